@@ -36,6 +36,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <pthread.h>
+#include <dirent.h>
 #include <time.h>
 #include "sqlfs.h"
 
@@ -56,6 +57,63 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 # include "sqlite3.h"
 #endif
 
+/* data following the last read of a connection, fetched ahead while its
+ * reads are sequential.  It is only used while the database is unchanged
+ * since it was fetched. */
+struct read_ahead
+{
+    char *path;
+    char *data;
+    size_t capacity;
+    size_t begin, end; /* file offsets held in data */
+    size_t next; /* where the next sequential read starts */
+    size_t window; /* bytes fetched beyond a read, 0 after random reads */
+    size_t filesize;
+    sqlite3_int64 data_version;
+    int changes;
+};
+
+/* small writes to an open file that are held back and stored together,
+ * see sqlfs_proc_write().  It hangs on the fh of the fuse_file_info from
+ * sqlfs_proc_open() or sqlfs_proc_create() to sqlfs_proc_release(), and is
+ * only used under write_back_lock, so the thread that stores it need not
+ * be the one that wrote. */
+struct write_back
+{
+    char *path; /* the file written to */
+    char *data;
+    size_t limit; /* bytes held at most */
+    unsigned int delay; /* milliseconds writes are held at most */
+    size_t begin, end; /* file offsets held in data */
+    size_t clean; /* data from begin up to here was loaded from the file */
+    int appends; /* the writes held were all appends */
+    size_t size; /* size of the file in the database, see write_back_check() */
+    unsigned long known_on; /* serial of the connection it was checked on */
+    sqlite3_int64 data_version; /* of that connection then */
+    int changes;
+    struct timeval since; /* when the first write held was made */
+    int error; /* -errno of writes that could not be stored */
+    int write_error; /* the same, until a write has returned it */
+    int released; /* released while the writes could not be stored */
+    struct write_back *next; /* in write_back_files */
+};
+
+/* a meta_data row, see get_meta() */
+struct meta_entry
+{
+    char *key; /* 0 for an empty slot */
+    int exists;
+    char *type;
+    mode_t mode;
+    uid_t uid;
+    gid_t gid;
+    time_t atime, mtime, ctime;
+    size_t size;
+    int inode;
+    int is_inline;
+    unsigned long gen; /* sqlfs_t meta_gen when it was looked up */
+};
+
 struct sqlfs_t
 {
     sqlite3 *db;
@@ -68,6 +126,26 @@ struct sqlfs_t
     uid_t uid;
     gid_t gid;
 #endif
+    size_t block_size; /* read from the superblock when connecting */
+    size_t inline_threshold; /* files up to this size live in meta_data */
+    int dedup; /* store identical blocks only once, see set_value_block() */
+    int codec; /* SQLFS_CODEC_* used to compress new blocks */
+    int cache_db; /* identifies the database in the block cache */
+    unsigned long cache_seq; /* block_cache_seq when the transaction began */
+    int cache_writing; /* the transaction changes blocks */
+    int read_transaction; /* the transaction was begun to read */
+    sqlite3_int64 data_version; /* PRAGMA data_version when the transaction began */
+    struct meta_entry *meta_cache; /* see get_meta() */
+    unsigned long meta_gen; /* entries of other generations are stale */
+    struct meta_entry meta_scratch; /* get_meta() outside a transaction */
+    int atime_mode; /* SQLFS_ATIME_*, when reads update atime */
+    int upsert; /* SQLite has INSERT ... ON CONFLICT DO UPDATE (3.24.0) */
+    struct read_ahead read_ahead; /* see sqlfs_proc_read() */
+    size_t write_back_size; /* bytes held back at most, 0 turns it off */
+    unsigned int write_back_delay; /* milliseconds writes are held back */
+    int write_back_storing; /* see write_back_enter() */
+    unsigned long serial; /* tells connections apart, see write_back_check() */
+    int group_writer; /* runs the calls queued by group_commit() */
 };
 
 
@@ -93,7 +171,51 @@ struct sqlfs_t
     else \
         get_sqlfs(sqlfs)->stmts[INDEX] = 0;
 
-static const size_t BLOCK_SIZE = 8192;
+/* value_data rows are keyed by block_id, the inode of their file in the
+ * upper 32 bits and the block number in the lower ones, so the blocks of a
+ * file are stored together and in order in the table b-tree itself.
+ * BLOCK_ID_RANGE() matches all the blocks of an inode given as SQL. */
+#define BLOCK_NO_MAX 0xffffffffULL
+#define BLOCK_ID_RANGE(inode) \
+    "between (" inode ") << 32 and ((" inode ") << 32) + 4294967295"
+
+static sqlite3_int64 block_id(int inode, size_t block_no)
+{
+    assert(block_no <= BLOCK_NO_MAX);
+    return ((sqlite3_int64) inode << 32) | (sqlite3_int64) block_no;
+}
+
+/* block size of databases created before it was stored in the superblock */
+static const size_t DEFAULT_BLOCK_SIZE = 8192;
+
+/* block size written to the superblock of newly created databases */
+static size_t new_db_block_size = 8192; /* see sqlfs_set_block_size() */
+
+static size_t default_inline_threshold = 1024; /* see sqlfs_set_inline_threshold() */
+
+static int default_dedup = 0; /* see sqlfs_set_dedup() */
+
+static int default_codec = SQLFS_CODEC_NONE; /* see sqlfs_set_codec() */
+static int default_atime_mode = SQLFS_ATIME_STRICT; /* see sqlfs_set_atime_mode() */
+static size_t default_write_back_size = 0; /* see sqlfs_set_write_back() */
+static unsigned int default_write_back_delay = 0;
+static size_t default_group_commit_ops = 0; /* see sqlfs_set_group_commit() */
+static unsigned int default_group_commit_delay = 0;
+
+/* open files with a write-back buffer, see write_back_enter() */
+static pthread_mutex_t write_back_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct write_back *write_back_files = 0;
+static unsigned long connection_serial = 0; /* given to the last connection */
+
+/* on-disk layout version, stored in "PRAGMA user_version".  0 is the
+ * original layout where value_data was keyed by the path text, 1 keys
+ * value_data by the inode of the file so renames only touch meta_data,
+ * 2 adds the dentry table of direct directory children, 3 adds the
+ * superblock table holding the block size, 4 adds inline_data to
+ * meta_data for small files, 5 adds the block_content table for
+ * deduplicated blocks, 6 adds the codec tag of compressed blocks, 7 keys
+ * value_data by block_id and drops the redundant indexes on meta_data */
+static const int LAYOUT_VERSION = 7;
 
 static pthread_key_t pthread_key;
 
@@ -106,10 +228,10 @@ static char default_db_file[PATH_MAX] = { 0 };
  * thread needs the key */
 static char cached_password[MAX_PASSWORD_LENGTH] = { 0 };
 
-static int max_inode = 0;
-
 static void * sqlfs_t_init(const char *db_file, const char *db_key);
 static void sqlfs_t_finalize(void *arg);
+static void write_back_store_all(sqlfs_t *sqlfs, struct write_back *except);
+static void write_back_open(sqlfs_t *sqlfs, const char *path, struct fuse_file_info *fi);
 
 static __inline__ int sql_step(sqlite3_stmt *stmt)
 {
@@ -138,11 +260,6 @@ static __inline__ sqlfs_t *get_sqlfs(sqlfs_t *p)
     return sqlfs;
 }
 
-static __inline__ int get_new_inode(void)
-{
-    return ++max_inode;
-}
-
 static __inline__ void remove_tail_slash(char *str)
 {
     char *s = str + strlen(str) - 1;
@@ -203,6 +320,493 @@ void clean_value(key_value *value)
     memset(value, 0, sizeof(*value));
 }
 
+/* Blocks read recently, shared by all the connections of the process.
+ * Entries are keyed by the database and the block_id of the block, and
+ * the least recently used ones are evicted once the cache holds more
+ * than block_cache_budget bytes.  Holes are cached as empty blocks.
+ * Every change to a block through any connection invalidates it, so the
+ * cache must not be used while other processes write to the database. */
+struct cache_block
+{
+    struct cache_block *hash_next, *lru_prev, *lru_next;
+    int db;
+    sqlite3_int64 block_id;
+    size_t size;
+    char data[];
+};
+
+/* the database files with connections open, told apart by device and
+ * inode so that every path to a file shares its blocks.  Each gets a new
+ * id when its first connection opens, blocks of a database replaced in
+ * between are never found. */
+struct cache_db
+{
+    struct cache_db *next;
+    dev_t dev;
+    ino_t ino;
+    int shared, id, connections;
+};
+
+#define BLOCK_CACHE_BUCKETS 16384
+
+static pthread_mutex_t block_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct cache_block *block_cache_table[BLOCK_CACHE_BUCKETS];
+static struct cache_block block_cache_lru = { 0, &block_cache_lru, &block_cache_lru };
+static struct cache_db *block_cache_dbs = 0;
+static int block_cache_next_db = 0;
+static size_t block_cache_budget = 0; /* see sqlfs_set_block_cache_size() */
+static size_t block_cache_used = 0;
+static size_t block_cache_hits = 0, block_cache_misses = 0;
+/* readers run alongside writers, so a block a reader fetched may already
+ * be outdated.  It is only cached when no transaction has changed blocks
+ * since the reader's began (block_cache_seq moves when one ends) and none
+ * is changing blocks now. */
+static unsigned long block_cache_seq = 0;
+static int block_cache_writers = 0;
+
+static size_t block_cache_bucket(int db, sqlite3_int64 id)
+{
+    uint64_t h = ((uint64_t) id ^ ((uint64_t) db << 48)) * 0x9e3779b97f4a7c15ULL;
+    return (size_t) (h >> 40) % BLOCK_CACHE_BUCKETS;
+}
+
+static struct cache_block *block_cache_find(int db, sqlite3_int64 id)
+{
+    struct cache_block *b = block_cache_table[block_cache_bucket(db, id)];
+    while (b && ((b->db != db) || (b->block_id != id)))
+        b = b->hash_next;
+    return b;
+}
+
+static void block_cache_remove(struct cache_block *b)
+{
+    struct cache_block **p = &block_cache_table[block_cache_bucket(b->db, b->block_id)];
+    while (*p != b)
+        p = &(*p)->hash_next;
+    *p = b->hash_next;
+    b->lru_prev->lru_next = b->lru_next;
+    b->lru_next->lru_prev = b->lru_prev;
+    block_cache_used -= sizeof(*b) + b->size;
+    free(b);
+}
+
+static void block_cache_evict(void)
+{
+    while ((block_cache_used > block_cache_budget) && (block_cache_lru.lru_prev != &block_cache_lru))
+        block_cache_remove(block_cache_lru.lru_prev);
+}
+
+/* copies size bytes from offset in a cached block to data, returns 0 if
+ * the block is not in the cache.  Bytes past the end of a short block are
+ * left alone. */
+static int block_cache_read(sqlfs_t *sqlfs, sqlite3_int64 id, char *data, size_t offset, size_t size)
+{
+    struct cache_block *b;
+
+    pthread_mutex_lock(&block_cache_lock);
+    b = block_cache_find(get_sqlfs(sqlfs)->cache_db, id);
+    if (b)
+    {
+        if (offset < b->size)
+            memcpy(data, b->data + offset, (offset + size < b->size) ? size : b->size - offset);
+        /* move it to the front of the LRU list */
+        b->lru_prev->lru_next = b->lru_next;
+        b->lru_next->lru_prev = b->lru_prev;
+        b->lru_next = block_cache_lru.lru_next;
+        b->lru_prev = &block_cache_lru;
+        b->lru_next->lru_prev = b;
+        block_cache_lru.lru_next = b;
+        block_cache_hits++;
+    }
+    else
+        block_cache_misses++;
+    pthread_mutex_unlock(&block_cache_lock);
+    return b != 0;
+}
+
+static void block_cache_put(sqlfs_t *sqlfs, sqlite3_int64 id, const char *data, size_t size)
+{
+    int db = get_sqlfs(sqlfs)->cache_db;
+    struct cache_block *b = malloc(sizeof(*b) + size);
+
+    if (!b)
+        return;
+    b->db = db;
+    b->block_id = id;
+    b->size = size;
+    memcpy(b->data, data, size);
+    pthread_mutex_lock(&block_cache_lock);
+    if ((block_cache_writers > 0) || (get_sqlfs(sqlfs)->cache_seq != block_cache_seq) ||
+        block_cache_find(db, id))
+    {
+        /* outdated, or another connection was quicker */
+        pthread_mutex_unlock(&block_cache_lock);
+        free(b);
+        return;
+    }
+    b->hash_next = block_cache_table[block_cache_bucket(db, id)];
+    block_cache_table[block_cache_bucket(db, id)] = b;
+    b->lru_next = block_cache_lru.lru_next;
+    b->lru_prev = &block_cache_lru;
+    b->lru_next->lru_prev = b;
+    block_cache_lru.lru_next = b;
+    block_cache_used += sizeof(*b) + size;
+    block_cache_evict();
+    pthread_mutex_unlock(&block_cache_lock);
+}
+
+static __inline__ int block_cache_active(void)
+{
+    return (block_cache_budget > 0) || (block_cache_used > 0);
+}
+
+/* drops the blocks first to last of a database from the cache, last == 0
+ * drops all of them.  The lock is held by the caller. */
+static void block_cache_drop(int db, sqlite3_int64 first, sqlite3_int64 last)
+{
+    struct cache_block *b, *next;
+
+    if ((first == last) && (last != 0))
+    {
+        b = block_cache_find(db, first);
+        if (b)
+            block_cache_remove(b);
+    }
+    else
+    {
+        for (b = block_cache_lru.lru_next; b != &block_cache_lru; b = next)
+        {
+            next = b->lru_next;
+            if ((b->db == db) && ((last == 0) || ((b->block_id >= first) && (b->block_id <= last))))
+                block_cache_remove(b);
+        }
+    }
+}
+
+/* drops blocks that the current transaction is about to change, see
+ * block_cache_drop().  Until the transaction ends nothing is cached. */
+static void block_cache_invalidate(sqlfs_t *sqlfs, sqlite3_int64 first, sqlite3_int64 last)
+{
+    if (!block_cache_active())
+        return;
+    pthread_mutex_lock(&block_cache_lock);
+    if (!get_sqlfs(sqlfs)->cache_writing)
+    {
+        get_sqlfs(sqlfs)->cache_writing = 1;
+        block_cache_writers++;
+    }
+    block_cache_drop(get_sqlfs(sqlfs)->cache_db, first, last);
+    pthread_mutex_unlock(&block_cache_lock);
+}
+
+/* called before a transaction starts and after it ended */
+static void block_cache_begin(sqlfs_t *sqlfs)
+{
+    if (!block_cache_active())
+        return;
+    pthread_mutex_lock(&block_cache_lock);
+    get_sqlfs(sqlfs)->cache_seq = block_cache_seq;
+    pthread_mutex_unlock(&block_cache_lock);
+}
+
+static void block_cache_end(sqlfs_t *sqlfs)
+{
+    if (!get_sqlfs(sqlfs)->cache_writing)
+        return;
+    pthread_mutex_lock(&block_cache_lock);
+    get_sqlfs(sqlfs)->cache_writing = 0;
+    block_cache_writers--;
+    block_cache_seq++;
+    pthread_mutex_unlock(&block_cache_lock);
+}
+
+static void block_cache_attach(sqlfs_t *sqlfs, const char *db_file)
+{
+    struct cache_db *d = 0;
+    struct stat st;
+    int shared = (stat(db_file, &st) == 0);
+
+    pthread_mutex_lock(&block_cache_lock);
+    if (shared)
+        for (d = block_cache_dbs; d && !(d->shared && (d->dev == st.st_dev) && (d->ino == st.st_ino)); d = d->next)
+            ;
+    if (!d)
+    {
+        /* in-memory and temporary databases are private to the connection */
+        d = calloc(1, sizeof(*d));
+        assert(d);
+        d->shared = shared;
+        if (shared)
+        {
+            d->dev = st.st_dev;
+            d->ino = st.st_ino;
+        }
+        d->id = ++block_cache_next_db;
+        d->next = block_cache_dbs;
+        block_cache_dbs = d;
+    }
+    d->connections++;
+    sqlfs->cache_db = d->id;
+    pthread_mutex_unlock(&block_cache_lock);
+}
+
+static void block_cache_detach(sqlfs_t *sqlfs)
+{
+    struct cache_db **p, *d;
+    int unused = 0;
+
+    pthread_mutex_lock(&block_cache_lock);
+    for (p = &block_cache_dbs; *p && ((*p)->id != sqlfs->cache_db); p = &(*p)->next)
+        ;
+    d = *p;
+    if (d && (--d->connections == 0))
+    {
+        *p = d->next;
+        free(d);
+        unused = 1;
+    }
+    if (unused)
+        block_cache_drop(sqlfs->cache_db, 0, 0);
+    pthread_mutex_unlock(&block_cache_lock);
+}
+
+/* meta_data rows a connection looked up, in a direct mapped table of
+ * META_CACHE_SIZE slots, including keys that do not exist.  Entries are
+ * only used inside a transaction: the table is emptied when it begins if
+ * another connection committed since the last one, and the rows this
+ * connection writes are dropped as it writes them.  Emptying the table
+ * only moves on meta_gen, which makes every entry of an older one stale. */
+#define META_CACHE_SIZE 1024
+
+static void meta_cache_flush(sqlfs_t *sqlfs)
+{
+    get_sqlfs(sqlfs)->meta_gen++;
+}
+
+static struct meta_entry *meta_cache_slot(sqlfs_t *sqlfs, const char *key)
+{
+    uint32_t h = 2166136261U;
+    const unsigned char *p;
+
+    for (p = (const unsigned char *) key; *p; p++)
+        h = (h ^ *p) * 16777619U;
+    return &get_sqlfs(sqlfs)->meta_cache[h % META_CACHE_SIZE];
+}
+
+/* the current entry of a key, 0 if there is none */
+static struct meta_entry *meta_cache_find(sqlfs_t *sqlfs, const char *key)
+{
+    struct meta_entry *e;
+
+    if (!get_sqlfs(sqlfs)->meta_cache)
+        return 0;
+    e = meta_cache_slot(sqlfs, key);
+    if (e->key && (e->gen == get_sqlfs(sqlfs)->meta_gen) && !strcmp(e->key, key))
+        return e;
+    return 0;
+}
+
+static void meta_cache_alloc(sqlfs_t *sqlfs)
+{
+    if (!get_sqlfs(sqlfs)->meta_cache)
+    {
+        get_sqlfs(sqlfs)->meta_cache = calloc(META_CACHE_SIZE, sizeof(struct meta_entry));
+        assert(get_sqlfs(sqlfs)->meta_cache);
+    }
+}
+
+/* drops the entry of a key this connection is changing */
+static void meta_cache_forget(sqlfs_t *sqlfs, const char *key)
+{
+    struct meta_entry *e = meta_cache_find(sqlfs, key);
+
+    if (e)
+        e->gen--;
+}
+
+#undef INDEX
+#define INDEX 43
+
+/* reads PRAGMA data_version at the start of a transaction.  It changes
+ * whenever another connection commits, which makes the cached meta_data
+ * rows outdated. */
+static void meta_cache_check(sqlfs_t *sqlfs)
+{
+    int r;
+    const char *tail;
+    sqlite3_stmt *stmt;
+    sqlite3_int64 version = -1;
+    static const char *cmd = "pragma data_version;";
+
+    SQLITE3_PREPARE(get_sqlfs(sqlfs)->db, cmd, -1, &stmt,  &tail);
+    if (r != SQLITE_OK)
+        show_msg(stderr, "%s\n", sqlite3_errmsg(get_sqlfs(sqlfs)->db));
+    else
+    {
+        if (sql_step(stmt) == SQLITE_ROW)
+            version = sqlite3_column_int64(stmt, 0);
+        sqlite3_reset(stmt);
+    }
+    if ((version < 0) || (version != get_sqlfs(sqlfs)->data_version))
+        meta_cache_flush(sqlfs);
+    get_sqlfs(sqlfs)->data_version = version;
+}
+
+/* the columns of meta_data kept in a struct meta_entry, as SQL */
+#define META_COLUMNS(m) m "type, " m "mode, " m "uid, " m "gid, " m "atime, " m "mtime, " \
+    m "ctime, " m "size, " m "inode, " m "inline_data is not null"
+
+/* sets *e to the row of key whose META_COLUMNS start at column col of
+ * stmt, or to a key that does not exist if stmt is 0 */
+static void meta_entry_set(sqlfs_t *sqlfs, struct meta_entry *e, const char *key,
+                           sqlite3_stmt *stmt, int col)
+{
+    free(e->key);
+    free(e->type);
+    memset(e, 0, sizeof(*e));
+    e->gen = get_sqlfs(sqlfs)->meta_gen;
+    if (stmt)
+    {
+        e->exists = 1;
+        e->type = make_str_copy((const char *) sqlite3_column_text(stmt, col));
+        e->mode = (mode_t) sqlite3_column_int(stmt, col + 1);
+        e->uid = (uid_t) sqlite3_column_int(stmt, col + 2);
+        e->gid = (gid_t) sqlite3_column_int(stmt, col + 3);
+        e->atime = sqlite3_column_int(stmt, col + 4);
+        e->mtime = sqlite3_column_int(stmt, col + 5);
+        e->ctime = sqlite3_column_int(stmt, col + 6);
+        e->size = sqlite3_column_int64(stmt, col + 7);
+        e->inode = sqlite3_column_int(stmt, col + 8);
+        e->is_inline = sqlite3_column_int(stmt, col + 9);
+    }
+    e->key = strdup(key);
+}
+
+#undef INDEX
+#define INDEX 47
+
+/* looks up the meta_data row of a key.  *entry stays valid until the next
+ * call, its exists field says whether the key was found. */
+static int get_meta(sqlfs_t *sqlfs, const char *key, struct meta_entry **entry)
+{
+    int r;
+    const char *tail;
+    sqlite3_stmt *stmt;
+    struct meta_entry *e;
+    static const char *cmd = "select " META_COLUMNS("") " from meta_data where key = :key;";
+
+    if (get_sqlfs(sqlfs)->in_transaction)
+    {
+        meta_cache_alloc(sqlfs);
+        e = meta_cache_find(sqlfs, key);
+        if (e)
+        {
+            *entry = e;
+            return SQLITE_OK;
+        }
+        e = meta_cache_slot(sqlfs, key);
+    }
+    else
+    {
+        /* outside a transaction there is nothing keeping it current */
+        e = &get_sqlfs(sqlfs)->meta_scratch;
+    }
+
+    SQLITE3_PREPARE(get_sqlfs(sqlfs)->db, cmd, -1, &stmt,  &tail);
+    if (r != SQLITE_OK)
+    {
+        show_msg(stderr, "%s\n", sqlite3_errmsg(get_sqlfs(sqlfs)->db));
+        return r;
+    }
+    sqlite3_bind_text(stmt, 1, key, -1, SQLITE_STATIC);
+    r = sql_step(stmt);
+    if ((r != SQLITE_ROW) && (r != SQLITE_DONE))
+    {
+        show_msg(stderr, "%s\n", sqlite3_errmsg(get_sqlfs(sqlfs)->db));
+        sqlite3_reset(stmt);
+        return r;
+    }
+    meta_entry_set(sqlfs, e, key, (r == SQLITE_ROW) ? stmt : 0, 0);
+    sqlite3_reset(stmt);
+    *entry = e;
+    return SQLITE_OK;
+}
+
+#undef INDEX
+#define INDEX 48
+
+/* how many keys get_meta_ancestors() looks up per query */
+#define META_ANCESTORS 16
+
+/* puts the rows of the root, of every directory below it on the way to
+ * key and of key itself in the cache, missing ones included.  A query
+ * fetches META_ANCESTORS of them at a time.  Only inside a transaction. */
+static int get_meta_ancestors(sqlfs_t *sqlfs, const char *key)
+{
+    int r, n, j;
+    const char *tail;
+    sqlite3_stmt *stmt;
+    size_t i, len = strlen(key), ends[META_ANCESTORS];
+    int found[META_ANCESTORS];
+    char prefix[PATH_MAX];
+    /* an OR of equalities runs as one index lookup each, unlike an IN
+     * list, which gets sorted first */
+    static const char *cmd = "select key, " META_COLUMNS("") " from meta_data where "
+                             "key = ?1 or key = ?2 or key = ?3 or key = ?4 or key = ?5 or "
+                             "key = ?6 or key = ?7 or key = ?8 or key = ?9 or key = ?10 or "
+                             "key = ?11 or key = ?12 or key = ?13 or key = ?14 or key = ?15 or "
+                             "key = ?16;";
+
+    assert(get_sqlfs(sqlfs)->in_transaction);
+    meta_cache_alloc(sqlfs);
+    SQLITE3_PREPARE(get_sqlfs(sqlfs)->db, cmd, -1, &stmt,  &tail);
+    if (r != SQLITE_OK)
+    {
+        show_msg(stderr, "%s\n", sqlite3_errmsg(get_sqlfs(sqlfs)->db));
+        return r;
+    }
+    i = 1;
+    while ((r == SQLITE_OK) && (i <= len))
+    {
+        /* the prefixes of key ending before a '/', the root being "/" */
+        for (n = 0; (n < META_ANCESTORS) && (i <= len); i++)
+            if ((i == 1) || (key[i] == '/') || (key[i] == 0))
+                ends[n++] = i;
+        for (j = 0; j < META_ANCESTORS; j++)
+        {
+            found[j] = 0;
+            if (j < n)
+                sqlite3_bind_text(stmt, j + 1, key, ends[j], SQLITE_STATIC);
+            else
+                sqlite3_bind_null(stmt, j + 1);
+        }
+        while ((r = sql_step(stmt)) == SQLITE_ROW)
+        {
+            const char *k = (const char *) sqlite3_column_text(stmt, 0);
+            meta_entry_set(sqlfs, meta_cache_slot(sqlfs, k), k, stmt, 1);
+            for (j = 0; j < n; j++)
+                if (strlen(k) == ends[j])
+                    found[j] = 1;
+        }
+        sqlite3_reset(stmt);
+        if (r != SQLITE_DONE)
+        {
+            show_msg(stderr, "%s\n", sqlite3_errmsg(get_sqlfs(sqlfs)->db));
+            break;
+        }
+        r = SQLITE_OK;
+        for (j = 0; j < n; j++)
+        {
+            if (found[j])
+                continue;
+            memcpy(prefix, key, ends[j]);
+            prefix[ends[j]] = 0;
+            meta_entry_set(sqlfs, meta_cache_slot(sqlfs, prefix), prefix, 0, 0);
+        }
+    }
+    return r;
+}
+
 #undef INDEX
 #define INDEX 100
 
@@ -220,6 +824,8 @@ static int begin_transaction(sqlfs_t *sqlfs)
     if (get_sqlfs(sqlfs)->transaction_level == 0)
     {
         int i;
+        write_back_store_all(sqlfs, 0);
+        block_cache_begin(sqlfs);
         SQLITE3_PREPARE(get_sqlfs(sqlfs)->db, cmd, -1,  &stmt,  &tail);
         for (i = 0; i < 10; i++)
         {
@@ -236,6 +842,50 @@ static int begin_transaction(sqlfs_t *sqlfs)
             return r;  /* busy, return back */
         }
         get_sqlfs(sqlfs)->in_transaction = 1;
+        meta_cache_check(sqlfs);
+    }
+    get_sqlfs(sqlfs)->transaction_level++;
+    return r;
+}
+
+#undef INDEX
+#define INDEX 45
+
+/* begins a transaction for an operation that only reads.  Unless reads
+ * have to record the access time every time, it is a deferred one: it
+ * takes no lock, so readers on other connections run alongside it and
+ * alongside a writer, each on its own snapshot of the database. */
+static int begin_read_transaction(sqlfs_t *sqlfs)
+{
+    const char *cmd = "begin deferred;";
+
+    sqlite3_stmt *stmt;
+    const char *tail;
+    int r = SQLITE_OK;
+
+    if (get_sqlfs(sqlfs)->atime_mode == SQLFS_ATIME_STRICT)
+        return begin_transaction(sqlfs);
+    if (get_sqlfs(sqlfs)->transaction_level == 0)
+    {
+        write_back_store_all(sqlfs, 0);
+        block_cache_begin(sqlfs);
+        SQLITE3_PREPARE(get_sqlfs(sqlfs)->db, cmd, -1,  &stmt,  &tail);
+        if (r != SQLITE_OK)
+        {
+            show_msg(stderr, "%s\n", sqlite3_errmsg(get_sqlfs(sqlfs)->db));
+            return r;
+        }
+        r = sqlite3_step(stmt);
+        sqlite3_reset(stmt);
+        if (r != SQLITE_DONE)
+        {
+            show_msg(stderr, "%s\n", sqlite3_errmsg(get_sqlfs(sqlfs)->db));
+            return r;
+        }
+        r = SQLITE_OK;
+        get_sqlfs(sqlfs)->in_transaction = 1;
+        get_sqlfs(sqlfs)->read_transaction = 1;
+        meta_cache_check(sqlfs);
     }
     get_sqlfs(sqlfs)->transaction_level++;
     return r;
@@ -290,6 +940,15 @@ static int commit_transaction(sqlfs_t *sqlfs, int r0)
         }
         //**assert(sqlite3_get_autocommit(get_sqlfs(sqlfs)->db) != 0);*/
         get_sqlfs(sqlfs)->in_transaction = 0;
+        get_sqlfs(sqlfs)->read_transaction = 0;
+        block_cache_end(sqlfs);
+        /* data read ahead inside the transaction is gone now, and so
+         * are the rows it looked up */
+        if (r0 == 0)
+        {
+            get_sqlfs(sqlfs)->read_ahead.end = 0;
+            meta_cache_flush(sqlfs);
+        }
     }
     get_sqlfs(sqlfs)->transaction_level--;
 
@@ -344,6 +1003,15 @@ static int break_transaction(sqlfs_t *sqlfs, int r0)
         }
         //**assert(sqlite3_get_autocommit(get_sqlfs(sqlfs)->db) != 0);*/
         get_sqlfs(sqlfs)->in_transaction = 0;
+        get_sqlfs(sqlfs)->read_transaction = 0;
+        block_cache_end(sqlfs);
+        /* data read ahead inside the transaction is gone now, and so
+         * are the rows it looked up */
+        if (r0 == 0)
+        {
+            get_sqlfs(sqlfs)->read_ahead.end = 0;
+            meta_cache_flush(sqlfs);
+        }
     }
 
     return r;
@@ -384,84 +1052,155 @@ static __inline__ int get_current_max_inode(sqlfs_t *sqlfs)
     return result;
 }
 
-
-#undef INDEX
-#define INDEX 2
+/* the data blocks are keyed by inode, so inode numbers have to be unique
+ * across every connection to the database, not just this process.  All
+ * callers hold the write lock here, so the max() is stable until the new
+ * meta_data row is inserted. */
+static __inline__ int get_new_inode(sqlfs_t *sqlfs)
+{
+    return get_current_max_inode(sqlfs) + 1;
+}
 
 
 static int key_exists(sqlfs_t *sqlfs, const char *key, size_t *size)
 {
-    sqlite3_stmt *stmt;
-    const char *tail;
-    static const char *cmd = "select size from meta_data where key = :key;";
-    int r, result = 0;
-    SQLITE3_PREPARE(get_sqlfs(sqlfs)->db, cmd, -1,  &stmt,  &tail);
+    struct meta_entry *e;
+    int r;
+
+    r = get_meta(sqlfs, key, &e);
     if (r != SQLITE_OK)
-    {
-        show_msg(stderr, "%s\n", sqlite3_errmsg(get_sqlfs(sqlfs)->db));
+        return (r == SQLITE_BUSY) ? 2 : 0;
+    if (!e->exists)
         return 0;
-    }
+    if (size)
+        *size = e->size;
+    return 1;
+}
 
+/* same as key_exists(), but also returns the inode that the data blocks
+ * of the key are stored under */
+static int get_key_inode(sqlfs_t *sqlfs, const char *key, int *inode, size_t *size)
+{
+    struct meta_entry *e;
+    int r;
 
-    sqlite3_bind_text(stmt, 1, key, -1, SQLITE_STATIC);
-    r = sql_step(stmt);
-    if (r != SQLITE_ROW)
-    {
-        if (r != SQLITE_DONE)
+    r = get_meta(sqlfs, key, &e);
+    if (r != SQLITE_OK)
+        return (r == SQLITE_BUSY) ? 2 : 0;
+    if (!e->exists)
+        return 0;
+    if (inode)
+        *inode = e->inode;
+    if (size)
+        *size = e->size;
+    return 1;
+}
+
+#undef INDEX
+#define INDEX 34
+
+/* same as get_key_inode(), but also returns a copy of the data of a file
+ * stored inline in its meta_data row in *data, which the caller has to
+ * free().  *data is 0 if the file keeps its data in value_data blocks. */
+static int get_key_inline_data(sqlfs_t *sqlfs, const char *key, int *inode, size_t *size,
+                               char **data, size_t *data_size)
+{
+    sqlite3_stmt *stmt;
+    const char *tail;
+    static const char *cmd = "select inode, size, inline_data from meta_data where key = :key;";
+    int r, result = 0;
+
+    *data = 0;
+    *data_size = 0;
+    SQLITE3_PREPARE(get_sqlfs(sqlfs)->db, cmd, -1,  &stmt,  &tail);
+    if (r != SQLITE_OK)
+    {
+        show_msg(stderr, "%s\n", sqlite3_errmsg(get_sqlfs(sqlfs)->db));
+        return 0;
+    }
+
+    sqlite3_bind_text(stmt, 1, key, -1, SQLITE_STATIC);
+    r = sql_step(stmt);
+    if (r != SQLITE_ROW)
+    {
+        if (r != SQLITE_DONE)
             show_msg(stderr, "%s\n", sqlite3_errmsg(get_sqlfs(sqlfs)->db));
         if (r == SQLITE_BUSY)
             result = 2;
     }
-
     else
     {
+        if (inode)
+            *inode = sqlite3_column_int(stmt, 0);
         if (size)
-            *size = sqlite3_column_int64(stmt, 0);
+            *size = sqlite3_column_int64(stmt, 1);
+        if (sqlite3_column_type(stmt, 2) != SQLITE_NULL)
+        {
+            *data_size = sqlite3_column_bytes(stmt, 2);
+            *data = malloc(*data_size + 1);
+            assert(*data);
+            memcpy(*data, sqlite3_column_blob(stmt, 2), *data_size);
+        }
         result = 1;
     }
     sqlite3_reset(stmt);
     return result;
-
 }
 
 #undef INDEX
-#define INDEX 3
+#define INDEX 35
 
-
-static int key_is_dir(sqlfs_t *sqlfs, const char *key)
+/* stores the whole content of a small file in its meta_data row, or moves
+ * it out of there when data is 0 */
+static int set_inline_data(sqlfs_t *sqlfs, const char *key, const char *data, size_t size)
 {
     sqlite3_stmt *stmt;
-    const char *tail, *t;
-    static const char *cmd = "select type from meta_data where key = :key;";
-    int r, result = 0;
+    const char *tail;
+    time_t now;
+    static const char *cmd = "update meta_data set inline_data = :data, size = coalesce(:size, size), "
+                             "atime = :atime, mtime = :mtime, ctime = :ctime where key = :key;";
+    int r;
+
+    time(&now);
     SQLITE3_PREPARE(get_sqlfs(sqlfs)->db, cmd, -1,  &stmt,  &tail);
     if (r != SQLITE_OK)
     {
         show_msg(stderr, "%s\n", sqlite3_errmsg(get_sqlfs(sqlfs)->db));
         return r;
     }
-
-    sqlite3_bind_text(stmt, 1, key, -1, SQLITE_STATIC);
-    r = sql_step(stmt);
-    if (r != SQLITE_ROW)
+    if (data)
     {
-        if (r != SQLITE_DONE)
-            show_msg(stderr, "%s\n", sqlite3_errmsg(get_sqlfs(sqlfs)->db));
-        if (r == SQLITE_BUSY)
-            result = 2;
+        sqlite3_bind_blob(stmt, 1, data, size, SQLITE_STATIC);
+        sqlite3_bind_int64(stmt, 2, size);
     }
-
     else
     {
-        t = (const char *)sqlite3_column_text(stmt, 0);
-
-        if (t && !strcmp(TYPE_DIR, t))
-            result = 1;
-
+        sqlite3_bind_null(stmt, 1);
+        sqlite3_bind_null(stmt, 2);
     }
+    sqlite3_bind_int64(stmt, 3, now);
+    sqlite3_bind_int64(stmt, 4, now);
+    sqlite3_bind_int64(stmt, 5, now);
+    sqlite3_bind_text(stmt, 6, key, -1, SQLITE_STATIC);
+    r = sql_step(stmt);
+    if (r != SQLITE_DONE)
+        show_msg(stderr, "%s\n", sqlite3_errmsg(get_sqlfs(sqlfs)->db));
+    else
+        r = SQLITE_OK;
     sqlite3_reset(stmt);
-    return result;
+    meta_cache_forget(sqlfs, key);
+    return r;
+}
 
+static int key_is_dir(sqlfs_t *sqlfs, const char *key)
+{
+    struct meta_entry *e;
+    int r;
+
+    r = get_meta(sqlfs, key, &e);
+    if (r != SQLITE_OK)
+        return (r == SQLITE_BUSY) ? 2 : 0;
+    return e->exists && e->type && !strcmp(TYPE_DIR, e->type);
 }
 
 
@@ -473,11 +1212,46 @@ static int key_accessed(sqlfs_t *sqlfs, const char *key)
     sqlite3_stmt *stmt;
     const char *tail;
     static const char *cmd = "update meta_data set atime = :atime where key = :key;";
+    /* relatime: only when the access time is not after the last
+     * modification, or is more than a day old */
+    static const char *cmd1 = "update meta_data set atime = :atime where key = :key and "
+                              "(atime is null or atime <= mtime or atime <= :atime - 86400);";
+    static const char *cmd2 = "select 1 from meta_data where key = :key and "
+                              "(atime is null or atime <= mtime or atime <= :atime - 86400);";
     int r;
     time_t now;
 
+    if (get_sqlfs(sqlfs)->atime_mode == SQLFS_ATIME_NOATIME)
+        return SQLITE_OK;
     time(&now);
-    SQLITE3_PREPARE(get_sqlfs(sqlfs)->db, cmd, -1,  &stmt,  &tail);
+    if (get_sqlfs(sqlfs)->atime_mode == SQLFS_ATIME_RELATIME)
+    {
+        /* look first, the update would take the write lock even when it
+         * has nothing to do */
+#undef INDEX
+#define INDEX 46
+        SQLITE3_PREPARE(get_sqlfs(sqlfs)->db, cmd2, -1,  &stmt,  &tail);
+        if (r != SQLITE_OK)
+        {
+            show_msg(stderr, "%s\n", sqlite3_errmsg(get_sqlfs(sqlfs)->db));
+            return r;
+        }
+        sqlite3_bind_text(stmt, 1, key, -1, SQLITE_STATIC);
+        sqlite3_bind_int64(stmt, 2, now);
+        r = sql_step(stmt);
+        sqlite3_reset(stmt);
+        if (r != SQLITE_ROW)
+            return (r == SQLITE_DONE) ? SQLITE_OK : r;
+#undef INDEX
+#define INDEX 44
+        SQLITE3_PREPARE(get_sqlfs(sqlfs)->db, cmd1, -1,  &stmt,  &tail);
+    }
+    else
+    {
+#undef INDEX
+#define INDEX 4
+        SQLITE3_PREPARE(get_sqlfs(sqlfs)->db, cmd, -1,  &stmt,  &tail);
+    }
     if (r != SQLITE_OK)
     {
         show_msg(stderr, "%s\n", sqlite3_errmsg(get_sqlfs(sqlfs)->db));
@@ -487,7 +1261,20 @@ static int key_accessed(sqlfs_t *sqlfs, const char *key)
     r = sqlite3_bind_int64(stmt, 1, now);
     r = sqlite3_bind_text(stmt, 2, key, -1, SQLITE_STATIC);
     r = sqlite3_step(stmt);
-    if (r != SQLITE_DONE)
+    if ((r == SQLITE_DONE) && sqlite3_changes(get_sqlfs(sqlfs)->db))
+    {
+        struct meta_entry *e = meta_cache_find(sqlfs, key);
+        if (e)
+            e->atime = now;
+    }
+    if ((r == SQLITE_BUSY) && get_sqlfs(sqlfs)->read_transaction)
+    {
+        /* a reader's snapshot is outdated once another connection has
+         * written, it cannot write itself then.  The next read records
+         * the access. */
+        r = SQLITE_OK;
+    }
+    else if (r != SQLITE_DONE)
     {
         show_msg(stderr, "%s\n", sqlite3_errmsg(get_sqlfs(sqlfs)->db));
 
@@ -532,6 +1319,7 @@ static int key_modified(sqlfs_t *sqlfs, const char *key)
     else
         r = SQLITE_OK;
     sqlite3_reset(stmt);
+    meta_cache_forget(sqlfs, key);
     return r;
 }
 
@@ -546,9 +1334,17 @@ static int remove_key(sqlfs_t *sqlfs, const char *key)
     int r;
     const char *tail;
     sqlite3_stmt *stmt;
-    static const char *cmd1 = "delete from meta_data where key = :key;";
-    static const char *cmd2 = "delete from value_data where key = :key;" ;
+    static const char *cmd1 = "delete from value_data where block_id "
+                              BLOCK_ID_RANGE("select inode from meta_data where key = :key") ";" ;
+    static const char *cmd2 = "delete from meta_data where key = :key;";
     begin_transaction(get_sqlfs(sqlfs));
+    if (block_cache_active())
+    {
+        /* the inode is reused by the next file created */
+        int inode;
+        if (get_key_inode(sqlfs, key, &inode, NULL) == 1)
+            block_cache_invalidate(sqlfs, block_id(inode, 0), block_id(inode, BLOCK_NO_MAX));
+    }
     SQLITE3_PREPARE(get_sqlfs(sqlfs)->db, cmd1, -1, &stmt, &tail);
     if (r != SQLITE_OK)
     {
@@ -592,6 +1388,7 @@ static int remove_key(sqlfs_t *sqlfs, const char *key)
             r = SQLITE_OK;
         }
         sqlite3_reset(stmt);
+        meta_cache_forget(sqlfs, key);
     }
     commit_transaction(get_sqlfs(sqlfs), 1);
     return r;
@@ -610,8 +1407,10 @@ static int remove_key_subtree(sqlfs_t *sqlfs, const char *key)
     const char *tail;
     sqlite3_stmt *stmt;
     char pattern[PATH_MAX];
-    static const char *cmd1 = "delete from meta_data where key glob :pattern;";
-    static const char *cmd2 = "delete from value_data where key glob :pattern;" ;
+    static const char *cmd1 = "delete from value_data where block_id in (select v.block_id "
+                              "from meta_data m join value_data v on v.block_id " BLOCK_ID_RANGE("m.inode") " "
+                              "where m.key glob :pattern);" ;
+    static const char *cmd2 = "delete from meta_data where key glob :pattern;";
     char *lpath;
 
     lpath = strdup(key);
@@ -619,6 +1418,8 @@ static int remove_key_subtree(sqlfs_t *sqlfs, const char *key)
     sprintf(pattern, "%s/*", lpath);
     free(lpath);
     begin_transaction(get_sqlfs(sqlfs));
+    block_cache_invalidate(sqlfs, 0, 0);
+    meta_cache_flush(sqlfs);
     SQLITE3_PREPARE(get_sqlfs(sqlfs)->db, cmd1, -1, &stmt, &tail);
     if (r != SQLITE_OK)
     {
@@ -684,8 +1485,10 @@ static int remove_key_subtree_with_exclusion(sqlfs_t *sqlfs, const char *key, co
     sqlite3_stmt *stmt;
     char pattern[PATH_MAX];
     char n_pattern[PATH_MAX];
-    static const char *cmd1 = "delete from meta_data where (key glob :pattern) and not (key glob :n_pattern) ;";
-    static const char *cmd2 = "delete from value_data where (key glob :pattern) and not (key glob :n_pattern) ;" ;
+    static const char *cmd1 = "delete from value_data where block_id in (select v.block_id "
+                              "from meta_data m join value_data v on v.block_id " BLOCK_ID_RANGE("m.inode") " "
+                              "where (m.key glob :pattern) and not (m.key glob :n_pattern)) ;" ;
+    static const char *cmd2 = "delete from meta_data where (key glob :pattern) and not (key glob :n_pattern) ;";
     static const char *cmd3 = "select key from meta_data where (key glob :n_pattern) ;" ;
     char *lpath;
 
@@ -696,6 +1499,8 @@ static int remove_key_subtree_with_exclusion(sqlfs_t *sqlfs, const char *key, co
     snprintf(n_pattern, sizeof(n_pattern), "%s/%s", lpath, exclusion_pattern);
     free(lpath);
     begin_transaction(get_sqlfs(sqlfs));
+    block_cache_invalidate(sqlfs, 0, 0);
+    meta_cache_flush(sqlfs);
     SQLITE3_PREPARE(get_sqlfs(sqlfs)->db, cmd1, -1, &stmt, &tail);
     if (r != SQLITE_OK)
     {
@@ -729,6 +1534,7 @@ static int remove_key_subtree_with_exclusion(sqlfs_t *sqlfs, const char *key, co
             return r;
         }
         sqlite3_bind_text(stmt, 1, pattern, -1, SQLITE_STATIC);
+        sqlite3_bind_text(stmt, 2, n_pattern, -1, SQLITE_STATIC);
         r = sql_step(stmt);
         if (r != SQLITE_DONE)
         {
@@ -790,10 +1596,10 @@ static int rename_key(sqlfs_t *sqlfs, const char *old, const char *new)
     int r;
     const char *tail;
     sqlite3_stmt *stmt;
-    static const char *cmd1 = "update meta_data set key = :new where key = :old; ";
-    static const char *cmd2 = "update value_data set key = :new where key = :old; ";
+    /* the data blocks are keyed by inode, so only the path changes */
+    static const char *cmd = "update meta_data set key = :new where key = :old; ";
     begin_transaction(get_sqlfs(sqlfs));
-    SQLITE3_PREPARE(get_sqlfs(sqlfs)->db, cmd1, -1, &stmt,  &tail);
+    SQLITE3_PREPARE(get_sqlfs(sqlfs)->db, cmd, -1, &stmt,  &tail);
     if (r != SQLITE_OK)
     {
         show_msg(stderr, "%s\n", sqlite3_errmsg(get_sqlfs(sqlfs)->db));
@@ -812,35 +1618,8 @@ static int rename_key(sqlfs_t *sqlfs, const char *old, const char *new)
         r = SQLITE_OK;
     }
     sqlite3_reset(stmt);
-
-
-
-#undef INDEX
-#define INDEX 14
-
-
-    if (r == SQLITE_OK)
-    {
-        SQLITE3_PREPARE(get_sqlfs(sqlfs)->db, cmd2, -1, &stmt,  &tail);
-        if (r != SQLITE_OK)
-        {
-            show_msg(stderr, "%s\n", sqlite3_errmsg(get_sqlfs(sqlfs)->db));
-            commit_transaction(get_sqlfs(sqlfs), 1);
-            return r;
-        }
-        sqlite3_bind_text(stmt, 1, new, -1, SQLITE_STATIC);
-        sqlite3_bind_text(stmt, 2, old, -1, SQLITE_STATIC);
-        r = sql_step(stmt);
-        if (r != SQLITE_DONE)
-        {
-            show_msg(stderr, "%s\n", sqlite3_errmsg(get_sqlfs(sqlfs)->db));
-        }
-        else
-        {
-            r = SQLITE_OK;
-        }
-        sqlite3_reset(stmt);
-    }
+    meta_cache_forget(sqlfs, old);
+    meta_cache_forget(sqlfs, new);
     commit_transaction(get_sqlfs(sqlfs), 1);
     return r;
 
@@ -854,10 +1633,10 @@ static int get_dir_children_num(sqlfs_t *sqlfs, const char *path)
 {
     int i, r, count = 0;
     const char *tail;
-    const char *t, *t2;
     char *lpath = 0;
-    static const char *cmd = "select key from meta_data where key glob :pattern; ";
-    char tmp[PATH_MAX];
+    /* dentry only holds the direct children, so this costs O(children) */
+    static const char *cmd = "select count(*) from dentry where parent = "
+                             "(select inode from meta_data where key = :key); ";
     sqlite3_stmt *stmt;
 
     i = key_is_dir(sqlfs, path);
@@ -868,7 +1647,6 @@ static int get_dir_children_num(sqlfs_t *sqlfs, const char *path)
 
     lpath = strdup(path);
     remove_tail_slash(lpath);
-    snprintf(tmp, sizeof(tmp), "%s/*", lpath);
     SQLITE3_PREPARE(get_sqlfs(sqlfs)->db, cmd, -1, &stmt,  &tail);
     if (r != SQLITE_OK)
     {
@@ -876,31 +1654,12 @@ static int get_dir_children_num(sqlfs_t *sqlfs, const char *path)
     }
     else
     {
-        sqlite3_bind_text(stmt, 1, tmp, -1, SQLITE_STATIC);
-
-        while (1)
-        {
-            r = sql_step(stmt);
-            if (r == SQLITE_ROW)
-            {
-                t = (const char *)sqlite3_column_text(stmt, 0);
-                t2 = t + strlen(tmp) - 1;
-                if (strchr(t2, '/'))
-                    continue; /* grand child, etc. */
-                count++;
-
-            }
-            else if (r == SQLITE_DONE)
-            {
-                break;
-            }
-            else
-            {
-                show_msg(stderr, "%s\n", sqlite3_errmsg(get_sqlfs(sqlfs)->db));
-
-                break;
-            }
-        }
+        sqlite3_bind_text(stmt, 1, *lpath ? lpath : "/", -1, SQLITE_STATIC);
+        r = sql_step(stmt);
+        if (r == SQLITE_ROW)
+            count = sqlite3_column_int(stmt, 0);
+        else if (r != SQLITE_BUSY)
+            show_msg(stderr, "%s\n", sqlite3_errmsg(get_sqlfs(sqlfs)->db));
         sqlite3_reset(stmt);
     }
     free(lpath);
@@ -915,6 +1674,7 @@ static int set_attr(sqlfs_t *sqlfs, const char *key, const key_attr *attr);
 
 static int ensure_existence(sqlfs_t *sqlfs, const char *key, const char *type)
 {
+    begin_transaction(get_sqlfs(sqlfs));
     if (key_exists(sqlfs, key, 0) == 0)
     {
         int r;
@@ -930,16 +1690,15 @@ static int ensure_existence(sqlfs_t *sqlfs, const char *key, const char *type)
         attr.gid = get_sqlfs(sqlfs)->gid;
 
 #endif
-        attr.inode = get_new_inode();
+        attr.inode = get_new_inode(sqlfs);
         r = set_attr(sqlfs, key, &attr);
+        clean_attr(&attr);
+        commit_transaction(get_sqlfs(sqlfs), 1);
         if (r != SQLITE_OK)
-        {
-            clean_attr(&attr);
             return 0;
-        }
-        clean_attr(&attr);
         return 2;
     }
+    commit_transaction(get_sqlfs(sqlfs), 1);
     return 1;
 }
 
@@ -966,53 +1725,21 @@ static int get_parent_path(const char *path, char buf[PATH_MAX])
 }
 
 
-#undef INDEX
-#define INDEX 16
-
-
 static int get_permission_data(sqlfs_t *sqlfs, const char *key, gid_t *gid, uid_t *uid, mode_t *mode)
 {
-
+    struct meta_entry *e;
     int r;
 
-    const char *tail;
-    sqlite3_stmt *stmt;
-    static const char *cmd = "select mode, uid, gid from meta_data where key = :key; ";
-
-
-    SQLITE3_PREPARE(get_sqlfs(sqlfs)->db, cmd, -1, &stmt,  &tail);
+    r = get_meta(sqlfs, key, &e);
     if (r != SQLITE_OK)
-    {
-        show_msg(stderr, "%s\n", sqlite3_errmsg(get_sqlfs(sqlfs)->db));
         return r;
-    }
-    r = sqlite3_bind_text(stmt, 1, key, -1, SQLITE_STATIC);
-    if (r != SQLITE_OK)
-    {
-        show_msg(stderr, "%s\n", sqlite3_errmsg(get_sqlfs(sqlfs)->db));
-
-    }
-    r = sql_step(stmt);
-    if (r != SQLITE_ROW)
-    {
-        if (r != SQLITE_DONE)
-            show_msg(stderr, "%s\n", sqlite3_errmsg(get_sqlfs(sqlfs)->db));
-        else if (r == SQLITE_BUSY)
-            ;
-        else
-            r = SQLITE_NOTFOUND;
-    }
-    else
-    {
-        *mode = (mode_t) (sqlite3_column_int(stmt, 0));
-        *uid = (uid_t) (sqlite3_column_int(stmt, 1));
-        *gid = (gid_t) (sqlite3_column_int(stmt, 2));
-        r = SQLITE_OK;
-    }
-
-    sqlite3_reset(stmt);
+    if (!e->exists)
+        return SQLITE_NOTFOUND;
+    *mode = e->mode;
+    *uid = e->uid;
+    *gid = e->gid;
     key_accessed(sqlfs, key);
-    return r;
+    return SQLITE_OK;
 }
 
 static int get_parent_permission_data(sqlfs_t *sqlfs, const char *key, gid_t *gid, uid_t *uid, mode_t *mode)
@@ -1027,60 +1754,29 @@ static int get_parent_permission_data(sqlfs_t *sqlfs, const char *key, gid_t *gi
 }
 
 
-#undef INDEX
-#define INDEX 17
-
-
 static int get_attr(sqlfs_t *sqlfs, const char *key, key_attr *attr)
 {
+    struct meta_entry *e;
     int r;
 
-    const char *tail;
-    sqlite3_stmt *stmt;
-    static const char *cmd = "select key, type, mode, uid, gid, atime, mtime, ctime, size, inode from meta_data where key = :key; ";
-
     clean_attr(attr);
-    SQLITE3_PREPARE(get_sqlfs(sqlfs)->db, cmd, -1, &stmt,  &tail);
+    r = get_meta(sqlfs, key, &e);
     if (r != SQLITE_OK)
-    {
-        show_msg(stderr, "%s\n", sqlite3_errmsg(get_sqlfs(sqlfs)->db));
         return r;
-    }
-    r = sqlite3_bind_text(stmt, 1, key, -1, SQLITE_STATIC);
-    if (r != SQLITE_OK)
-    {
-        show_msg(stderr, "%s\n", sqlite3_errmsg(get_sqlfs(sqlfs)->db));
-
-    }
-    r = sql_step(stmt);
-    if (r != SQLITE_ROW)
-    {
-        if (r != SQLITE_DONE)
-            show_msg(stderr, "%s\n", sqlite3_errmsg(get_sqlfs(sqlfs)->db));
-        if (r == SQLITE_BUSY)
-            ;
-        else
-            r = SQLITE_NOTFOUND;
-    }
-    else
-    {
-        attr->path = make_str_copy((const char *)sqlite3_column_text(stmt, 0));
-        assert(!strcmp(key, attr->path));
-        attr->type = make_str_copy((const char *)sqlite3_column_text(stmt, 1));
-        attr->mode = (sqlite3_column_int(stmt, 2));
-        attr->uid = (sqlite3_column_int(stmt, 3));
-        attr->gid = (sqlite3_column_int(stmt, 4));
-        attr->atime = (sqlite3_column_int(stmt, 5));
-        attr->mtime = (sqlite3_column_int(stmt, 6));
-        attr->ctime = (sqlite3_column_int(stmt, 7));
-        attr->size = (sqlite3_column_int64(stmt, 8));
-        attr->inode = (sqlite3_column_int(stmt, 9));
-        r = SQLITE_OK;
-    }
-
-    sqlite3_reset(stmt);
+    if (!e->exists)
+        return SQLITE_NOTFOUND;
+    attr->path = make_str_copy(key);
+    attr->type = make_str_copy(e->type);
+    attr->mode = e->mode;
+    attr->uid = e->uid;
+    attr->gid = e->gid;
+    attr->atime = e->atime;
+    attr->mtime = e->mtime;
+    attr->ctime = e->ctime;
+    attr->size = e->size;
+    attr->inode = e->inode;
     key_accessed(sqlfs, key);
-    return r;
+    return SQLITE_OK;
 }
 
 
@@ -1093,11 +1789,31 @@ static int set_attr(sqlfs_t *sqlfs, const char *key, const key_attr *attr)
     const char *tail;
     sqlite3_stmt *stmt;
     int mode = attr->mode;
+    int inode = attr->inode;
+    time_t now;
     static const char *cmd1 = "insert or ignore into meta_data (key) VALUES ( :key ) ; ";
+    /* an existing key keeps its inode, since its data blocks are stored under it */
     static const char *cmd2 = "update meta_data set type = :type, mode = :mode, uid = :uid, gid = :gid,"
-                              "atime = :atime, mtime = :mtime, ctime = :ctime,  size = :size, inode = :inode, block_size = :block_size where key = :key; ";
+                              "atime = :atime, mtime = :mtime, ctime = :ctime,  size = :size, inode = coalesce(inode, :inode), block_size = :block_size where key = :key; ";
+    /* cmd1 and cmd2 in one statement, where SQLite supports it */
+    static const char *upsert_cmd = "insert into meta_data (type, mode, uid, gid, atime, mtime, ctime, "
+                                    "size, inode, block_size, key) values (:type, :mode, :uid, :gid, "
+                                    ":atime, :mtime, :ctime, :size, :inode, :block_size, :key) "
+                                    "on conflict (key) do update set type = excluded.type, "
+                                    "mode = excluded.mode, uid = excluded.uid, gid = excluded.gid, "
+                                    "atime = excluded.atime, mtime = excluded.mtime, "
+                                    "ctime = excluded.ctime, size = excluded.size, "
+                                    "inode = coalesce(meta_data.inode, excluded.inode), "
+                                    "block_size = excluded.block_size; ";
 
+    time(&now);
     begin_transaction(get_sqlfs(sqlfs));
+    if (inode == 0)
+    {
+        get_key_inode(sqlfs, key, &inode, 0);
+        if (inode == 0)
+            inode = get_new_inode(sqlfs);
+    }
     if (!strcmp(attr->type, TYPE_DIR))
         mode |= S_IFDIR;
     else if (!strcmp(attr->type, TYPE_SYM_LINK))
@@ -1105,23 +1821,26 @@ static int set_attr(sqlfs_t *sqlfs, const char *key, const key_attr *attr)
     else
         mode |= S_IFREG;
 
-    SQLITE3_PREPARE(get_sqlfs(sqlfs)->db, cmd1, -1, &stmt,  &tail);
-    if (r != SQLITE_OK)
+    if (!get_sqlfs(sqlfs)->upsert)
     {
-        show_msg(stderr, "%s\n", sqlite3_errmsg(get_sqlfs(sqlfs)->db));
-        commit_transaction(get_sqlfs(sqlfs), 1);
-        return r;
+        SQLITE3_PREPARE(get_sqlfs(sqlfs)->db, cmd1, -1, &stmt,  &tail);
+        if (r != SQLITE_OK)
+        {
+            show_msg(stderr, "%s\n", sqlite3_errmsg(get_sqlfs(sqlfs)->db));
+            commit_transaction(get_sqlfs(sqlfs), 1);
+            return r;
+        }
+        sqlite3_bind_text(stmt, 1, key, -1, SQLITE_STATIC);
+        r = sql_step(stmt);
+        sqlite3_reset(stmt);
     }
-    sqlite3_bind_text(stmt, 1, key, -1, SQLITE_STATIC);
-    r = sql_step(stmt);
-    sqlite3_reset(stmt);
 
 
 #undef INDEX
 #define INDEX 19
 
 
-    SQLITE3_PREPARE(get_sqlfs(sqlfs)->db, cmd2, -1, &stmt,  &tail);
+    SQLITE3_PREPARE(get_sqlfs(sqlfs)->db, get_sqlfs(sqlfs)->upsert ? upsert_cmd : cmd2, -1, &stmt,  &tail);
     if (r != SQLITE_OK)
     {
         show_msg(stderr, "%s\n", sqlite3_errmsg(get_sqlfs(sqlfs)->db));
@@ -1132,14 +1851,16 @@ static int set_attr(sqlfs_t *sqlfs, const char *key, const key_attr *attr)
     sqlite3_bind_int(stmt, 2, mode);
     sqlite3_bind_int(stmt, 3, attr->uid);
     sqlite3_bind_int(stmt, 4, attr->gid);
-    sqlite3_bind_int(stmt, 5, attr->atime);
-    sqlite3_bind_int(stmt, 6, attr->mtime);
-    sqlite3_bind_int(stmt, 7, attr->ctime);
+    /* setting the attributes counts as a modification, whatever times
+     * they hold */
+    sqlite3_bind_int64(stmt, 5, now);
+    sqlite3_bind_int64(stmt, 6, now);
+    sqlite3_bind_int64(stmt, 7, now);
     sqlite3_bind_int64(stmt, 8, attr->size);
-    sqlite3_bind_int(stmt, 9, attr->inode);
-    sqlite3_bind_int(stmt, 10, BLOCK_SIZE);
+    sqlite3_bind_int(stmt, 9, inode);
+    sqlite3_bind_int(stmt, 10, get_sqlfs(sqlfs)->block_size);
 
-    sqlite3_bind_text(stmt, 11, attr->path, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 11, get_sqlfs(sqlfs)->upsert ? key : attr->path, -1, SQLITE_STATIC);
     r = sql_step(stmt);
 
 
@@ -1151,7 +1872,8 @@ static int set_attr(sqlfs_t *sqlfs, const char *key, const key_attr *attr)
     else
         r = SQLITE_OK;
     sqlite3_reset(stmt);
-    key_modified(sqlfs, key);
+    meta_cache_forget(sqlfs, attr->path);
+    meta_cache_forget(sqlfs, key);
     /*ensure_parent_existence(sqlfs, key);*/
     commit_transaction(get_sqlfs(sqlfs), 1);
     return r;
@@ -1188,6 +1910,7 @@ static int key_set_type(sqlfs_t *sqlfs, const char *key, const char *type)
             show_msg(stderr, "%s\n", sqlite3_errmsg(get_sqlfs(sqlfs)->db));
         }
         sqlite3_reset(stmt);
+        meta_cache_forget(sqlfs, key);
     }
     else
         r = SQLITE_ERROR;
@@ -1200,26 +1923,192 @@ static int key_set_type(sqlfs_t *sqlfs, const char *key, const char *type)
 #undef INDEX
 #define INDEX 21
 
-/* If the read was successful, SQLITE_OK is returned.  If there is
- * nothing to read, then SQLITE_DONE is returned.  This probably
- * doesn't make sense, but leave it as is for now since it'll be a
- * little project to change it. */
-static int get_value_block(sqlfs_t *sqlfs, const char *key, char *data, size_t block_no, size_t *size)
+/* A small LZ77 codec in the spirit of LZF, used for SQLFS_CODEC_LZF.  The
+ * compressed data is a sequence of
+ *   000LLLLL + L+1 literal bytes
+ *   LLLOOOOO [+ extra length byte when LLL is 7] + OOOOOOOO
+ * where the latter copies L+2 bytes from O+1 bytes back in the output. */
+
+#define LZF_HASH_LOG 13
+#define LZF_MAX_DISTANCE 8192
+#define LZF_MAX_MATCH (7 + 255 + 2)
+
+/* returns the compressed size, or 0 when it would not fit in out_size */
+static size_t lzf_compress(const char *in_data, size_t in_size, char *out_data, size_t out_size)
 {
-    int r;
-    const char *tail;
-    sqlite3_stmt *stmt;
-    static const char *cmd = "select data_block from value_data where key = :key and block_no = :block_no;";
-    key_attr attr = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 } ;
-    clean_attr(&attr);
-    SQLITE3_PREPARE(get_sqlfs(sqlfs)->db, cmd, -1, &stmt,  &tail);
-    if (r != SQLITE_OK)
+    const unsigned char *in = (const unsigned char *) in_data;
+    const unsigned char *ip = in, *in_end = in + in_size;
+    unsigned char *op = (unsigned char *) out_data, *out_end = op + out_size;
+    unsigned char *lit_ctrl;
+    uint32_t htab[1 << LZF_HASH_LOG]; /* position + 1 of the last occurrence */
+    size_t lit = 0;
+
+    if (out_size < 2)
+        return 0;
+    memset(htab, 0, sizeof(htab));
+    lit_ctrl = op++;
+    while (ip < in_end)
+    {
+        if (ip + 2 < in_end)
+        {
+            uint32_t v = (ip[0] << 16) | (ip[1] << 8) | ip[2];
+            uint32_t h = (v * 2654435761u) >> (32 - LZF_HASH_LOG);
+            const unsigned char *ref = htab[h] ? in + htab[h] - 1 : 0;
+            htab[h] = ip - in + 1;
+            if (ref && (size_t)(ip - ref) <= LZF_MAX_DISTANCE &&
+                ref[0] == ip[0] && ref[1] == ip[1] && ref[2] == ip[2])
+            {
+                size_t len = 3, max = in_end - ip, distance = ip - ref - 1;
+                if (max > LZF_MAX_MATCH)
+                    max = LZF_MAX_MATCH;
+                while (len < max && ref[len] == ip[len])
+                    len++;
+                if (lit)
+                    *lit_ctrl = lit - 1;
+                else
+                    op--; /* drop the unused literal control byte */
+                if (op + 4 > out_end)
+                    return 0;
+                ip += len;
+                len -= 2;
+                if (len < 7)
+                    *op++ = (len << 5) | (distance >> 8);
+                else
+                {
+                    *op++ = (7 << 5) | (distance >> 8);
+                    *op++ = len - 7;
+                }
+                *op++ = distance & 0xff;
+                lit_ctrl = op++;
+                lit = 0;
+                continue;
+            }
+        }
+        if (op >= out_end)
+            return 0;
+        *op++ = *ip++;
+        if (++lit == 32)
+        {
+            *lit_ctrl = lit - 1;
+            if (op >= out_end)
+                return 0;
+            lit_ctrl = op++;
+            lit = 0;
+        }
+    }
+    if (lit)
+        *lit_ctrl = lit - 1;
+    else
+        op--;
+    return op - (unsigned char *) out_data;
+}
+
+/* returns the decompressed size, or 0 if the data is corrupt or does not
+ * fit in out_size */
+static size_t lzf_decompress(const char *in_data, size_t in_size, char *out_data, size_t out_size)
+{
+    const unsigned char *ip = (const unsigned char *) in_data, *in_end = ip + in_size;
+    unsigned char *out = (unsigned char *) out_data, *op = out, *out_end = op + out_size;
+
+    while (ip < in_end)
+    {
+        unsigned int ctrl = *ip++;
+        size_t len;
+        if (ctrl < 32)
+        {
+            len = ctrl + 1;
+            if ((len > (size_t)(in_end - ip)) || (len > (size_t)(out_end - op)))
+                return 0;
+            memcpy(op, ip, len);
+            op += len;
+            ip += len;
+        }
+        else
+        {
+            const unsigned char *ref;
+            len = ctrl >> 5;
+            if (len == 7)
+            {
+                if (ip >= in_end)
+                    return 0;
+                len += *ip++;
+            }
+            if (ip >= in_end)
+                return 0;
+            ref = op - (((ctrl & 31) << 8) | *ip++) - 1;
+            len += 2;
+            if ((ref < out) || (len > (size_t)(out_end - op)))
+                return 0;
+            while (len--)
+                *op++ = *ref++;
+        }
+    }
+    return op - out;
+}
+
+/* compresses a block for storage with the codec of the connection.  Returns
+ * the codec actually used, SQLFS_CODEC_NONE if it did not make the block
+ * smaller, in which case the block is stored as is. */
+static int encode_block(sqlfs_t *sqlfs, const char *data, size_t size, char *out, size_t *out_size)
+{
+    if ((get_sqlfs(sqlfs)->codec == SQLFS_CODEC_LZF) && (size > 64))
+    {
+        *out_size = lzf_compress(data, size, out, size - size / 16);
+        if (*out_size)
+            return SQLFS_CODEC_LZF;
+    }
+    return SQLFS_CODEC_NONE;
+}
+
+/* copies the block in column col of a row to data, decoding it with the
+ * codec in column col + 1 */
+static int column_block(sqlfs_t *sqlfs, sqlite3_stmt *stmt, int col, char *data, size_t *size)
+{
+    size_t n, block_size = get_sqlfs(sqlfs)->block_size;
+
+    if (sqlite3_column_int(stmt, col + 1) == SQLFS_CODEC_LZF)
+    {
+        n = lzf_decompress(sqlite3_column_blob(stmt, col), sqlite3_column_bytes(stmt, col),
+                           data, block_size);
+        if (n == 0)
+        {
+            show_msg(stderr, "corrupt compressed block\n");
+            return SQLITE_CORRUPT;
+        }
+    }
+    else
+    {
+        n = (size_t) sqlite3_column_bytes(stmt, col);
+        if (n > block_size)
+            n = block_size;
+        memcpy(data, sqlite3_column_blob(stmt, col), n);
+    }
+    if (size)
+        *size = n;
+    return SQLITE_OK;
+}
+
+/* If the read was successful, SQLITE_OK is returned.  If there is
+ * nothing to read, then SQLITE_DONE is returned.  This probably
+ * doesn't make sense, but leave it as is for now since it'll be a
+ * little project to change it. */
+static int get_value_block(sqlfs_t *sqlfs, int inode, char *data, size_t block_no, size_t *size)
+{
+    int r;
+    const char *tail;
+    sqlite3_stmt *stmt;
+    /* deduplicated blocks live in block_content */
+    static const char *cmd = "select coalesce(v.data_block, c.data_block), "
+                             "case when v.content is null then v.codec else c.codec end from value_data v "
+                             "left join block_content c on c.id = v.content "
+                             "where v.block_id = :block_id;";
+    SQLITE3_PREPARE(get_sqlfs(sqlfs)->db, cmd, -1, &stmt,  &tail);
+    if (r != SQLITE_OK)
     {
         show_msg(stderr, "%s\n", sqlite3_errmsg(get_sqlfs(sqlfs)->db));
         return r;
     }
-    sqlite3_bind_text(stmt, 1, key, -1, SQLITE_STATIC);
-    sqlite3_bind_int(stmt, 2, block_no);
+    sqlite3_bind_int64(stmt, 1, block_id(inode, block_no));
     r = sql_step(stmt);
     if (r != SQLITE_ROW)
     {
@@ -1228,33 +2117,166 @@ static int get_value_block(sqlfs_t *sqlfs, const char *key, char *data, size_t b
 
     }
     else
+        r = column_block(sqlfs, stmt, 0, data, size);
+
+    sqlite3_reset(stmt);
+
+    return r;
+}
+
+#undef INDEX
+#define INDEX 40
+
+/* reads the whole blocks first to first + count - 1 of a file into data
+ * with one range query, rather than a lookup per block.  Holes are
+ * skipped, so data has to be zeroed by the caller. */
+static int get_value_blocks(sqlfs_t *sqlfs, int inode, char *data, size_t first, size_t count)
+{
+    int r;
+    const char *tail;
+    sqlite3_stmt *stmt;
+    size_t block_size = get_sqlfs(sqlfs)->block_size;
+    static const char *cmd = "select v.block_id, coalesce(v.data_block, c.data_block), "
+                             "case when v.content is null then v.codec else c.codec end from value_data v "
+                             "left join block_content c on c.id = v.content "
+                             "where v.block_id between :first and :last order by v.block_id;";
+    SQLITE3_PREPARE(get_sqlfs(sqlfs)->db, cmd, -1, &stmt,  &tail);
+    if (r != SQLITE_OK)
     {
-        if (size)
-          *size = (size_t) sqlite3_column_bytes(stmt, 0);
-        memcpy(data, sqlite3_column_blob(stmt, 0), sqlite3_column_bytes(stmt, 0));
+        show_msg(stderr, "%s\n", sqlite3_errmsg(get_sqlfs(sqlfs)->db));
+        return r;
+    }
+    sqlite3_bind_int64(stmt, 1, block_id(inode, first));
+    sqlite3_bind_int64(stmt, 2, block_id(inode, first + count - 1));
+    while ((r = sql_step(stmt)) == SQLITE_ROW)
+    {
+        size_t block_no = (size_t) (sqlite3_column_int64(stmt, 0) & BLOCK_NO_MAX);
+        r = column_block(sqlfs, stmt, 1, data + (block_no - first) * block_size, NULL);
+        if (r != SQLITE_OK)
+            break;
+    }
+    if (r == SQLITE_DONE)
         r = SQLITE_OK;
+    else if (r != SQLITE_CORRUPT)
+        show_msg(stderr, "%s\n", sqlite3_errmsg(get_sqlfs(sqlfs)->db));
+    sqlite3_reset(stmt);
+    return r;
+}
+
 
+/* 64-bit FNV-1a, used to find candidates for identical blocks */
+static sqlite3_int64 hash_block(const char *data, size_t size)
+{
+    uint64_t h = 14695981039346656037ULL;
+    size_t i;
+    for (i = 0; i < size; i++)
+    {
+        h ^= (unsigned char) data[i];
+        h *= 1099511628211ULL;
     }
+    return (sqlite3_int64) h;
+}
+
+#undef INDEX
+#define INDEX 36
+
+static void bind_codec(sqlite3_stmt *stmt, int i, int codec)
+{
+    if (codec == SQLFS_CODEC_NONE)
+        sqlite3_bind_null(stmt, i);
+    else
+        sqlite3_bind_int(stmt, i, codec);
+}
+
+/* returns the id of the block_content row holding a copy of data, adding
+ * one if there is none yet.  The block is stored as 'stored', 'data' after
+ * going through 'codec'.  Its refcount is maintained by the triggers on
+ * value_data. */
+static int get_block_content(sqlfs_t *sqlfs, const char *data, size_t size,
+                             const char *stored, size_t stored_size, int codec, sqlite3_int64 *id)
+{
+    int r;
+    const char *tail;
+    sqlite3_stmt *stmt;
+    sqlite3_int64 hash = hash_block(data, size);
+    static const char *cmd1 = "select id from block_content where hash = :hash and codec is :codec "
+                              "and data_block = :data_block;";
+    static const char *cmd2 = "insert into block_content (hash, refcount, data_block, codec) "
+                              "values (:hash, 0, :data_block, :codec);";
 
+    SQLITE3_PREPARE(get_sqlfs(sqlfs)->db, cmd1, -1, &stmt,  &tail);
+    if (r != SQLITE_OK)
+    {
+        show_msg(stderr, "%s\n", sqlite3_errmsg(get_sqlfs(sqlfs)->db));
+        return r;
+    }
+    sqlite3_bind_int64(stmt, 1, hash);
+    bind_codec(stmt, 2, codec);
+    sqlite3_bind_blob(stmt, 3, stored, stored_size, SQLITE_STATIC);
+    r = sql_step(stmt);
+    if (r == SQLITE_ROW)
+    {
+        *id = sqlite3_column_int64(stmt, 0);
+        r = SQLITE_OK;
+    }
+    else if (r != SQLITE_DONE)
+        show_msg(stderr, "%s\n", sqlite3_errmsg(get_sqlfs(sqlfs)->db));
     sqlite3_reset(stmt);
+    if (r != SQLITE_DONE)
+        return r;
+
+#undef INDEX
+#define INDEX 37
 
+    SQLITE3_PREPARE(get_sqlfs(sqlfs)->db, cmd2, -1, &stmt,  &tail);
+    if (r != SQLITE_OK)
+    {
+        show_msg(stderr, "%s\n", sqlite3_errmsg(get_sqlfs(sqlfs)->db));
+        return r;
+    }
+    sqlite3_bind_int64(stmt, 1, hash);
+    sqlite3_bind_blob(stmt, 2, stored, stored_size, SQLITE_STATIC);
+    bind_codec(stmt, 3, codec);
+    r = sql_step(stmt);
+    if (r == SQLITE_DONE)
+    {
+        *id = sqlite3_last_insert_rowid(get_sqlfs(sqlfs)->db);
+        r = SQLITE_OK;
+    }
+    else
+        show_msg(stderr, "%s\n", sqlite3_errmsg(get_sqlfs(sqlfs)->db));
+    sqlite3_reset(stmt);
     return r;
 }
 
-
 #undef INDEX
 #define INDEX 22
 
-static int set_value_block(sqlfs_t *sqlfs, const char *key, const char *data, size_t block_no, size_t size)
+static int set_value_block(sqlfs_t *sqlfs, int inode, const char *data, size_t block_no, size_t size)
 {
     int r;
     const char *tail;
     sqlite3_stmt *stmt;
-
-    static const char *cmd = "update value_data set data_block = :data_block where key = :key and block_no = :block_no;";
-    static const char *cmd1 = "insert or ignore into value_data (key, block_no) VALUES ( :key, :block_no ) ; ";
-    static const char *cmd2 = "delete from value_data  where key = :key and block_no = :block_no;";
-
+    sqlite3_int64 content = 0;
+    const char *stored = data;
+    size_t stored_size = size;
+    char *encoded = 0;
+    int codec = SQLFS_CODEC_NONE;
+
+    /* in dedup mode the block only refers to its data in block_content */
+    static const char *cmd = "update value_data set data_block = :data_block, content = :content, "
+                             "codec = :codec where block_id = :block_id;";
+    static const char *cmd1 = "insert or ignore into value_data (block_id) VALUES ( :block_id ) ; ";
+    static const char *cmd2 = "delete from value_data  where block_id = :block_id;";
+    /* cmd1 and cmd in one statement, where SQLite supports it.  Either way
+     * the block_content triggers see the change of content. */
+    static const char *upsert_cmd = "insert into value_data (data_block, content, codec, block_id) "
+                                    "values (:data_block, :content, :codec, :block_id) "
+                                    "on conflict (block_id) do update set "
+                                    "data_block = excluded.data_block, content = excluded.content, "
+                                    "codec = excluded.codec;";
+
+    block_cache_invalidate(sqlfs, block_id(inode, block_no), block_id(inode, block_no));
     begin_transaction(get_sqlfs(sqlfs));
 
     if (size == 0)
@@ -1267,8 +2289,7 @@ static int set_value_block(sqlfs_t *sqlfs, const char *key, const char *data, si
             commit_transaction(get_sqlfs(sqlfs), 1);
             return r;
         }
-        sqlite3_bind_text(stmt, 1, key, -1, SQLITE_STATIC);
-        sqlite3_bind_int(stmt, 2, block_no);
+        sqlite3_bind_int64(stmt, 1, block_id(inode, block_no));
         r = sql_step(stmt);
         if (r != SQLITE_DONE)
         {
@@ -1283,42 +2304,79 @@ static int set_value_block(sqlfs_t *sqlfs, const char *key, const char *data, si
     }
 
 
+    if (get_sqlfs(sqlfs)->codec != SQLFS_CODEC_NONE)
+    {
+        encoded = malloc(size);
+        assert(encoded);
+        codec = encode_block(sqlfs, data, size, encoded, &stored_size);
+        if (codec != SQLFS_CODEC_NONE)
+            stored = encoded;
+        else
+            stored_size = size;
+    }
+
+    if (get_sqlfs(sqlfs)->dedup)
+    {
+        r = get_block_content(sqlfs, data, size, stored, stored_size, codec, &content);
+        if (r != SQLITE_OK)
+        {
+            free(encoded);
+            commit_transaction(get_sqlfs(sqlfs), 1);
+            return r;
+        }
+    }
+
 #undef INDEX
 #define INDEX 23
 
 
-    SQLITE3_PREPARE(get_sqlfs(sqlfs)->db, cmd1, -1, &stmt,  &tail);
-    if (r != SQLITE_OK)
+    if (!get_sqlfs(sqlfs)->upsert)
     {
-        show_msg(stderr, "%s\n", sqlite3_errmsg(get_sqlfs(sqlfs)->db));
-        commit_transaction(get_sqlfs(sqlfs), 1);
-        return r;
-    }
-    sqlite3_bind_text(stmt, 1, key, -1, SQLITE_STATIC);
-    sqlite3_bind_int(stmt, 2, block_no);
-    r = sql_step(stmt);
-    sqlite3_reset(stmt);
+        SQLITE3_PREPARE(get_sqlfs(sqlfs)->db, cmd1, -1, &stmt,  &tail);
+        if (r != SQLITE_OK)
+        {
+            show_msg(stderr, "%s\n", sqlite3_errmsg(get_sqlfs(sqlfs)->db));
+            free(encoded);
+            commit_transaction(get_sqlfs(sqlfs), 1);
+            return r;
+        }
+        sqlite3_bind_int64(stmt, 1, block_id(inode, block_no));
+        r = sql_step(stmt);
+        sqlite3_reset(stmt);
 
-    if (r == SQLITE_BUSY)
-    {
-        commit_transaction(get_sqlfs(sqlfs), 1);
-        return r;
+        if (r == SQLITE_BUSY)
+        {
+            free(encoded);
+            commit_transaction(get_sqlfs(sqlfs), 1);
+            return r;
+        }
     }
 
 #undef INDEX
 #define INDEX 24
 
 
-    SQLITE3_PREPARE(get_sqlfs(sqlfs)->db, cmd, -1, &stmt,  &tail);
+    SQLITE3_PREPARE(get_sqlfs(sqlfs)->db, get_sqlfs(sqlfs)->upsert ? upsert_cmd : cmd, -1, &stmt,  &tail);
     if (r != SQLITE_OK)
     {
         show_msg(stderr, "%s\n", sqlite3_errmsg(get_sqlfs(sqlfs)->db));
+        free(encoded);
         commit_transaction(get_sqlfs(sqlfs), 1);
         return r;
     }
-    sqlite3_bind_blob(stmt, 1, data, size, SQLITE_STATIC);
-    sqlite3_bind_text(stmt, 2, key, -1, SQLITE_STATIC);
-    sqlite3_bind_int(stmt, 3, block_no);
+    if (content)
+    {
+        sqlite3_bind_null(stmt, 1);
+        sqlite3_bind_int64(stmt, 2, content);
+        sqlite3_bind_null(stmt, 3);
+    }
+    else
+    {
+        sqlite3_bind_blob(stmt, 1, stored, stored_size, SQLITE_STATIC);
+        sqlite3_bind_null(stmt, 2);
+        bind_codec(stmt, 3, codec);
+    }
+    sqlite3_bind_int64(stmt, 4, block_id(inode, block_no));
     r = sql_step(stmt);
 
 
@@ -1330,161 +2388,353 @@ static int set_value_block(sqlfs_t *sqlfs, const char *key, const char *data, si
     else
         r = SQLITE_OK;
     sqlite3_reset(stmt);
+    free(encoded);
 
     commit_transaction(get_sqlfs(sqlfs), 1);
     return r;
 }
 
-
-
 #undef INDEX
-#define INDEX 25
-
-
-static int get_value(sqlfs_t *sqlfs, const char *key, key_value *value, size_t begin, size_t end)
+#define INDEX 39
+
+/* opens the data_block of a block for incremental blob I/O.  Only blocks
+ * stored as raw bytes in value_data can be opened: SQLITE_MISMATCH is
+ * returned for deduplicated or compressed blocks, and SQLITE_DONE when
+ * the block is a hole. */
+static int open_block_blob(sqlfs_t *sqlfs, int inode, size_t block_no, int writable,
+                           sqlite3_blob **blob)
 {
     int r;
     const char *tail;
     sqlite3_stmt *stmt;
-    static const char *cmd = "select size from meta_data where key = :key; ";
-
-    begin_transaction(get_sqlfs(sqlfs));
+    static const char *cmd = "select content is null and codec is null from value_data "
+                             "where block_id = :block_id;";
 
+    *blob = 0;
     SQLITE3_PREPARE(get_sqlfs(sqlfs)->db, cmd, -1, &stmt,  &tail);
     if (r != SQLITE_OK)
     {
         show_msg(stderr, "%s\n", sqlite3_errmsg(get_sqlfs(sqlfs)->db));
-        commit_transaction(get_sqlfs(sqlfs), 1);
         return r;
     }
-    sqlite3_bind_text(stmt, 1, key, -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 1, block_id(inode, block_no));
     r = sql_step(stmt);
-    if (r != SQLITE_ROW)
+    if (r == SQLITE_ROW)
+        r = sqlite3_column_int(stmt, 0) ? SQLITE_OK : SQLITE_MISMATCH;
+    else if (r != SQLITE_DONE)
+        show_msg(stderr, "%s\n", sqlite3_errmsg(get_sqlfs(sqlfs)->db));
+    sqlite3_reset(stmt);
+
+    if (r == SQLITE_OK)
+        r = sqlite3_blob_open(get_sqlfs(sqlfs)->db, "main", "value_data", "data_block",
+                              block_id(inode, block_no), writable, blob);
+    return r;
+}
+
+/* reads size bytes from offset in a block straight into data.  Bytes past
+ * the end of the stored block are left untouched, as is data for a hole. */
+static int read_block_range(sqlfs_t *sqlfs, int inode, size_t block_no, char *data,
+                            size_t offset, size_t size)
+{
+    sqlite3_blob *blob;
+    int r = open_block_blob(sqlfs, inode, block_no, 0, &blob);
+
+    if (r == SQLITE_OK)
     {
-        if (r != SQLITE_DONE)
-            show_msg(stderr, "%s\n", sqlite3_errmsg(get_sqlfs(sqlfs)->db));
+        size_t n = sqlite3_blob_bytes(blob);
+        if (offset + size > n)
+            size = (offset < n) ? n - offset : 0;
+        if (size > 0)
+            r = sqlite3_blob_read(blob, data, size, offset);
+        sqlite3_blob_close(blob);
     }
-    else
+    else if (r == SQLITE_DONE)
     {
-        size_t filesize = sqlite3_column_int64(stmt, 0);
-        if ((end == 0) || (end > filesize))
-            end = filesize;
         r = SQLITE_OK;
     }
+    else
+    {
+        /* encoded blocks can only be read as a whole */
+        char *block = calloc(get_sqlfs(sqlfs)->block_size, sizeof(char));
+        assert(block);
+        r = get_value_block(sqlfs, inode, block, block_no, NULL);
+        if (r == SQLITE_DONE)
+            r = SQLITE_OK;
+        memcpy(data, block + offset, size);
+        free(block);
+    }
+    return r;
+}
 
-    if (r == SQLITE_OK)
+/* overwrites size bytes at offset in a block in place, without reading or
+ * rebinding the rest of it.  SQLITE_DONE is returned when the block is not
+ * stored raw or the write would change its length; the caller then has to
+ * rewrite the whole block. */
+static int patch_value_block(sqlfs_t *sqlfs, int inode, size_t block_no, const char *data,
+                             size_t offset, size_t size)
+{
+    sqlite3_blob *blob;
+    int r = open_block_blob(sqlfs, inode, block_no, 1, &blob);
+
+    if (r != SQLITE_OK)
+        return SQLITE_DONE;
+    block_cache_invalidate(sqlfs, block_id(inode, block_no), block_id(inode, block_no));
+    if (offset + size <= (size_t) sqlite3_blob_bytes(blob))
+        r = sqlite3_blob_write(blob, data, size, offset);
+    else
+        r = SQLITE_DONE;
+    sqlite3_blob_close(blob);
+    return r;
+}
+
+/* reads bytes begin to end of a file through the block cache, loading the
+ * blocks that are not cached yet one by one */
+static int get_value_cached(sqlfs_t *sqlfs, int inode, char *data, size_t begin, size_t end)
+{
+    int r = SQLITE_OK;
+    size_t block_size = get_sqlfs(sqlfs)->block_size;
+    size_t pos = begin;
+    char *block = 0;
+
+    while ((r == SQLITE_OK) && (pos < end))
     {
-        if (begin < end)
+        size_t block_no = pos / block_size;
+        size_t offset = pos % block_size;
+        size_t n = block_size - offset;
+        sqlite3_int64 id = block_id(inode, block_no);
+
+        if (n > end - pos)
+            n = end - pos;
+        if (!block_cache_read(sqlfs, id, data, offset, n))
         {
-            size_t block_no = begin / BLOCK_SIZE;
-            size_t blockbegin = block_no * BLOCK_SIZE; // rounded down to nearest block
-            size_t blockend = end / BLOCK_SIZE * BLOCK_SIZE; // beginning of last block
-            size_t offset = begin - blockbegin;
-            char *block = calloc(BLOCK_SIZE, sizeof(char));
-            char *data = value->data; // pointer to move along as it is written to
-            assert(value->data);
-            { /* handle first block, whether it is the whole block, or only part of it */
-                size_t readsize = BLOCK_SIZE - offset;
-                if (value->size < readsize)
-                  readsize = value->size;
-                r = get_value_block(sqlfs, key, block, block_no, NULL);
-                memcpy(data, block + offset, readsize);
-                block_no++;
-                blockbegin += BLOCK_SIZE;
-                data += readsize;
+            size_t size = 0;
+            if (!block)
+            {
+                block = malloc(block_size);
+                assert(block);
             }
-            /* read complete blocks in the middle of the write */
-            while ((r == SQLITE_OK) && (blockbegin < blockend))
+            r = get_value_block(sqlfs, inode, block, block_no, &size);
+            if (r == SQLITE_DONE)
             {
-                r = get_value_block(sqlfs, key, data, block_no, NULL);
-                if (r != SQLITE_OK)
-                    break;
-                block_no++;
-                blockbegin += BLOCK_SIZE;
-                data += BLOCK_SIZE;
+                /* a hole */
+                size = 0;
+                r = SQLITE_OK;
             }
-            /* partial block at the end of the read */
-            if ((r == SQLITE_OK) && (blockbegin < end))
+            if (r == SQLITE_OK)
             {
-                assert(blockbegin % BLOCK_SIZE == 0);
-                assert(end - blockbegin < BLOCK_SIZE);
-                r = get_value_block(sqlfs, key, block, block_no, NULL);
-                memcpy(data, block, end - blockend);
+                block_cache_put(sqlfs, id, block, size);
+                if (offset < size)
+                    memcpy(data, block + offset, (offset + n < size) ? n : size - offset);
             }
-            free(block);
-        }
-        else
-        {
-            r = SQLITE_NOTFOUND;
         }
+        data += n;
+        pos += n;
     }
-
-    sqlite3_reset(stmt);
-    key_accessed(sqlfs, key);
-    commit_transaction(get_sqlfs(sqlfs), 1);
+    free(block);
     return r;
 }
 
 
 #undef INDEX
-#define INDEX 26
+#define INDEX 25
 
-/* 'begin' and 'end' are the positions in bytes relative to the file
- * to start and finish writing to. */
-static int set_value(sqlfs_t *sqlfs, const char *key, const key_value *value, size_t begin, size_t end)
+
+static int get_value(sqlfs_t *sqlfs, const char *key, key_value *value, size_t begin, size_t end)
 {
-    int r;
+    int r, inode = 0, is_inline = 0;
+    size_t block_size = get_sqlfs(sqlfs)->block_size;
     const char *tail;
-    sqlite3_stmt *stmt;
-    size_t current_file_size = 0;
-    static const char *selectsize = "select size from meta_data where key = :key ";
-    static const char *createfile_cmd = "insert or ignore into meta_data (key) VALUES ( :key ) ; ";
-    static const char *updatesize_cmd = "update meta_data set size = :size where key =  :key  ; ";
+    sqlite3_stmt *stmt = 0;
+    struct meta_entry *e;
+    static const char *cmd = "select size, inode, inline_data from meta_data where key = :key; ";
+
+    begin_transaction(get_sqlfs(sqlfs));
 
-    /* get the size of the file if it already exists */
-    r = sqlite3_prepare(get_sqlfs(sqlfs)->db, selectsize, -1, &stmt, &tail);
+    r = get_meta(sqlfs, key, &e);
     if (r != SQLITE_OK)
     {
-        show_msg(stderr, "%s\n", sqlite3_errmsg(get_sqlfs(sqlfs)->db));
+        commit_transaction(get_sqlfs(sqlfs), 1);
         return r;
     }
-    sqlite3_bind_text(stmt, 1, key, -1, SQLITE_STATIC);
-    if (r != SQLITE_OK)
-        show_msg(stderr, "%s\n", sqlite3_errmsg(get_sqlfs(sqlfs)->db));
-    r = sql_step(stmt);
-    if (r != SQLITE_ROW)
+    if (!e->exists)
+        r = SQLITE_DONE;
+    else if (!e->is_inline)
     {
-        if (r != SQLITE_DONE)
-            show_msg(stderr, "%s\n", sqlite3_errmsg(get_sqlfs(sqlfs)->db));
-        if (r == SQLITE_BUSY)
+        /* the data is in blocks, the cached row has all it takes */
+        inode = e->inode;
+        if ((end == 0) || (end > e->size))
+            end = e->size;
+    }
+    else
+    {
+        SQLITE3_PREPARE(get_sqlfs(sqlfs)->db, cmd, -1, &stmt,  &tail);
+        if (r != SQLITE_OK)
         {
             show_msg(stderr, "%s\n", sqlite3_errmsg(get_sqlfs(sqlfs)->db));
+            commit_transaction(get_sqlfs(sqlfs), 1);
             return r;
         }
+        sqlite3_bind_text(stmt, 1, key, -1, SQLITE_STATIC);
+        r = sql_step(stmt);
     }
-    else
-        current_file_size = sqlite3_column_int64(stmt, 0);
-    sqlite3_reset(stmt);
+    if (stmt && (r != SQLITE_ROW))
+    {
+        if (r != SQLITE_DONE)
+            show_msg(stderr, "%s\n", sqlite3_errmsg(get_sqlfs(sqlfs)->db));
+    }
+    else if (stmt)
+    {
+        size_t filesize = sqlite3_column_int64(stmt, 0);
+        inode = sqlite3_column_int(stmt, 1);
+        if ((end == 0) || (end > filesize))
+            end = filesize;
+        r = SQLITE_OK;
+        if (sqlite3_column_type(stmt, 2) != SQLITE_NULL)
+        {
+            /* small file stored inline, no blocks to look up */
+            size_t n = sqlite3_column_bytes(stmt, 2);
+            if (begin < end)
+            {
+                memset(value->data, 0, end - begin);
+                if (begin < n)
+                    memcpy(value->data, (const char *) sqlite3_column_blob(stmt, 2) + begin,
+                           ((end < n) ? end : n) - begin);
+            }
+            else
+                r = SQLITE_NOTFOUND;
+            is_inline = 1;
+        }
+    }
+    if (stmt)
+        sqlite3_reset(stmt);
+
+    if ((r == SQLITE_OK) && !is_inline)
+    {
+        if (begin < end)
+        {
+            size_t block_no = begin / block_size;
+            size_t blockbegin = block_no * block_size; // rounded down to nearest block
+            size_t blockend = end / block_size * block_size; // beginning of last block
+            size_t offset = begin - blockbegin;
+            char *data = value->data; // pointer to move along as it is written to
+            assert(value->data);
+            /* blocks that are missing or short are holes in a sparse file,
+             * which read as zeros */
+            memset(data, 0, end - begin);
+            if (block_cache_budget > 0)
+            {
+                r = get_value_cached(sqlfs, inode, data, begin, end);
+                blockbegin = end;
+            }
+            else
+            { /* handle first block, whether it is the whole block, or only part of it */
+                size_t readsize = block_size - offset;
+                if (value->size < readsize)
+                  readsize = value->size;
+                r = read_block_range(sqlfs, inode, block_no, data, offset, readsize);
+                block_no++;
+                blockbegin += block_size;
+                data += readsize;
+            }
+            /* read complete blocks in the middle of the read */
+            if ((r == SQLITE_OK) && (blockbegin < blockend))
+            {
+                size_t count = (blockend - blockbegin) / block_size;
+                r = get_value_blocks(sqlfs, inode, data, block_no, count);
+                block_no += count;
+                blockbegin += count * block_size;
+                data += count * block_size;
+            }
+            /* partial block at the end of the read */
+            if ((r == SQLITE_OK) && (blockbegin < end))
+            {
+                assert(blockbegin % block_size == 0);
+                assert(end - blockbegin < block_size);
+                r = read_block_range(sqlfs, inode, block_no, data, 0, end - blockend);
+            }
+        }
+        else
+        {
+            r = SQLITE_NOTFOUND;
+        }
+    }
+
+    key_accessed(sqlfs, key);
+    commit_transaction(get_sqlfs(sqlfs), 1);
+    return r;
+}
+
+
+#undef INDEX
+#define INDEX 26
 
+/* 'begin' and 'end' are the positions in bytes relative to the file
+ * to start and finish writing to. */
+static int set_value(sqlfs_t *sqlfs, const char *key, const key_value *value, size_t begin, size_t end)
+{
+    int r, i, inode = 0;
+    size_t block_size = get_sqlfs(sqlfs)->block_size;
+    size_t inline_threshold = get_sqlfs(sqlfs)->inline_threshold;
+    const char *tail;
+    sqlite3_stmt *stmt;
+    size_t current_file_size = 0, inline_size = 0;
+    char *inline_data = 0;
+    time_t now;
+    /* the size and the times of the change in one statement */
+    static const char *updatesize_cmd = "update meta_data set size = :size, atime = :atime, "
+                                        "mtime = :mtime, ctime = :ctime where key =  :key  ; ";
 
+    if ((end ? end : begin + value->size) > (BLOCK_NO_MAX + 1) * block_size)
+        return SQLITE_TOOBIG;
     begin_transaction(get_sqlfs(sqlfs));
-    SQLITE3_PREPARE(get_sqlfs(sqlfs)->db, createfile_cmd, -1, &stmt,  &tail);
-    if (r != SQLITE_OK)
+    /* get the size and the inode of the file, creating it if needed */
+    i = get_key_inline_data(sqlfs, key, &inode, &current_file_size, &inline_data, &inline_size);
+    if ((i == 0) && ensure_existence(sqlfs, key, TYPE_BLOB))
+        i = get_key_inline_data(sqlfs, key, &inode, &current_file_size, &inline_data, &inline_size);
+    if (i != 1)
     {
-        show_msg(stderr, "%s\n", sqlite3_errmsg(get_sqlfs(sqlfs)->db));
         commit_transaction(get_sqlfs(sqlfs), 1);
-        return r;
+        if (i == 2)
+            return SQLITE_BUSY;
+        return SQLITE_ERROR;
     }
-    sqlite3_bind_text(stmt, 1, key, -1, SQLITE_STATIC);
-    r = sql_step(stmt);
-    sqlite3_reset(stmt);
-
-    if (r == SQLITE_BUSY)
-    {
-        show_msg(stderr, "%s\n", sqlite3_errmsg(get_sqlfs(sqlfs)->db));
+    if (end == 0)
+        end = begin + value->size;
+
+    if (inline_threshold > block_size)
+        inline_threshold = block_size;
+    if ((inline_data || (current_file_size == 0)) &&
+        (end <= inline_threshold) && (current_file_size <= inline_threshold))
+    {
+        /* the file stays small enough to be kept inline */
+        size_t new_size = (end > current_file_size) ? end : current_file_size;
+        char *data = calloc(new_size + 1, sizeof(char));
+        assert(data);
+        if (inline_data)
+            memcpy(data, inline_data, (inline_size < new_size) ? inline_size : new_size);
+        memcpy(data + begin, value->data, end - begin);
+        r = set_inline_data(sqlfs, key, data, new_size);
+        free(data);
+        free(inline_data);
         commit_transaction(get_sqlfs(sqlfs), 1);
         return r;
     }
+    if (inline_data)
+    {
+        /* the file outgrew the inline storage, move its data to a block */
+        assert(inline_size <= block_size);
+        r = SQLITE_OK;
+        if (inline_size > 0)
+            r = set_value_block(sqlfs, inode, inline_data, 0, inline_size);
+        if (r == SQLITE_OK)
+            r = set_inline_data(sqlfs, key, 0, 0);
+        free(inline_data);
+        if (r != SQLITE_OK)
+        {
+            commit_transaction(get_sqlfs(sqlfs), 1);
+            return r;
+        }
+    }
 
 #undef INDEX
 #define INDEX 27
@@ -1493,54 +2743,73 @@ static int set_value(sqlfs_t *sqlfs, const char *key, const key_value *value, si
     {
         size_t block_no;
         size_t blockbegin, blockend, length, position_in_value = 0;
-        char tmp[BLOCK_SIZE];
+        char *tmp;
 
-        if (end == 0)
-            end = begin + value->size;
-        block_no = begin / BLOCK_SIZE;
-        blockbegin = block_no * BLOCK_SIZE; // 'begin' chopped to BLOCK_SIZE increments
-        // beginning of last block, i.e. 'end' rounded to 'BLOCK_SIZE'
-        blockend = end / BLOCK_SIZE * BLOCK_SIZE;
+        block_no = begin / block_size;
+        blockbegin = block_no * block_size; // 'begin' chopped to block_size increments
+        // beginning of last block, i.e. 'end' rounded to 'block_size'
+        blockend = end / block_size * block_size;
+        tmp = calloc(block_size, sizeof(char));
+        assert(tmp);
 
         /* partial write in the first block */
         {
             size_t end_of_this_block, old_size = 0;
+            int whole;
 
-            r = get_value_block(sqlfs, key, tmp, block_no, &old_size);
-            /* SQLITE_OK == read data, SQLITE_DONE == no data */
-            if (r != SQLITE_OK && r != SQLITE_DONE)
-            {
-                show_msg(stderr, "%s\n", sqlite3_errmsg(get_sqlfs(sqlfs)->db));
-                commit_transaction(get_sqlfs(sqlfs), 1);
-                return r;
-            }
-            if (end > blockbegin + BLOCK_SIZE)
+            if (end > blockbegin + block_size)
                 // the write spans multiple blocks, only write first one
-                end_of_this_block = blockbegin + BLOCK_SIZE;
+                end_of_this_block = blockbegin + block_size;
             else
                 end_of_this_block = end; // the write fits in a single block
             position_in_value = end_of_this_block - begin;
 
-            memcpy(tmp + (begin - blockbegin), value->data, position_in_value);
-            length = end_of_this_block - blockbegin;
-            if (length < old_size)
-                length = old_size;
-            r = set_value_block(sqlfs, key, tmp, block_no, length);
+            /* a block written from its start to its end, or to the end of
+             * the file, has nothing to keep from the stored one, and past
+             * the end of the file there is none.  Overwriting part of a
+             * stored block is done in place. */
+            whole = (begin == blockbegin) && ((end_of_this_block == blockbegin + block_size) ||
+                                              (end_of_this_block >= current_file_size));
+            if (whole && (blockbegin >= current_file_size))
+                r = SQLITE_DONE;
+            else
+                r = patch_value_block(sqlfs, inode, block_no, value->data,
+                                      begin - blockbegin, position_in_value);
+            if ((r == SQLITE_DONE) && whole)
+                r = set_value_block(sqlfs, inode, value->data, block_no, position_in_value);
+            else if (r == SQLITE_DONE)
+            {
+                r = get_value_block(sqlfs, inode, tmp, block_no, &old_size);
+                /* SQLITE_OK == read data, SQLITE_DONE == no data */
+                if (r != SQLITE_OK && r != SQLITE_DONE)
+                {
+                    show_msg(stderr, "%s\n", sqlite3_errmsg(get_sqlfs(sqlfs)->db));
+                    free(tmp);
+                    commit_transaction(get_sqlfs(sqlfs), 1);
+                    return r;
+                }
+                memcpy(tmp + (begin - blockbegin), value->data, position_in_value);
+                length = end_of_this_block - blockbegin;
+                if (length < old_size)
+                    length = old_size;
+                r = set_value_block(sqlfs, inode, tmp, block_no, length);
+            }
             block_no++;
-            blockbegin += BLOCK_SIZE;
+            blockbegin += block_size;
         }
 
         /* writing complete blocks in the middle of the write */
         while ((r == SQLITE_OK) && (blockbegin < blockend))
         {
-            r = set_value_block(sqlfs, key, value->data + position_in_value, block_no, BLOCK_SIZE);
+            r = set_value_block(sqlfs, inode, value->data + position_in_value, block_no, block_size);
             block_no++;
-            blockbegin += BLOCK_SIZE;
-            position_in_value += BLOCK_SIZE;
+            blockbegin += block_size;
+            position_in_value += block_size;
         }
         if (r != SQLITE_OK)
         {
             show_msg(stderr, "%s\n", sqlite3_errmsg(get_sqlfs(sqlfs)->db));
+            free(tmp);
             commit_transaction(get_sqlfs(sqlfs), 1);
             return r;
         }
@@ -1550,19 +2819,31 @@ static int set_value(sqlfs_t *sqlfs, const char *key, const key_value *value, si
         {
             size_t get_value_size;
 
-            assert(blockbegin % BLOCK_SIZE == 0);
-            assert(end - blockbegin < (size_t) BLOCK_SIZE);
+            assert(blockbegin % block_size == 0);
+            assert(end - blockbegin < (size_t) block_size);
 
-            memset(tmp, 0, BLOCK_SIZE);
-            r = get_value_block(sqlfs, key, tmp, block_no, &get_value_size);
-            if (r != SQLITE_OK)
-                get_value_size = 0;
-            memcpy(tmp, value->data + position_in_value, end - blockbegin);
-            if (get_value_size < (end - blockbegin))
-                get_value_size = end - blockbegin;
+            if (blockbegin >= current_file_size)
+                r = SQLITE_DONE;
+            else
+                r = patch_value_block(sqlfs, inode, block_no, value->data + position_in_value,
+                                      0, end - blockbegin);
+            if ((r == SQLITE_DONE) && (end >= current_file_size))
+                r = set_value_block(sqlfs, inode, value->data + position_in_value, block_no,
+                                    end - blockbegin);
+            else if (r == SQLITE_DONE)
+            {
+                memset(tmp, 0, block_size);
+                r = get_value_block(sqlfs, inode, tmp, block_no, &get_value_size);
+                if (r != SQLITE_OK)
+                    get_value_size = 0;
+                memcpy(tmp, value->data + position_in_value, end - blockbegin);
+                if (get_value_size < (end - blockbegin))
+                    get_value_size = end - blockbegin;
 
-            r = set_value_block(sqlfs, key, tmp, block_no, get_value_size);
+                r = set_value_block(sqlfs, inode, tmp, block_no, get_value_size);
+            }
         }
+        free(tmp);
     }
 
     SQLITE3_PREPARE(get_sqlfs(sqlfs)->db, updatesize_cmd, -1, &stmt,  &tail);
@@ -1572,13 +2853,17 @@ static int set_value(sqlfs_t *sqlfs, const char *key, const key_value *value, si
         commit_transaction(get_sqlfs(sqlfs), 1);
         return r;
     }
+    time(&now);
     sqlite3_bind_int64(stmt, 1, (end > current_file_size) ? end : current_file_size);
-    sqlite3_bind_text(stmt, 2, key, -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 2, now);
+    sqlite3_bind_int64(stmt, 3, now);
+    sqlite3_bind_int64(stmt, 4, now);
+    sqlite3_bind_text(stmt, 5, key, -1, SQLITE_STATIC);
     r = sql_step(stmt);
     sqlite3_reset(stmt);
+    meta_cache_forget(sqlfs, key);
     if (r == SQLITE_DONE)
         r = SQLITE_OK;
-    key_modified(sqlfs, key);
     /*ensure_parent_existence(sqlfs, key);*/
     commit_transaction(get_sqlfs(sqlfs), 1);
     return r;
@@ -1596,11 +2881,16 @@ static int key_shorten_value(sqlfs_t *sqlfs, const char *key, size_t new_length)
     char *tmp;
     const char *tail;
     sqlite3_stmt *stmt;
-    static const char *cmd1 = "delete from value_data where key = :key and block_no > :block_no; ";
-    static const char *cmd2 = "update meta_data set size = :size where key =  :key  ; ";
+    int inode = 0;
+    size_t block_size = get_sqlfs(sqlfs)->block_size;
+    static const char *cmd1 = "delete from value_data where block_id > :first and block_id <= :last; ";
+    static const char *cmd2 = "update meta_data set size = :size, "
+                              "inline_data = substr(inline_data, 1, :size) where key =  :key  ; ";
+    char *inline_data = 0;
+    size_t inline_size;
 
     begin_transaction(get_sqlfs(sqlfs));
-    i = key_exists(sqlfs, key, &l);
+    i = get_key_inline_data(sqlfs, key, &inode, &l, &inline_data, &inline_size);
     if (i == 0)
     {
         assert(0);
@@ -1615,18 +2905,36 @@ static int key_shorten_value(sqlfs_t *sqlfs, const char *key, size_t new_length)
     }
 
     assert(l > new_length);
-    block_no = new_length / BLOCK_SIZE;
+    block_no = new_length / block_size;
 
-    tmp = calloc(BLOCK_SIZE, sizeof(char));
+    tmp = calloc(block_size, sizeof(char));
     assert(tmp);
-    r = get_value_block(sqlfs, key, tmp, block_no, &i);
-    assert(new_length % BLOCK_SIZE <= (unsigned int) i);
-    r = set_value_block(sqlfs, key, tmp, block_no, new_length % BLOCK_SIZE);
-    if (r != SQLITE_OK)
-        show_msg(stderr, "%s\n", sqlite3_errmsg(get_sqlfs(sqlfs)->db));
+    if (inline_data)
+    {
+        /* the inline data is cut down along with the size below */
+        r = SQLITE_OK;
+    }
+    else
+    {
+        r = get_value_block(sqlfs, inode, tmp, block_no, &i);
+        if (r == SQLITE_DONE)
+        {
+            /* the new last block is a hole, it stays one */
+            r = SQLITE_OK;
+        }
+        else if (r == SQLITE_OK)
+        {
+            if (new_length % block_size < i)
+                i = new_length % block_size;
+            r = set_value_block(sqlfs, inode, tmp, block_no, i);
+        }
+        if (r != SQLITE_OK)
+            show_msg(stderr, "%s\n", sqlite3_errmsg(get_sqlfs(sqlfs)->db));
+    }
 
-    if (r == SQLITE_OK)
+    if ((r == SQLITE_OK) && !inline_data)
     {
+        block_cache_invalidate(sqlfs, block_id(inode, block_no + 1), block_id(inode, BLOCK_NO_MAX));
         SQLITE3_PREPARE(get_sqlfs(sqlfs)->db, cmd1, -1, &stmt,  &tail);
         if (r != SQLITE_OK)
         {
@@ -1634,8 +2942,8 @@ static int key_shorten_value(sqlfs_t *sqlfs, const char *key, size_t new_length)
         }
         else
         {
-            sqlite3_bind_text(stmt, 1, key, -1, SQLITE_STATIC);
-            sqlite3_bind_int(stmt, 2, block_no);
+            sqlite3_bind_int64(stmt, 1, block_id(inode, block_no));
+            sqlite3_bind_int64(stmt, 2, block_id(inode, BLOCK_NO_MAX));
             r = sql_step(stmt);
             /*if (r != SQLITE_DONE)
             {
@@ -1668,37 +2976,310 @@ static int key_shorten_value(sqlfs_t *sqlfs, const char *key, size_t new_length)
             sqlite3_bind_text(stmt, 2, key, -1, SQLITE_STATIC);
             r = sql_step(stmt);
             sqlite3_reset(stmt);
+            meta_cache_forget(sqlfs, key);
             if (r == SQLITE_DONE)
                 r = SQLITE_OK;
         }
 
     }
     free(tmp);
+    free(inline_data);
     key_modified(sqlfs, key);
     /*ensure_parent_existence(sqlfs, key);*/
     commit_transaction(get_sqlfs(sqlfs), 1);
     return r;
 }
 
-static int check_parent_access(sqlfs_t *sqlfs, const char *path)
+#undef INDEX
+#define INDEX 38
+
+/* grows a file to new_length.  No blocks are written for the new space:
+ * blocks missing from value_data are holes that read as zeros, so this
+ * takes the same time however large the hole is. */
+static int key_extend_value(sqlfs_t *sqlfs, const char *key, size_t new_length)
 {
-    char ppath[PATH_MAX];
-    int r, result = 0;
+    int r, inode = 0;
+    size_t l, inline_size;
+    size_t inline_threshold = get_sqlfs(sqlfs)->inline_threshold;
+    const char *tail;
+    sqlite3_stmt *stmt;
+    char *inline_data = 0;
+    static const char *cmd = "update meta_data set size = :size where key = :key; ";
 
+    if (new_length > (BLOCK_NO_MAX + 1) * get_sqlfs(sqlfs)->block_size)
+        return SQLITE_TOOBIG;
     begin_transaction(get_sqlfs(sqlfs));
-    r = get_parent_path(path, ppath);
-    if (r == SQLITE_OK)
+    r = get_key_inline_data(sqlfs, key, &inode, &l, &inline_data, &inline_size);
+    if (r != 1)
     {
-        result = check_parent_access(sqlfs, ppath);
-        if (result == 0)
-            result = (sqlfs_proc_access(sqlfs, (ppath), X_OK));
+        commit_transaction(get_sqlfs(sqlfs), 1);
+        if (r == 2)
+            return SQLITE_BUSY;
+        return SQLITE_ERROR;
+    }
+    assert(l < new_length);
+
+    if (inline_threshold > get_sqlfs(sqlfs)->block_size)
+        inline_threshold = get_sqlfs(sqlfs)->block_size;
+    r = SQLITE_OK;
+    if (inline_data && (new_length <= inline_threshold))
+    {
+        /* small enough to stay inline, pad it out */
+        char *data = calloc(new_length, sizeof(char));
+        assert(data);
+        memcpy(data, inline_data, inline_size);
+        r = set_inline_data(sqlfs, key, data, new_length);
+        free(data);
+        free(inline_data);
+        commit_transaction(get_sqlfs(sqlfs), 1);
+        return r;
+    }
+    if (inline_data)
+    {
+        /* the inline data becomes the first block, the rest is a hole */
+        if (inline_size > 0)
+            r = set_value_block(sqlfs, inode, inline_data, 0, inline_size);
+        if (r == SQLITE_OK)
+            r = set_inline_data(sqlfs, key, 0, 0);
+        free(inline_data);
     }
-    /* else if no parent, we return 0 by default */
 
+    if (r == SQLITE_OK)
+    {
+        SQLITE3_PREPARE(get_sqlfs(sqlfs)->db, cmd, -1, &stmt,  &tail);
+        if (r != SQLITE_OK)
+        {
+            show_msg(stderr, "%s\n", sqlite3_errmsg(get_sqlfs(sqlfs)->db));
+        }
+        else
+        {
+            sqlite3_bind_int64(stmt, 1, new_length);
+            sqlite3_bind_text(stmt, 2, key, -1, SQLITE_STATIC);
+            r = sql_step(stmt);
+            sqlite3_reset(stmt);
+            meta_cache_forget(sqlfs, key);
+            if (r == SQLITE_DONE)
+                r = SQLITE_OK;
+            else
+                show_msg(stderr, "%s\n", sqlite3_errmsg(get_sqlfs(sqlfs)->db));
+        }
+    }
+    key_modified(sqlfs, key);
     commit_transaction(get_sqlfs(sqlfs), 1);
-    return result;
+    return r;
+}
+
+/* group commit, see sqlfs_set_group_commit().  The calls that change the
+ * file system from threads of the thread API are queued here, and one
+ * writer thread runs them on its own connection, many to a transaction,
+ * instead of each committing on its own and taking turns for the lock */
+
+#define GROUP_MKNOD 1
+#define GROUP_MKDIR 2
+#define GROUP_UNLINK 3
+#define GROUP_RMDIR 4
+#define GROUP_SYMLINK 5
+#define GROUP_RENAME 6
+#define GROUP_CHMOD 7
+#define GROUP_CHOWN 8
+#define GROUP_TRUNCATE 9
+#define GROUP_UTIME 10
+#define GROUP_CREATE 11
+#define GROUP_OPEN 12
+#define GROUP_WRITE 13
+
+struct group_op
+{
+    int op; /* GROUP_* */
+    const char *path, *to;
+    const char *buf;
+    size_t size;
+    off_t offset;
+    mode_t mode;
+    dev_t rdev;
+    uid_t uid;
+    gid_t gid;
+    struct utimbuf *times;
+    struct fuse_file_info *fi;
+    int result;
+    int done; /* result is set and its transaction ended */
+    struct group_op *next;
+};
+
+static pthread_mutex_t group_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t group_queued = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t group_done = PTHREAD_COND_INITIALIZER;
+static struct group_op *group_head = 0, **group_tail = &group_head;
+static size_t group_length = 0;
+static int group_started = 0;
+static int group_stopping = 0;
+static pthread_t group_thread;
+
+static int group_run(struct group_op *op)
+{
+    switch (op->op)
+    {
+    case GROUP_MKNOD:
+        return sqlfs_proc_mknod(0, op->path, op->mode, op->rdev);
+    case GROUP_MKDIR:
+        return sqlfs_proc_mkdir(0, op->path, op->mode);
+    case GROUP_UNLINK:
+        return sqlfs_proc_unlink(0, op->path);
+    case GROUP_RMDIR:
+        return sqlfs_proc_rmdir(0, op->path);
+    case GROUP_SYMLINK:
+        return sqlfs_proc_symlink(0, op->path, op->to);
+    case GROUP_RENAME:
+        return sqlfs_proc_rename(0, op->path, op->to);
+    case GROUP_CHMOD:
+        return sqlfs_proc_chmod(0, op->path, op->mode);
+    case GROUP_CHOWN:
+        return sqlfs_proc_chown(0, op->path, op->uid, op->gid);
+    case GROUP_TRUNCATE:
+        return sqlfs_proc_truncate(0, op->path, op->offset);
+    case GROUP_UTIME:
+        return sqlfs_proc_utime(0, op->path, op->times);
+    case GROUP_CREATE:
+        return sqlfs_proc_create(0, op->path, op->mode, op->fi);
+    case GROUP_OPEN:
+        return sqlfs_proc_open(0, op->path, op->fi);
+    case GROUP_WRITE:
+        return sqlfs_proc_write(0, op->path, op->buf, op->size, op->offset, op->fi);
+    }
+    return -ENOSYS;
+}
+
+/* takes up to the limit of calls off the queue, after waiting the delay
+ * for more to arrive, runs them in one transaction and wakes their
+ * threads once it has ended */
+static void *group_writer(void *arg)
+{
+    sqlfs_t *sqlfs = get_sqlfs(0);
+
+    if (sqlfs)
+    {
+        /* the callers give the files they open their buffers */
+        sqlfs->group_writer = 1;
+        sqlfs->write_back_size = 0;
+    }
+    pthread_mutex_lock(&group_lock);
+    for (;;)
+    {
+        struct group_op *batch, *op;
+        size_t n, limit = default_group_commit_ops;
+        int r = SQLITE_OK;
+
+        while (!group_head && !group_stopping)
+            pthread_cond_wait(&group_queued, &group_lock);
+        if (!group_head)
+            break;
+        if (limit == 0)
+            limit = 1;
+        if (default_group_commit_delay && (group_length < limit) && !group_stopping)
+        {
+            struct timeval now;
+            struct timespec until;
+            gettimeofday(&now, 0);
+            until.tv_sec = now.tv_sec + default_group_commit_delay / 1000;
+            until.tv_nsec = (now.tv_usec + (default_group_commit_delay % 1000) * 1000) * 1000;
+            if (until.tv_nsec >= 1000000000)
+            {
+                until.tv_sec++;
+                until.tv_nsec -= 1000000000;
+            }
+            while ((group_length < limit) && !group_stopping)
+                if (pthread_cond_timedwait(&group_queued, &group_lock, &until) == ETIMEDOUT)
+                    break;
+        }
+        batch = group_head;
+        for (op = batch, n = 1; op->next && (n < limit); op = op->next)
+            n++;
+        group_head = op->next;
+        op->next = 0;
+        if (!group_head)
+            group_tail = &group_head;
+        group_length -= n;
+        pthread_mutex_unlock(&group_lock);
+
+        if (sqlfs)
+            r = begin_transaction(sqlfs);
+        for (op = batch; op; op = op->next)
+            op->result = sqlfs ? group_run(op) : -EIO;
+        /* when the batch could not begin as one, each call committed on
+         * its own; when it cannot commit, none of them happened */
+        if (sqlfs && (r == SQLITE_OK) && (commit_transaction(sqlfs, 1) != SQLITE_OK))
+        {
+            break_transaction(sqlfs, 0);
+            sqlfs->transaction_level = 0;
+            for (op = batch; op; op = op->next)
+                op->result = -EIO;
+        }
+
+        pthread_mutex_lock(&group_lock);
+        for (op = batch; op; op = op->next)
+            op->done = 1;
+        pthread_cond_broadcast(&group_done);
+    }
+    pthread_mutex_unlock(&group_lock);
+    return arg;
+}
+
+/* hands op to the writer thread and waits for its result, when group
+ * commit is on and the caller uses the thread API outside a transaction of
+ * its own.  Returns 0 when the caller should run it itself. */
+static int group_commit(sqlfs_t *sqlfs, struct group_op *op)
+{
+    sqlfs_t *own;
+
+    if (sqlfs || !default_group_commit_ops)
+        return 0;
+    own = (sqlfs_t *) pthread_getspecific(pthread_key);
+    /* a write that does not fit the buffer of its file is made holding
+     * write_back_lock, which the writer takes to begin a transaction */
+    if (own && (own->group_writer || own->transaction_level || own->write_back_storing))
+        return 0;
+
+    pthread_mutex_lock(&group_lock);
+    if (!group_started)
+    {
+        if (pthread_create(&group_thread, 0, group_writer, 0) != 0)
+        {
+            pthread_mutex_unlock(&group_lock);
+            return 0;
+        }
+        group_started = 1;
+    }
+    op->done = 0;
+    op->next = 0;
+    *group_tail = op;
+    group_tail = &op->next;
+    group_length++;
+    pthread_cond_signal(&group_queued);
+    while (!op->done)
+        pthread_cond_wait(&group_done, &group_lock);
+    pthread_mutex_unlock(&group_lock);
+    return 1;
+}
+
+/* runs what is still queued and ends the writer thread */
+static void group_commit_stop(void)
+{
+    int started;
+
+    pthread_mutex_lock(&group_lock);
+    started = group_started;
+    group_stopping = 1;
+    pthread_cond_signal(&group_queued);
+    pthread_mutex_unlock(&group_lock);
+    if (started)
+        pthread_join(group_thread, 0);
+    pthread_mutex_lock(&group_lock);
+    group_started = 0;
+    group_stopping = 0;
+    pthread_mutex_unlock(&group_lock);
 }
 
+static int check_parent_access(sqlfs_t *sqlfs, const char *path);
 
 static int check_parent_write(sqlfs_t *sqlfs, const char *path)
 {
@@ -1797,7 +3378,7 @@ int sqlfs_proc_getattr(sqlfs_t *sqlfs, const char *path, struct stat *stbuf)
     key_attr attr = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
     int r, result = 0;
 
-    begin_transaction(get_sqlfs(sqlfs));
+    begin_read_transaction(get_sqlfs(sqlfs));
     CHECK_PARENT_PATH(path);
     CHECK_READ(path);
 
@@ -1855,9 +3436,31 @@ static int gid_in_supp_groups(gid_t gid)
 }
 
 
-int sqlfs_proc_access(sqlfs_t *sqlfs, const char *path, int mask)
+/* whether a user may access a key owned by fuid:fgid with mode fmode as
+ * mask asks */
+static int mode_allows(uid_t uid, gid_t gid, uid_t fuid, gid_t fgid, mode_t fmode, int mask)
 {
+    if (uid == fuid)
+        return !(((mask & R_OK) && !(S_IRUSR & fmode)) ||
+                 ((mask & W_OK) && !(S_IWUSR & fmode)) ||
+                 ((mask & X_OK) && !(S_IXUSR & fmode)));
+    if ((gid == fgid) || gid_in_supp_groups(fgid))
+        return !(((mask & R_OK) && !(S_IRGRP & fmode)) ||
+                 ((mask & W_OK) && !(S_IWGRP & fmode)) ||
+                 ((mask & X_OK) && !(S_IXGRP & fmode)));
+    return !(((mask & R_OK) && !(S_IROTH & fmode)) ||
+             ((mask & W_OK) && !(S_IWOTH & fmode)) ||
+             ((mask & X_OK) && !(S_IXOTH & fmode)));
+}
 
+/* checks that every directory above path exists and may be searched.  The
+ * rows of the whole chain are fetched at once, unless path is in the cache
+ * already, and checked from the root down. */
+static int check_parent_access(sqlfs_t *sqlfs, const char *path)
+{
+    char ppath[PATH_MAX];
+    struct meta_entry *e;
+    size_t i, len;
     int r = SQLITE_OK, result = 0;
 #ifdef HAVE_LIBFUSE
     gid_t gid = getegid();
@@ -1866,26 +3469,72 @@ int sqlfs_proc_access(sqlfs_t *sqlfs, const char *path, int mask)
     gid_t gid = get_sqlfs(sqlfs)->gid;
     uid_t uid = get_sqlfs(sqlfs)->uid;
 #endif
-    /* init based on least permission, in case of trouble */
-    uid_t fuid = UINT_MAX;
-    gid_t fgid = UINT_MAX;
-    mode_t fmode = 0;
 
-    begin_transaction(get_sqlfs(sqlfs));
+    if (get_parent_path(path, ppath) != SQLITE_OK)
+        return 0; /* no parent */
 
-    if (uid == 0) /* root user so everything is granted */
+    begin_read_transaction(get_sqlfs(sqlfs));
+    /* the row of path itself comes along, the caller looks it up next */
+    if (!meta_cache_find(sqlfs, path))
+        r = get_meta_ancestors(sqlfs, path);
+
+    len = strlen(ppath);
+    for (i = 1; (r == SQLITE_OK) && (result == 0) && (i <= len); i++)
     {
-        int i = key_exists(sqlfs, path, 0);
-        if (i == 0)
+        /* the root, then each directory below it */
+        char c = ppath[i];
+        if ((i > 1) && (c != '/') && (c != 0))
+            continue;
+        ppath[i] = 0;
+        r = get_meta(sqlfs, ppath, &e);
+        if (r != SQLITE_OK)
+            ;
+        else if (!e->exists)
             result = -ENOENT;
-        else if (i == 2)
-            result = -EBUSY;
-
-        commit_transaction(get_sqlfs(sqlfs), 1);
-        return result;
+        else if ((uid != 0) && !mode_allows(uid, gid, e->uid, e->gid, e->mode, X_OK))
+            result = -EACCES;
+        ppath[i] = c;
     }
+    if (r == SQLITE_BUSY)
+        result = -EBUSY;
+    else if (r != SQLITE_OK)
+        result = -EIO;
 
-    if (mask & F_OK)
+    commit_transaction(get_sqlfs(sqlfs), 1);
+    return result;
+}
+
+int sqlfs_proc_access(sqlfs_t *sqlfs, const char *path, int mask)
+{
+
+    int r = SQLITE_OK, result = 0;
+#ifdef HAVE_LIBFUSE
+    gid_t gid = getegid();
+    uid_t uid = geteuid();
+#else
+    gid_t gid = get_sqlfs(sqlfs)->gid;
+    uid_t uid = get_sqlfs(sqlfs)->uid;
+#endif
+    /* init based on least permission, in case of trouble */
+    uid_t fuid = UINT_MAX;
+    gid_t fgid = UINT_MAX;
+    mode_t fmode = 0;
+
+    begin_read_transaction(get_sqlfs(sqlfs));
+
+    if (uid == 0) /* root user so everything is granted */
+    {
+        int i = key_exists(sqlfs, path, 0);
+        if (i == 0)
+            result = -ENOENT;
+        else if (i == 2)
+            result = -EBUSY;
+
+        commit_transaction(get_sqlfs(sqlfs), 1);
+        return result;
+    }
+
+    if (mask & F_OK)
     {
         r = get_parent_permission_data(sqlfs, path, &fgid, &fuid, &fmode);
         if (r == SQLITE_OK)
@@ -1914,31 +3563,8 @@ int sqlfs_proc_access(sqlfs_t *sqlfs, const char *path, int mask)
         r = get_permission_data(get_sqlfs(sqlfs), path, &fgid, &fuid, &fmode);
     if ((r == SQLITE_OK) && (result == 0))
     {
-        if (uid == (uid_t) fuid)
-        {
-            if (((mask & R_OK) && !(S_IRUSR & fmode))  ||
-                    ((mask & W_OK) && !(S_IWUSR & fmode))  ||
-                    ((mask & X_OK) && !(S_IXUSR & fmode)))
-            {
-                result = -EACCES;
-            }
-        }
-        else if ((gid == (uid_t) fgid) || (gid_in_supp_groups(fgid)))
-        {
-            if (((mask & R_OK) && !(S_IRGRP & fmode))  ||
-                    ((mask & W_OK) && !(S_IWGRP & fmode))  ||
-                    ((mask & X_OK) && !(S_IXGRP & fmode)))
-            {
-                result = -EACCES;
-            }
-        }
-
-        else if (((mask & R_OK) && !(S_IROTH & fmode))  ||
-                 ((mask & W_OK) && !(S_IWOTH & fmode))  ||
-                 ((mask & X_OK) && !(S_IXOTH & fmode)))
-        {
+        if (!mode_allows(uid, gid, fuid, fgid, fmode, mask))
             result = -EACCES;
-        }
     }
     else if (r == SQLITE_NOTFOUND)
         result = -ENOENT;
@@ -1954,7 +3580,7 @@ int sqlfs_proc_readlink(sqlfs_t *sqlfs, const char *path, char *buf, size_t size
     key_attr attr = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
     key_value value = { 0, 0 };
     int r, result = 0;
-    begin_transaction(get_sqlfs(sqlfs));
+    begin_read_transaction(get_sqlfs(sqlfs));
     CHECK_PARENT_PATH(path);
     CHECK_READ(path);
     r = get_attr(get_sqlfs(sqlfs), path, &attr);
@@ -1991,12 +3617,12 @@ int sqlfs_proc_readdir(sqlfs_t *sqlfs, const char *path, void *buf, fuse_fill_di
 {
     int i, r, result = 0;
     const char *tail;
-    const char *t, *t2;
-    static const char *cmd = "select key, mode from meta_data where key glob :pattern; ";
-    char tmp[PATH_MAX];
+    const char *t;
+    static const char *cmd = "select name from dentry where parent = "
+                             "(select inode from meta_data where key = :key); ";
     char *lpath;
     sqlite3_stmt *stmt;
-    begin_transaction(get_sqlfs(sqlfs));
+    begin_read_transaction(get_sqlfs(sqlfs));
     CHECK_PARENT_PATH(path);
     CHECK_DIR_READ(path);
 
@@ -2016,7 +3642,6 @@ int sqlfs_proc_readdir(sqlfs_t *sqlfs, const char *path, void *buf, fuse_fill_di
     remove_tail_slash(lpath);
     filler(buf, ".", NULL, 0);
     filler(buf, "..", NULL, 0);
-    snprintf(tmp, sizeof(tmp), "%s/*", lpath);
 
     SQLITE3_PREPARE(get_sqlfs(sqlfs)->db, cmd, -1, &stmt,  &tail);
     if (r != SQLITE_OK)
@@ -2027,7 +3652,7 @@ int sqlfs_proc_readdir(sqlfs_t *sqlfs, const char *path, void *buf, fuse_fill_di
     }
     if (result == 0)
     {
-        sqlite3_bind_text(stmt, 1, tmp, -1, SQLITE_STATIC);
+        sqlite3_bind_text(stmt, 1, *lpath ? lpath : "/", -1, SQLITE_STATIC);
 
         while (1)
         {
@@ -2035,15 +3660,7 @@ int sqlfs_proc_readdir(sqlfs_t *sqlfs, const char *path, void *buf, fuse_fill_di
             if (r == SQLITE_ROW)
             {
                 t = (const char *)sqlite3_column_text(stmt, 0);
-                if (!strcmp(t, lpath))
-                    continue;
-                t2 = t + strlen(lpath) + 1;
-                if (strchr(t2, '/'))
-                    continue; /* grand child, etc. */
-                if (*t2 == 0) /* special case when dir the root directory */
-                    continue;
-
-                if (filler(buf, t2, NULL, 0))
+                if (filler(buf, t, NULL, 0))
                     break;
             }
             else if (r == SQLITE_DONE)
@@ -2068,6 +3685,7 @@ int sqlfs_proc_readdir(sqlfs_t *sqlfs, const char *path, void *buf, fuse_fill_di
 
 int sqlfs_proc_mknod(sqlfs_t *sqlfs, const char *path, mode_t mode, dev_t rdev)
 {
+    struct group_op group = { GROUP_MKNOD };
     key_attr attr = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
     int r, result = 0;
     if ((S_IFCHR & mode) || (S_IFBLK & mode))
@@ -2075,6 +3693,11 @@ int sqlfs_proc_mknod(sqlfs_t *sqlfs, const char *path, mode_t mode, dev_t rdev)
 
     if (!((S_IFREG & mode) || (S_IFIFO & mode) || (S_IFSOCK & mode)))
         return -EINVAL;
+    group.path = path;
+    group.mode = mode;
+    group.rdev = rdev;
+    if (group_commit(sqlfs, &group))
+        return group.result;
     begin_transaction(get_sqlfs(sqlfs));
     CHECK_PARENT_WRITE(path);
 
@@ -2096,7 +3719,7 @@ int sqlfs_proc_mknod(sqlfs_t *sqlfs, const char *path, mode_t mode, dev_t rdev)
     attr.uid = get_sqlfs(sqlfs)->uid;
 #endif
     attr.size = 0;
-    attr.inode = get_new_inode();
+    attr.inode = get_new_inode(sqlfs);
     r = set_attr(get_sqlfs(sqlfs), path, &attr);
     if (r == SQLITE_BUSY)
         result = -EBUSY;
@@ -2109,8 +3732,13 @@ int sqlfs_proc_mknod(sqlfs_t *sqlfs, const char *path, mode_t mode, dev_t rdev)
 
 int sqlfs_proc_mkdir(sqlfs_t *sqlfs, const char *path, mode_t mode)
 {
+    struct group_op group = { GROUP_MKDIR };
     key_attr attr = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
     int r, result = 0;
+    group.path = path;
+    group.mode = mode;
+    if (group_commit(sqlfs, &group))
+        return group.result;
     begin_transaction(get_sqlfs(sqlfs));
     CHECK_PARENT_WRITE(path);
 
@@ -2133,7 +3761,7 @@ int sqlfs_proc_mkdir(sqlfs_t *sqlfs, const char *path, mode_t mode)
     attr.uid = get_sqlfs(sqlfs)->uid;
 #endif
     attr.size = 0;
-    attr.inode = get_new_inode();
+    attr.inode = get_new_inode(sqlfs);
     r = set_attr(get_sqlfs(sqlfs), path, &attr);
     if (r == SQLITE_BUSY)
         result = -EBUSY;
@@ -2146,7 +3774,11 @@ int sqlfs_proc_mkdir(sqlfs_t *sqlfs, const char *path, mode_t mode)
 
 int sqlfs_proc_unlink(sqlfs_t *sqlfs, const char *path)
 {
+    struct group_op group = { GROUP_UNLINK };
     int i, result = 0;
+    group.path = path;
+    if (group_commit(sqlfs, &group))
+        return group.result;
     begin_transaction(get_sqlfs(sqlfs));
     CHECK_PARENT_WRITE(path);
 
@@ -2173,7 +3805,11 @@ int sqlfs_proc_unlink(sqlfs_t *sqlfs, const char *path)
 
 int sqlfs_proc_rmdir(sqlfs_t *sqlfs, const char *path)
 {
+    struct group_op group = { GROUP_RMDIR };
     int result = 0;
+    group.path = path;
+    if (group_commit(sqlfs, &group))
+        return group.result;
     begin_transaction(get_sqlfs(sqlfs));
     CHECK_PARENT_WRITE(path);
 
@@ -2193,9 +3829,14 @@ int sqlfs_proc_rmdir(sqlfs_t *sqlfs, const char *path)
 
 int sqlfs_proc_symlink(sqlfs_t *sqlfs, const char *path, const char *to)
 {
+    struct group_op group = { GROUP_SYMLINK };
     key_attr attr = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
     key_value value = { 0, 0 };
     int r, result = 0;
+    group.path = path;
+    group.to = to;
+    if (group_commit(sqlfs, &group))
+        return group.result;
     begin_transaction(get_sqlfs(sqlfs));
     CHECK_PARENT_WRITE(to);
 
@@ -2219,7 +3860,7 @@ int sqlfs_proc_symlink(sqlfs_t *sqlfs, const char *path, const char *to)
 
 #endif
     attr.size = 0;
-    attr.inode = get_new_inode();
+    attr.inode = get_new_inode(sqlfs);
     r = set_attr(get_sqlfs(sqlfs), to, &attr);
 
     if (r != SQLITE_OK)
@@ -2243,6 +3884,9 @@ int sqlfs_proc_symlink(sqlfs_t *sqlfs, const char *path, const char *to)
     return result;
 }
 
+#undef INDEX
+#define INDEX 33
+
 static int rename_dir_children(sqlfs_t *sqlfs, const char *old, const char *new)
 {
     int i, r, result = 0;
@@ -2348,7 +3992,12 @@ static int rename_dir_children(sqlfs_t *sqlfs, const char *old, const char *new)
 
 int sqlfs_proc_rename(sqlfs_t *sqlfs, const char *from, const char *to)
 {
+    struct group_op group = { GROUP_RENAME };
     int i, r = SQLITE_OK, result = 0;
+    group.path = from;
+    group.to = to;
+    if (group_commit(sqlfs, &group))
+        return group.result;
     begin_transaction(get_sqlfs(sqlfs));
     CHECK_PARENT_WRITE(from);
     CHECK_PARENT_WRITE(to);
@@ -2422,8 +4071,13 @@ int sqlfs_proc_link(sqlfs_t *sqlfs, const char *from, const char *to)
 
 int sqlfs_proc_chmod(sqlfs_t *sqlfs, const char *path, mode_t mode)
 {
+    struct group_op group = { GROUP_CHMOD };
     int r, result = 0;
     key_attr attr = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 } ;
+    group.path = path;
+    group.mode = mode;
+    if (group_commit(sqlfs, &group))
+        return group.result;
     begin_transaction(get_sqlfs(sqlfs));
     CHECK_PARENT_PATH(path);
 
@@ -2463,9 +4117,15 @@ int sqlfs_proc_chmod(sqlfs_t *sqlfs, const char *path, mode_t mode)
 
 int sqlfs_proc_chown(sqlfs_t *sqlfs, const char *path, uid_t uid, gid_t gid)
 {
+    struct group_op group = { GROUP_CHOWN };
     int r, result = 0;
     key_attr attr = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 } ;
 
+    group.path = path;
+    group.uid = uid;
+    group.gid = gid;
+    if (group_commit(sqlfs, &group))
+        return group.result;
     begin_transaction(get_sqlfs(sqlfs));
     CHECK_PARENT_PATH(path);
 
@@ -2504,10 +4164,15 @@ int sqlfs_proc_chown(sqlfs_t *sqlfs, const char *path, uid_t uid, gid_t gid)
 
 int sqlfs_proc_truncate(sqlfs_t *sqlfs, const char *path, off_t size)
 {
+    struct group_op group = { GROUP_TRUNCATE };
     int i, r, result = 0;
     size_t existing_size = 0;
     key_value value = { 0, 0 };
 
+    group.path = path;
+    group.offset = size;
+    if (group_commit(sqlfs, &group))
+        return group.result;
     begin_transaction(get_sqlfs(sqlfs));
     CHECK_PARENT_PATH(path);
     CHECK_WRITE(path);
@@ -2534,14 +4199,13 @@ int sqlfs_proc_truncate(sqlfs_t *sqlfs, const char *path, off_t size)
     }
     else if (existing_size < (size_t) size)
     {
-        value.size = size - existing_size;
-        value.data = calloc(value.size, sizeof(char));
-        memset(value.data, 0, value.size);
-        r = set_value(get_sqlfs(sqlfs), path, &value, existing_size, size);
+        r = key_extend_value(get_sqlfs(sqlfs), path, size);
         if (r != SQLITE_OK)
         {
             if (r == SQLITE_BUSY)
                 result = -EBUSY;
+            else if (r == SQLITE_TOOBIG)
+                result = -EFBIG;
             else
                 result = -EACCES;
         }
@@ -2553,9 +4217,14 @@ int sqlfs_proc_truncate(sqlfs_t *sqlfs, const char *path, off_t size)
 
 int sqlfs_proc_utime(sqlfs_t *sqlfs, const char *path, struct utimbuf *buf)
 {
+    struct group_op group = { GROUP_UTIME };
     int r, result = 0;
     time_t now;
     key_attr attr = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 } ;
+    group.path = path;
+    group.times = buf;
+    if (group_commit(sqlfs, &group))
+        return group.result;
     begin_transaction(get_sqlfs(sqlfs));
     CHECK_PARENT_PATH(path);
     CHECK_WRITE(path);
@@ -2596,12 +4265,22 @@ int sqlfs_proc_utime(sqlfs_t *sqlfs, const char *path, struct utimbuf *buf)
 
 int sqlfs_proc_create(sqlfs_t *sqlfs, const char *path, mode_t mode, struct fuse_file_info *fi)
 {
+    struct group_op group = { GROUP_CREATE };
     int r, result = 0;
     key_attr attr = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
 
     if (fi->direct_io)
         return  -EACCES;
 
+    group.path = path;
+    group.mode = mode;
+    group.fi = fi;
+    if (group_commit(sqlfs, &group))
+    {
+        if (group.result == 0)
+            write_back_open(sqlfs, path, fi);
+        return group.result;
+    }
     fi->flags |= O_CREAT | O_WRONLY | O_TRUNC;
     begin_transaction(get_sqlfs(sqlfs));
     CHECK_PARENT_WRITE(path);
@@ -2636,7 +4315,7 @@ int sqlfs_proc_create(sqlfs_t *sqlfs, const char *path, mode_t mode, struct fuse
         if (attr.path == 0)
         {
             attr.path = strdup(path);
-            attr.inode = get_new_inode();
+            attr.inode = get_new_inode(sqlfs);
         }
         if (attr.type == 0)
             attr.type = strdup(TYPE_BLOB);
@@ -2648,6 +4327,8 @@ int sqlfs_proc_create(sqlfs_t *sqlfs, const char *path, mode_t mode, struct fuse
     }
     clean_attr(&attr);
     commit_transaction(get_sqlfs(sqlfs), 1);
+    if (result == 0)
+        write_back_open(sqlfs, path, fi);
     return result;
 }
 
@@ -2658,7 +4339,22 @@ int sqlfs_proc_open(sqlfs_t *sqlfs, const char *path, struct fuse_file_info *fi)
 
     if (fi->direct_io)
         return  -EACCES;
-    begin_transaction(get_sqlfs(sqlfs));
+    /* opening without creating or truncating only looks */
+    if ((fi->flags & O_CREAT) || ((fi->flags & O_TRUNC) && (fi->flags & (O_WRONLY | O_RDWR))))
+    {
+        struct group_op group = { GROUP_OPEN };
+        group.path = path;
+        group.fi = fi;
+        if (group_commit(sqlfs, &group))
+        {
+            if (group.result == 0)
+                write_back_open(sqlfs, path, fi);
+            return group.result;
+        }
+        begin_transaction(get_sqlfs(sqlfs));
+    }
+    else
+        begin_read_transaction(get_sqlfs(sqlfs));
 
     if ((fi->flags & O_CREAT) )
     {
@@ -2720,7 +4416,7 @@ int sqlfs_proc_open(sqlfs_t *sqlfs, const char *path, struct fuse_file_info *fi)
         if (attr.path == 0)
         {
             attr.path = strdup(path);
-            attr.inode = get_new_inode();
+            attr.inode = get_new_inode(sqlfs);
         }
         if (attr.type == 0)
             attr.type = strdup(TYPE_BLOB);
@@ -2732,20 +4428,542 @@ int sqlfs_proc_open(sqlfs_t *sqlfs, const char *path, struct fuse_file_info *fi)
     }
     clean_attr(&attr);
     commit_transaction(get_sqlfs(sqlfs), 1);
+    if (result == 0)
+        write_back_open(sqlfs, path, fi);
+    return result;
+}
+
+/* the read-ahead buffer is current as long as neither another connection
+ * committed (data_version) nor this one changed a row since it was filled */
+static void read_ahead_snapshot(sqlfs_t *sqlfs, struct read_ahead *ra)
+{
+    ra->data_version = get_sqlfs(sqlfs)->data_version;
+    ra->changes = sqlite3_total_changes(get_sqlfs(sqlfs)->db);
+}
+
+static int read_ahead_current(sqlfs_t *sqlfs, struct read_ahead *ra)
+{
+    return (ra->changes == sqlite3_total_changes(get_sqlfs(sqlfs)->db)) &&
+           (ra->data_version == get_sqlfs(sqlfs)->data_version);
+}
+
+/* fetches file data up to end into the read-ahead buffer, which then starts
+ * at offset.  Data already in the buffer from offset on is kept. */
+static int read_ahead_fill(sqlfs_t *sqlfs, struct read_ahead *ra, const char *path,
+                           size_t offset, size_t end)
+{
+    int r;
+    size_t kept = 0;
+    key_value value = { 0, 0 };
+
+    if (ra->capacity < end - offset)
+    {
+        free(ra->data);
+        ra->capacity = end - offset;
+        ra->data = malloc(ra->capacity);
+        assert(ra->data);
+        ra->end = 0;
+    }
+    if ((ra->begin <= offset) && (offset < ra->end))
+    {
+        kept = ra->end - offset;
+        memmove(ra->data, ra->data + (offset - ra->begin), kept);
+    }
+    value.data = ra->data + kept;
+    value.size = end - offset - kept;
+    r = get_value(get_sqlfs(sqlfs), path, &value, offset + kept, end);
+    if (r == SQLITE_OK)
+    {
+        ra->begin = offset;
+        ra->end = end;
+        read_ahead_snapshot(sqlfs, ra);
+    }
+    else
+        ra->end = 0;
+    return r;
+}
+
+static struct write_back *write_back_of(struct fuse_file_info *fi)
+{
+    return (fi && fi->fh) ? (struct write_back *) (uintptr_t) fi->fh : 0;
+}
+
+/* the size of the file known to the buffer is right as long as neither
+ * another connection committed (data_version) nor the one it was checked
+ * on changed a row since */
+static void write_back_snapshot(sqlfs_t *sqlfs, struct write_back *wb)
+{
+    wb->known_on = get_sqlfs(sqlfs)->serial;
+    wb->data_version = get_sqlfs(sqlfs)->data_version;
+    wb->changes = sqlite3_total_changes(get_sqlfs(sqlfs)->db);
+}
+
+static int write_back_current(sqlfs_t *sqlfs, struct write_back *wb)
+{
+    if (wb->known_on != get_sqlfs(sqlfs)->serial)
+        return 0;
+    if (get_sqlfs(sqlfs)->transaction_level == 0)
+        meta_cache_check(sqlfs);
+    return (wb->changes == sqlite3_total_changes(get_sqlfs(sqlfs)->db)) &&
+           (wb->data_version == get_sqlfs(sqlfs)->data_version);
+}
+
+/* tells whether the data loaded from the file is what the database has,
+ * the file being size bytes long */
+static int write_back_verify(sqlfs_t *sqlfs, struct write_back *wb, size_t size)
+{
+    key_value value;
+    int same;
+
+    if (wb->begin == wb->clean)
+        return 1;
+    if (size < wb->clean)
+        return 0;
+    value.size = wb->clean - wb->begin;
+    value.data = malloc(value.size);
+    assert(value.data);
+    same = (get_value(get_sqlfs(sqlfs), wb->path, &value, wb->begin, wb->clean) == SQLITE_OK) &&
+           !memcmp(value.data, wb->data, value.size);
+    free(value.data);
+    return same;
+}
+
+/* drops the data loaded from the file and keeps the writes held */
+static void write_back_unload(struct write_back *wb)
+{
+    if (wb->clean == wb->end)
+    {
+        wb->begin = wb->end = wb->clean = 0;
+        return;
+    }
+    memmove(wb->data, wb->data + (wb->clean - wb->begin), wb->end - wb->clean);
+    wb->begin = wb->clean;
+}
+
+/* loads the last block of the file into the empty buffer when it is not
+ * full, so the writes that continue it complete it there and it is stored
+ * once rather than on every store */
+static void write_back_load_tail(sqlfs_t *sqlfs, struct write_back *wb)
+{
+    size_t block_size = get_sqlfs(sqlfs)->block_size;
+    size_t tail = wb->size % block_size;
+    key_value value;
+
+    if (!tail || (tail >= wb->limit))
+        return;
+    if (!wb->data)
+    {
+        wb->data = malloc(wb->limit + block_size);
+        assert(wb->data);
+    }
+    value.data = wb->data;
+    value.size = tail;
+    begin_read_transaction(get_sqlfs(sqlfs));
+    if (get_value(get_sqlfs(sqlfs), wb->path, &value, wb->size - tail, wb->size) == SQLITE_OK)
+    {
+        wb->begin = wb->size - tail;
+        wb->end = wb->clean = wb->size;
+    }
+    commit_transaction(get_sqlfs(sqlfs), 1);
+}
+
+/* makes sure the size of the file and the data loaded from it are known on
+ * this connection, reading them again if they are not current.  Returns 0
+ * if the file is gone, or if the appends held no longer start at its end. */
+static int write_back_check(sqlfs_t *sqlfs, struct write_back *wb)
+{
+    int i;
+    size_t size = 0;
+
+    if (write_back_current(sqlfs, wb))
+        return 1;
+    begin_read_transaction(get_sqlfs(sqlfs));
+    i = key_exists(get_sqlfs(sqlfs), wb->path, &size);
+    /* data loaded that no longer is the end of the file is of no use */
+    if ((i == 1) && (!write_back_verify(sqlfs, wb, size) ||
+                     ((wb->clean == wb->end) && (size != wb->end))))
+        write_back_unload(wb);
+    commit_transaction(get_sqlfs(sqlfs), 1);
+    if ((i != 1) || (wb->appends && (wb->clean < wb->end) && (size != wb->size)))
+        return 0;
+    wb->size = size;
+    if (get_sqlfs(sqlfs)->transaction_level == 0)
+        write_back_snapshot(sqlfs, wb);
+    return 1;
+}
+
+/* stores the writes held for the file in a transaction of their own.  The
+ * file has to exist still, it is not created again when it was unlinked
+ * meanwhile, and appends go to its end even if another connection moved
+ * it.  Data loaded from the file is stored with them while the database
+ * still has it, so the blocks are written whole, and the last block, when
+ * it is not full, stays in the buffer for the writes that continue it;
+ * with whole_blocks it is not stored yet.  When the database is busy the
+ * writes stay held to be stored by a later call, other failures drop them
+ * and are kept to be reported by the next write and by fsync or release. */
+static int write_back_store(sqlfs_t *sqlfs, struct write_back *wb, int whole_blocks)
+{
+    int i, r, whole, keep = 0;
+    size_t block_size = get_sqlfs(sqlfs)->block_size;
+    size_t size = 0, at = wb->clean, from = wb->clean, to = wb->end;
+    size_t tail = wb->end / block_size * block_size;
+    key_value value;
+
+    if (wb->clean == wb->end)
+        return SQLITE_OK;
+    whole = write_back_current(sqlfs, wb);
+    r = begin_transaction(get_sqlfs(sqlfs));
+    if (r == SQLITE_OK)
+    {
+        i = key_exists(get_sqlfs(sqlfs), wb->path, &size);
+        if (i == 2)
+            r = SQLITE_BUSY;
+        else if (i != 1)
+            r = SQLITE_NOTFOUND;
+        else
+        {
+            if (wb->appends)
+                at = size;
+            whole = (at == wb->clean) && (whole || write_back_verify(sqlfs, wb, size));
+            if (tail < wb->begin)
+                tail = wb->begin;
+            /* a tail as long as the limit is stored and dropped */
+            keep = whole && (tail < wb->end) && (wb->end - tail < wb->limit);
+            if (whole)
+                from = wb->begin;
+            if (keep && whole_blocks && (tail > wb->begin))
+                to = tail;
+            value.data = wb->data + (from - wb->begin);
+            value.size = to - from;
+            at -= wb->clean - from;
+            r = set_value(get_sqlfs(sqlfs), wb->path, &value, at, at + value.size);
+            if (size < at + value.size)
+                size = at + value.size;
+        }
+        commit_transaction(get_sqlfs(sqlfs), 1);
+    }
+    if (r == SQLITE_BUSY)
+        return r;
+    if (r == SQLITE_OK)
+    {
+        wb->size = size;
+        if (get_sqlfs(sqlfs)->transaction_level == 0)
+            write_back_snapshot(sqlfs, wb);
+    }
+    else
+    {
+        if (!wb->error)
+        {
+            if (r == SQLITE_TOOBIG)
+                wb->error = -EFBIG;
+            else if (r == SQLITE_NOTFOUND)
+                wb->error = -ENOENT;
+            else
+                wb->error = -EIO;
+            wb->write_error = wb->error;
+        }
+        wb->known_on = 0;
+    }
+    if (keep && (r == SQLITE_OK))
+    {
+        memmove(wb->data, wb->data + (tail - wb->begin), wb->end - tail);
+        wb->begin = tail;
+        wb->clean = to;
+    }
+    else
+        wb->begin = wb->end = wb->clean = 0;
+    return r;
+}
+
+/* stores the writes held before the file is used another way, and makes
+ * path the one they are held for.  Returns SQLITE_BUSY when they are
+ * still held. */
+static int write_back_flush(sqlfs_t *sqlfs, struct write_back *wb, const char *path)
+{
+    if (write_back_store(sqlfs, wb, 0) == SQLITE_BUSY)
+        return SQLITE_BUSY;
+    if (strcmp(wb->path, path))
+    {
+        free(wb->path);
+        wb->path = strdup(path);
+        wb->begin = wb->end = wb->clean = 0;
+        wb->known_on = 0;
+    }
+    return SQLITE_OK;
+}
+
+/* gives a file opened for writing a buffer to hold its writes back, when
+ * the connection has write-back on */
+static void write_back_open(sqlfs_t *sqlfs, const char *path, struct fuse_file_info *fi)
+{
+    struct write_back *wb;
+
+    fi->fh = 0;
+    if (!get_sqlfs(sqlfs)->write_back_size || !(fi->flags & (O_WRONLY | O_RDWR)))
+        return;
+    wb = calloc(1, sizeof(*wb));
+    assert(wb);
+    wb->path = strdup(path);
+    wb->limit = get_sqlfs(sqlfs)->write_back_size;
+    wb->delay = get_sqlfs(sqlfs)->write_back_delay;
+    pthread_mutex_lock(&write_back_lock);
+    wb->next = write_back_files;
+    write_back_files = wb;
+    pthread_mutex_unlock(&write_back_lock);
+    fi->fh = (uintptr_t) wb;
+}
+
+/* drops the buffer of a file, under write_back_lock */
+static void write_back_free(struct write_back *wb)
+{
+    struct write_back **p;
+
+    for (p = &write_back_files; *p != wb; p = &(*p)->next)
+        ;
+    *p = wb->next;
+    free(wb->path);
+    free(wb->data);
+    free(wb);
+}
+
+/* stores the writes held for every open file but except before a
+ * transaction begins, so it sees them, and frees the buffers of files
+ * released while they could not be stored once they are */
+static void write_back_store_all(sqlfs_t *sqlfs, struct write_back *except)
+{
+    struct write_back *wb, *next;
+
+    if (get_sqlfs(sqlfs)->write_back_storing)
+        return;
+    pthread_mutex_lock(&write_back_lock);
+    /* the transactions would store the writes of every file again */
+    get_sqlfs(sqlfs)->write_back_storing = 1;
+    for (wb = write_back_files; wb; wb = next)
+    {
+        next = wb->next;
+        if (wb != except)
+            write_back_store(sqlfs, wb, 0);
+        if (wb->released && (wb->clean == wb->end))
+            write_back_free(wb);
+    }
+    get_sqlfs(sqlfs)->write_back_storing = 0;
+    pthread_mutex_unlock(&write_back_lock);
+}
+
+/* a call on an open file uses its buffer under write_back_lock, after
+ * storing what the others hold so it sees the file as every call before
+ * left it.  The transactions it begins meanwhile store nothing. */
+static void write_back_enter(sqlfs_t *sqlfs, struct write_back *wb)
+{
+    write_back_store_all(sqlfs, wb);
+    pthread_mutex_lock(&write_back_lock);
+    get_sqlfs(sqlfs)->write_back_storing = 1;
+}
+
+static void write_back_leave(sqlfs_t *sqlfs)
+{
+    get_sqlfs(sqlfs)->write_back_storing = 0;
+    pthread_mutex_unlock(&write_back_lock);
+}
+
+/* holds a write back if it continues or overlaps the ones held.  Returns 0
+ * if the write has to go to the database. */
+static int write_back_hold(sqlfs_t *sqlfs, struct write_back *wb, const char *path,
+                           const char *buf, size_t size, off_t offset, int append)
+{
+    size_t block_size = get_sqlfs(sqlfs)->block_size;
+    size_t begin = offset, end, held_begin, held_end;
+    int known, stored = 0;
+    struct timeval now;
+
+    if (strcmp(wb->path, path) || wb->error)
+        return 0;
+    /* appends that follow appends held go after them, the offset they are
+     * stored at is taken from the database by write_back_store() */
+    if (append && wb->appends && (wb->clean < wb->end))
+        begin = wb->end;
+    else if (append || (wb->begin == wb->end))
+    {
+        /* appends start at the end of the file, so it has to be known, and
+         * the first write there loads the last block */
+        known = write_back_check(sqlfs, wb);
+        if (append && !known)
+            return 0;
+        if (append)
+            begin = (wb->end > wb->size) ? wb->end : wb->size;
+        if (known && (wb->begin == wb->end) && (begin == wb->size))
+            write_back_load_tail(sqlfs, wb);
+    }
+    /* data loaded is only ever followed by writes */
+    if ((wb->begin < wb->clean) && (begin < wb->clean))
+        return 0;
+    end = begin + size;
+    for (;;)
+    {
+        if (wb->begin == wb->end)
+            held_begin = begin, held_end = end;
+        else if ((end < wb->begin) || (begin > wb->end))
+            return 0;
+        else
+        {
+            held_begin = (begin < wb->begin) ? begin : wb->begin;
+            held_end = (end > wb->end) ? end : wb->end;
+        }
+        /* the buffer has room for a block more than the limit, so a
+         * write can complete the last block before it is stored */
+        if (held_end - held_begin <= wb->limit + block_size)
+            break;
+        if (stored || (wb->clean == wb->end) ||
+            (write_back_store(sqlfs, wb, 1) != SQLITE_OK))
+            return 0;
+        stored = 1;
+        if (append)
+        {
+            begin = (wb->end > wb->size) ? wb->end : wb->size;
+            end = begin + size;
+        }
+    }
+    if (held_end > (BLOCK_NO_MAX + 1) * block_size)
+        return 0;
+
+    if (!wb->data)
+    {
+        wb->data = malloc(wb->limit + block_size);
+        assert(wb->data);
+    }
+    gettimeofday(&now, 0);
+    if (wb->clean == wb->end)
+    {
+        wb->since = now;
+        wb->appends = append;
+    }
+    else if (!append)
+        wb->appends = 0;
+    if ((wb->begin < wb->end) && (begin < wb->begin))
+        memmove(wb->data + (wb->begin - begin), wb->data, wb->end - wb->begin);
+    if ((wb->begin == wb->end) || (begin < wb->clean))
+        wb->clean = begin;
+    wb->begin = held_begin;
+    wb->end = held_end;
+    memcpy(wb->data + (begin - held_begin), buf, size);
+
+    /* a full buffer stores its whole blocks, and writes held long enough
+     * are stored right away */
+    if (wb->delay &&
+        ((now.tv_sec - wb->since.tv_sec) * 1000 + (now.tv_usec - wb->since.tv_usec) / 1000 >=
+         (long) wb->delay))
+        write_back_store(sqlfs, wb, 0);
+    else if (held_end - held_begin >= wb->limit)
+        write_back_store(sqlfs, wb, 1);
+    return 1;
+}
+
+/* serves a read from the writes held, or past the end of the file.
+ * Returns 0 if it has to go to the database. */
+static int write_back_read(sqlfs_t *sqlfs, struct write_back *wb, const char *path, char *buf,
+                           size_t size, off_t offset, int *result)
+{
+    size_t n, filesize;
+
+    if ((wb->begin == wb->end) || strcmp(wb->path, path) || !write_back_check(sqlfs, wb))
+        return 0;
+    filesize = (wb->end > wb->size) ? wb->end : wb->size;
+    if ((size_t) offset >= filesize)
+    {
+        *result = 0;
+        return 1;
+    }
+    n = ((size_t) offset + size < filesize) ? size : filesize - offset;
+    if (((size_t) offset < wb->begin) || ((size_t) offset + n > wb->end))
+        return 0;
+    memcpy(buf, wb->data + (offset - wb->begin), n);
+    *result = n;
+    return 1;
+}
+
+/* holds a write to an open file back, or stores what is held and makes
+ * the write on the database */
+static int write_back_write(sqlfs_t *sqlfs, struct write_back *wb, const char *path,
+                            const char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+    struct fuse_file_info direct = *fi;
+    int result;
+
+    if (!wb->write_error && write_back_hold(sqlfs, wb, path, buf, size, offset,
+                                            fi->flags & O_APPEND))
+        return size;
+    /* while the database is too busy to store the writes held, none is
+     * made past them */
+    if (write_back_flush(sqlfs, wb, path) == SQLITE_BUSY)
+        return -EBUSY;
+    if (wb->write_error)
+    {
+        result = wb->write_error;
+        wb->write_error = 0;
+        return result;
+    }
+    direct.fh = 0;
+    result = sqlfs_proc_write(sqlfs, path, buf, size, offset, &direct);
+    wb->known_on = 0;
     return result;
 }
 
+/* the read-ahead window grows up to READ_AHEAD_MAX.  Reads of
+ * READ_AHEAD_READ_MAX or more go straight to the caller's buffer: for them
+ * the lookups saved cost less than copying through the buffer. */
+#define READ_AHEAD_MAX (1024 * 1024)
+#define READ_AHEAD_READ_MAX (64 * 1024)
+
 int sqlfs_proc_read(sqlfs_t *sqlfs, const char *path, char *buf, size_t size, off_t offset, struct
                     fuse_file_info *fi)
 {
     int i, r, result = 0;
     key_value value = { 0, 0 };
     size_t existing_size = 0;
+    size_t block_size = get_sqlfs(sqlfs)->block_size;
+    struct read_ahead *ra = &get_sqlfs(sqlfs)->read_ahead;
+    struct write_back *wb = write_back_of(fi);
+    int same_file, sequential, current;
 
-    begin_transaction(get_sqlfs(sqlfs));
+    if (wb)
+    {
+        write_back_enter(sqlfs, wb);
+        if (write_back_read(sqlfs, wb, path, buf, size, offset, &result))
+            r = SQLITE_DONE;
+        else
+            r = write_back_flush(sqlfs, wb, path);
+        write_back_leave(sqlfs);
+        if (r == SQLITE_DONE)
+            return result;
+        if (r == SQLITE_BUSY)
+            return -EBUSY;
+    }
+
+    begin_read_transaction(get_sqlfs(sqlfs));
     CHECK_PARENT_PATH(path);
     CHECK_READ(path);
 
+    /* a read at the start of a file or right after the last one continues
+     * a stream, which is served from the read-ahead buffer */
+    same_file = ra->path && !strcmp(ra->path, path);
+    sequential = (offset == 0) || (same_file && ((size_t) offset == ra->next));
+    current = same_file && (ra->end > 0) && read_ahead_current(sqlfs, ra);
+    if (current && ((size_t) offset >= ra->begin) && ((size_t) offset < ra->end))
+    {
+        size_t n = (offset + size < ra->filesize) ? size : ra->filesize - offset;
+        if (offset + n <= ra->end)
+        {
+            memcpy(buf, ra->data + (offset - ra->begin), n);
+            ra->next = offset + n;
+            key_accessed(sqlfs, path);
+            ra->changes = sqlite3_total_changes(get_sqlfs(sqlfs)->db);
+            commit_transaction(get_sqlfs(sqlfs), 1);
+            return n;
+        }
+    }
+    if (!current || !sequential)
+        ra->end = 0;
+
     i = key_is_dir(get_sqlfs(sqlfs), path);
     if (i == 1)
     {
@@ -2769,34 +4987,262 @@ int sqlfs_proc_read(sqlfs_t *sqlfs, const char *path, char *buf, size_t size, of
         return -EBUSY;
     }
 
+    if (!same_file)
+    {
+        free(ra->path);
+        ra->path = strdup(path);
+    }
+    /* the window doubles with each sequential read that misses the buffer
+     * and closes on a random one */
+    if (sequential && (size < READ_AHEAD_READ_MAX))
+    {
+        size_t min_window = (4 * block_size < READ_AHEAD_MAX) ? 4 * block_size : READ_AHEAD_MAX;
+        ra->window = (ra->window < min_window) ? min_window : ra->window * 2;
+        if (ra->window > READ_AHEAD_MAX)
+            ra->window = READ_AHEAD_MAX;
+    }
+    else
+        ra->window = 0;
+
     if ((size_t) offset >= existing_size) /* nothing to read */
     {
         result = 0;
     }
     else
     {
-        value.data = buf;
-        value.size = size;
-        r = get_value(get_sqlfs(sqlfs), path, &value, offset, offset + size);
+        size_t end = ((size_t) offset + size > existing_size) ? existing_size : offset + size;
+        if (ra->window > 0)
+        {
+            /* fetch up to the end of the block the window ends in */
+            size_t ahead = (end + ra->window + block_size - 1) / block_size * block_size;
+            if (ahead > existing_size)
+                ahead = existing_size;
+            ra->filesize = existing_size;
+            r = read_ahead_fill(sqlfs, ra, path, offset, ahead);
+            if (r == SQLITE_OK)
+                memcpy(buf, ra->data, end - offset);
+        }
+        else
+        {
+            value.data = buf;
+            value.size = size;
+            r = get_value(get_sqlfs(sqlfs), path, &value, offset, end);
+        }
         if (r != SQLITE_OK) {
             result = -EIO;
-        } else if ((size_t) offset + size > existing_size) /* can read less than asked for */
-            result = existing_size - offset;
-        else
-            result = size;
+        } else
+            result = end - offset;
     }
+    ra->next = offset + ((result > 0) ? result : 0);
 
     commit_transaction(get_sqlfs(sqlfs), 1);
     return result;
 }
 
-int sqlfs_proc_write(sqlfs_t *sqlfs, const char *path, const char *buf, size_t size, off_t offset,
-                     struct fuse_file_info *fi)
+/* holes are handed to read callbacks from here */
+static const char zero_block[SQLFS_MAX_BLOCK_SIZE];
+
+/* hands zeros from *pos up to end to a read callback, a block at a time,
+ * and returns non-zero if the callback asked to stop */
+static int read_zeros(sqlfs_block_callback_t callback, void *ctx, size_t *pos, size_t end,
+                      size_t block_size)
 {
+    while (*pos < end)
+    {
+        size_t n = (end - *pos < block_size) ? end - *pos : block_size;
+        int stop = callback(ctx, zero_block, n, *pos);
+        *pos += n;
+        if (stop)
+            return stop;
+    }
+    return 0;
+}
+
+#undef INDEX
+#define INDEX 42
+
+/* passes the bytes from *pos to end of a file stored in blocks to a read
+ * callback, holes as zeros, moving *pos along.  Only compressed blocks
+ * are copied, to decode them. */
+static int read_blocks_to(sqlfs_t *sqlfs, int inode, size_t *pos, size_t end,
+                          sqlfs_block_callback_t callback, void *ctx)
+{
+    int r, stop = 0;
+    size_t block_size = get_sqlfs(sqlfs)->block_size;
+    char *decoded = 0;
+    const char *tail;
+    sqlite3_stmt *stmt;
+    static const char *cmd = "select v.block_id, coalesce(v.data_block, c.data_block), "
+                             "case when v.content is null then v.codec else c.codec end from value_data v "
+                             "left join block_content c on c.id = v.content "
+                             "where v.block_id between :first and :last order by v.block_id;";
+
+    if (*pos >= end)
+        return SQLITE_OK;
+    SQLITE3_PREPARE(get_sqlfs(sqlfs)->db, cmd, -1, &stmt,  &tail);
+    if (r != SQLITE_OK)
+    {
+        show_msg(stderr, "%s\n", sqlite3_errmsg(get_sqlfs(sqlfs)->db));
+        return r;
+    }
+    sqlite3_bind_int64(stmt, 1, block_id(inode, *pos / block_size));
+    sqlite3_bind_int64(stmt, 2, block_id(inode, (end - 1) / block_size));
+    while (!stop && ((r = sql_step(stmt)) == SQLITE_ROW))
+    {
+        size_t block_begin = (size_t) (sqlite3_column_int64(stmt, 0) & BLOCK_NO_MAX) * block_size;
+        size_t block_end = (block_begin + block_size < end) ? block_begin + block_size : end;
+        const char *data = sqlite3_column_blob(stmt, 1);
+        size_t n = sqlite3_column_bytes(stmt, 1);
+
+        /* a hole before this block */
+        stop = read_zeros(callback, ctx, pos, block_begin, block_size);
+        if (stop)
+            break;
+        if (sqlite3_column_int(stmt, 2) == SQLFS_CODEC_LZF)
+        {
+            if (!decoded)
+                decoded = malloc(block_size);
+            assert(decoded);
+            r = column_block(sqlfs, stmt, 1, decoded, &n);
+            if (r != SQLITE_OK)
+                break;
+            data = decoded;
+        }
+        /* the read may start inside the first block */
+        if (block_begin + n > block_end)
+            n = block_end - block_begin;
+        if (*pos < block_begin + n)
+        {
+            size_t len = block_begin + n - *pos;
+            stop = callback(ctx, data + (*pos - block_begin), len, *pos);
+            *pos += len;
+        }
+        /* a short block is followed by zeros */
+        if (!stop)
+            stop = read_zeros(callback, ctx, pos, block_end, block_size);
+    }
+    if (!stop && (r == SQLITE_DONE))
+        read_zeros(callback, ctx, pos, end, block_size);
+    if ((r == SQLITE_ROW) || (r == SQLITE_DONE))
+        r = SQLITE_OK;
+    else if (r != SQLITE_CORRUPT)
+        show_msg(stderr, "%s\n", sqlite3_errmsg(get_sqlfs(sqlfs)->db));
+    sqlite3_reset(stmt);
+    free(decoded);
+    return r;
+}
+
+#undef INDEX
+#define INDEX 41
+
+/* like sqlfs_proc_read(), but instead of copying the data into a buffer
+ * it passes the callback pointers into the blocks as SQLite returns them. */
+int sqlfs_read_blocks(sqlfs_t *sqlfs, const char *path, off_t offset, size_t size,
+                      sqlfs_block_callback_t callback, void *ctx)
+{
+    int r, inode = 0, result = 0, stop = 0;
+    size_t block_size = get_sqlfs(sqlfs)->block_size;
+    size_t filesize, end, pos = offset;
+    const char *tail, *type;
+    sqlite3_stmt *stmt;
+    static const char *cmd1 = "select size, inode, inline_data, type from meta_data where key = :key; ";
+
+    begin_read_transaction(get_sqlfs(sqlfs));
+    CHECK_PARENT_PATH(path);
+    CHECK_READ(path);
+
+    SQLITE3_PREPARE(get_sqlfs(sqlfs)->db, cmd1, -1, &stmt,  &tail);
+    if (r != SQLITE_OK)
+    {
+        show_msg(stderr, "%s\n", sqlite3_errmsg(get_sqlfs(sqlfs)->db));
+        commit_transaction(get_sqlfs(sqlfs), 1);
+        return -EIO;
+    }
+    sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
+    r = sql_step(stmt);
+    if (r != SQLITE_ROW)
+    {
+        sqlite3_reset(stmt);
+        commit_transaction(get_sqlfs(sqlfs), 1);
+        if (r == SQLITE_BUSY)
+            return -EBUSY;
+        if (r == SQLITE_DONE)
+            return -ENOENT;
+        show_msg(stderr, "%s\n", sqlite3_errmsg(get_sqlfs(sqlfs)->db));
+        return -EIO;
+    }
+    type = (const char *) sqlite3_column_text(stmt, 3);
+    if (type && !strcmp(type, TYPE_DIR))
+    {
+        sqlite3_reset(stmt);
+        commit_transaction(get_sqlfs(sqlfs), 1);
+        return -EISDIR;
+    }
+    filesize = sqlite3_column_int64(stmt, 0);
+    inode = sqlite3_column_int(stmt, 1);
+    end = (pos + size < filesize) ? pos + size : filesize;
+    if (pos >= end)
+    {
+        sqlite3_reset(stmt);
+        commit_transaction(get_sqlfs(sqlfs), 1);
+        return 0;
+    }
+    if (sqlite3_column_type(stmt, 2) != SQLITE_NULL)
+    {
+        /* small file stored inline */
+        size_t n = sqlite3_column_bytes(stmt, 2);
+        const char *data = sqlite3_column_blob(stmt, 2);
+        if (pos < n)
+        {
+            size_t len = ((end < n) ? end : n) - pos;
+            stop = callback(ctx, data + pos, len, pos);
+            pos += len;
+        }
+        if (!stop)
+            read_zeros(callback, ctx, &pos, end, block_size);
+        sqlite3_reset(stmt);
+        key_accessed(sqlfs, path);
+        commit_transaction(get_sqlfs(sqlfs), 1);
+        return pos - offset;
+    }
+    sqlite3_reset(stmt);
+
+    r = read_blocks_to(sqlfs, inode, &pos, end, callback, ctx);
+    if (r == SQLITE_OK)
+        result = pos - offset;
+    else
+        result = (r == SQLITE_BUSY) ? -EBUSY : -EIO;
+    key_accessed(sqlfs, path);
+    commit_transaction(get_sqlfs(sqlfs), 1);
+    return result;
+}
+
+int sqlfs_proc_write(sqlfs_t *sqlfs, const char *path, const char *buf, size_t size, off_t offset,
+                     struct fuse_file_info *fi)
+{
+    struct write_back *wb = write_back_of(fi);
+    struct group_op group = { GROUP_WRITE };
     int i, r, result = 0;
     size_t existing_size = 0;
     key_value value = { 0, 0 };
 
+    /* with write-back on, the writes to an open file that continue each
+     * other are held back, see write_back_hold() */
+    if (wb)
+    {
+        write_back_enter(sqlfs, wb);
+        result = write_back_write(sqlfs, wb, path, buf, size, offset, fi);
+        write_back_leave(sqlfs);
+        return result;
+    }
+    group.path = path;
+    group.buf = buf;
+    group.size = size;
+    group.offset = offset;
+    group.fi = fi;
+    if (group_commit(sqlfs, &group))
+        return group.result;
+
     begin_transaction(get_sqlfs(sqlfs));
 
     i = key_is_dir(get_sqlfs(sqlfs), path);
@@ -2831,7 +5277,7 @@ int sqlfs_proc_write(sqlfs_t *sqlfs, const char *path, const char *buf, size_t s
         attr.gid = get_sqlfs(sqlfs)->gid;
 
 #endif
-        attr.inode = get_new_inode();
+        attr.inode = get_new_inode(sqlfs);
         r = set_attr(get_sqlfs(sqlfs), path, &attr);
         if (r != SQLITE_OK)
             result = -EIO;
@@ -2860,40 +5306,22 @@ int sqlfs_proc_write(sqlfs_t *sqlfs, const char *path, const char *buf, size_t s
             write_begin = existing_size;
             write_end = existing_size + size;
         }
-        else if ((size_t) offset > existing_size)
-        { /* handle writes that start after the end of the existing data.  'buf'
-             cannot be used directly with set_value() because the buffer given
-             to set_value() needs to include any empty space between the end of
-             the existing file and the offset. The return value needs to then be
-             set to the number of bytes of _data_ written, not the total number
-             of bytes written, which would also include that empty space. */
-            value.size = offset - existing_size + size;
-            value.data = calloc(value.size, sizeof(char));
-            memset(value.data, 0, offset - existing_size);
-            memcpy(value.data + (offset - existing_size), buf, size);
-            write_begin = existing_size;
-            write_end = size + offset;
-        }
         else
-        {
+        {   /* writes that start after the end of the existing data leave a
+               hole between the two, which set_value() does not store */
             value.size = size;
             value.data = (char*) buf;
             write_begin = offset;
             write_end = size + offset;
         }
         r = set_value(get_sqlfs(sqlfs), path, &value, write_begin, write_end);
-        if (r != SQLITE_OK)
+        if (r == SQLITE_TOOBIG)
         {
-            result = -EIO;
+            result = -EFBIG;
         }
-        else if ((size_t) offset > existing_size)
+        else if (r != SQLITE_OK)
         {
-          /* this is the only case that uses calloc(), so
-             clean_value() should only be run here, otherwise it will
-             free() 'buf', which has been handed in by the caller. */
-            clean_value(&value);
-            // blank space was filled in, but there was only 'size' data
-            result = size;
+            result = -EIO;
         }
         else
         {
@@ -2904,6 +5332,78 @@ int sqlfs_proc_write(sqlfs_t *sqlfs, const char *path, const char *buf, size_t s
     return result;
 }
 
+/* total length of the buffers, or -1 if it does not fit the return value */
+static int iov_length(const struct iovec *iov, int iovcnt)
+{
+    int i;
+    size_t total = 0;
+
+    if (iovcnt < 0)
+        return -1;
+    for (i = 0; i < iovcnt; i++)
+    {
+        if (iov[i].iov_len > INT_MAX - total)
+            return -1;
+        total += iov[i].iov_len;
+    }
+    return total;
+}
+
+/* the buffers are gathered into one range so the file is looked up, checked
+ * and read in a single call, instead of once per buffer */
+int sqlfs_proc_readv(sqlfs_t *sqlfs, const char *path, const struct iovec *iov, int iovcnt,
+                     off_t offset, struct fuse_file_info *fi)
+{
+    int i, result, size = iov_length(iov, iovcnt);
+    size_t pos = 0;
+    char *buf;
+
+    if (size < 0)
+        return -EINVAL;
+    if (iovcnt == 1)
+        return sqlfs_proc_read(sqlfs, path, iov[0].iov_base, size, offset, fi);
+    buf = malloc(size + 1);
+    if (!buf)
+        return -ENOMEM;
+    result = sqlfs_proc_read(sqlfs, path, buf, size, offset, fi);
+    for (i = 0; (result > 0) && (pos < (size_t) result); i++)
+    {
+        size_t n = result - pos;
+        if (n > iov[i].iov_len)
+            n = iov[i].iov_len;
+        memcpy(iov[i].iov_base, buf + pos, n);
+        pos += n;
+    }
+    free(buf);
+    return result;
+}
+
+/* one write of the gathered buffers stores whole blocks where the buffers
+ * meet, and updates the size and mtime of the file once */
+int sqlfs_proc_writev(sqlfs_t *sqlfs, const char *path, const struct iovec *iov, int iovcnt,
+                      off_t offset, struct fuse_file_info *fi)
+{
+    int i, result, size = iov_length(iov, iovcnt);
+    size_t pos = 0;
+    char *buf;
+
+    if (size < 0)
+        return -EINVAL;
+    if (iovcnt == 1)
+        return sqlfs_proc_write(sqlfs, path, iov[0].iov_base, size, offset, fi);
+    buf = malloc(size + 1);
+    if (!buf)
+        return -ENOMEM;
+    for (i = 0; i < iovcnt; i++)
+    {
+        memcpy(buf + pos, iov[i].iov_base, iov[i].iov_len);
+        pos += iov[i].iov_len;
+    }
+    result = sqlfs_proc_write(sqlfs, path, buf, size, offset, fi);
+    free(buf);
+    return result;
+}
+
 /* we are faking this somewhat by using the data from the underlying
  partition that the database file is stored on. That means we ignore
  the path passed in and just use the default_db_name. */
@@ -2931,7 +5431,7 @@ int sqlfs_proc_statfs(sqlfs_t *sqlfs, const char *path, struct statvfs *stbuf)
     stbuf->f_ffree = 99;
     stbuf->f_files = 999;
     /* some guesses at how things should be represented */
-    stbuf->f_frsize = BLOCK_SIZE;
+    stbuf->f_frsize = get_sqlfs(sqlfs)->block_size;
     stbuf->f_bsize = sb.f_bsize;
     stbuf->f_bfree = sb.f_bfree;
 
@@ -2944,16 +5444,52 @@ int sqlfs_proc_statfs(sqlfs_t *sqlfs, const char *path, struct statvfs *stbuf)
     return 0;
 }
 
+/* stores the writes held back, and returns the error of any that could
+ * not be stored since the last call, or -EBUSY when they are still held */
+static int write_back_sync(sqlfs_t *sqlfs, struct write_back *wb)
+{
+    int result;
+
+    if (write_back_store(sqlfs, wb, 0) == SQLITE_BUSY)
+        return -EBUSY;
+    result = wb->error;
+    wb->error = wb->write_error = 0;
+    return result;
+}
+
+/* a file released while its writes cannot be stored keeps its buffer
+ * until a later transaction stores them, see write_back_store_all() */
 int sqlfs_proc_release(sqlfs_t *sqlfs, const char *path, struct fuse_file_info *fi)
 {
-    /* no operation */
-    return 0;
+    struct write_back *wb = write_back_of(fi);
+    int result;
+
+    if (!wb)
+        return 0;
+    fi->fh = 0;
+    write_back_enter(sqlfs, wb);
+    result = write_back_sync(sqlfs, wb);
+    if (result == -EBUSY)
+        wb->released = 1;
+    else
+        write_back_free(wb);
+    write_back_leave(sqlfs);
+    return result;
 }
 
 int sqlfs_proc_fsync(sqlfs_t *sqlfs, const char *path, int isfdatasync, struct fuse_file_info *fi)
 {
+    struct write_back *wb = write_back_of(fi);
+    int result = 0;
+
+    if (wb)
+    {
+        write_back_enter(sqlfs, wb);
+        result = write_back_sync(sqlfs, wb);
+        write_back_leave(sqlfs);
+    }
     sync(); /* just to sync everything */
-    return 0;
+    return result;
 }
 
 /* xattr operations are optional and can safely be left unimplemented
@@ -2963,78 +5499,894 @@ int sqlfs_proc_setxattr(sqlfs_t *sqlfs, const char *path, const char *name, cons
     return -ENOSYS;
 }
 
-int sqlfs_proc_getxattr(sqlfs_t *sqlfs, const char path, const char *name, char *value, size_t size)
+int sqlfs_proc_getxattr(sqlfs_t *sqlfs, const char path, const char *name, char *value, size_t size)
+{
+    return -ENOSYS;
+}
+
+int sqlfs_proc_listxattr(sqlfs_t *sqlfs, const char *path, char *list, size_t size)
+{
+    return -ENOSYS;
+}
+
+int sqlfs_proc_removexattr(sqlfs_t *sqlfs, const char *path, const char *name)
+{
+    return -ENOSYS;
+}
+*/
+
+int sqlfs_del_tree(sqlfs_t *sqlfs, const char *key)
+{
+    int i, result = 0;
+    begin_transaction(get_sqlfs(sqlfs));
+    CHECK_PARENT_WRITE(key);
+    CHECK_DIR_WRITE(key);
+
+    i = key_exists(get_sqlfs(sqlfs), key, 0);
+    if (i == 0)
+        result = -ENOENT;
+    else if (i == 2)
+        result = -EBUSY;
+
+    if (result == 0)
+    {
+        if (SQLITE_OK == remove_key_subtree(get_sqlfs(sqlfs), key))
+            result = 0;
+        else
+            result = -EIO;
+    }
+    commit_transaction(get_sqlfs(sqlfs), 1);
+    return result;
+}
+
+
+int sqlfs_del_tree_with_exclusion(sqlfs_t *sqlfs, const char *key, const char *exclusion_pattern)
+{
+    int i, result = 0;
+    begin_transaction(get_sqlfs(sqlfs));
+    CHECK_PARENT_WRITE(key);
+    CHECK_DIR_WRITE(key);
+
+    i = key_exists(get_sqlfs(sqlfs), key, 0);
+    if (i == 0)
+        result = -ENOENT;
+    else if (i == 2)
+        result = -EBUSY;
+
+    if (result == 0)
+    {
+        if (SQLITE_OK == remove_key_subtree_with_exclusion(get_sqlfs(sqlfs), key, exclusion_pattern))
+            result = 0;
+        else
+            result = -EIO;
+    }
+    commit_transaction(get_sqlfs(sqlfs), 1);
+    return result;
+}
+
+
+/* sqlfs_import_tree() reads the host tree with a few threads, which hand
+ * what they read to the calling thread, the only one using the database.
+ * Their tasks are the host directories and files still to be read. */
+#define IMPORT_THREADS 4
+#define IMPORT_THREADS_MAX 64
+#define IMPORT_BATCH_SIZE (16 * 1024 * 1024)
+/* files are handed over in pieces of this size, which are whole blocks
+ * whatever the block size */
+#define IMPORT_CHUNK SQLFS_MAX_BLOCK_SIZE
+
+/* a task for the readers, or a directory, symbolic link or piece of a
+ * file read for the writer */
+struct import_entry
+{
+    struct import_entry *next;
+    char *host; /* the host path of a task */
+    char *path;
+    mode_t mode;
+    int fresh; /* its parent directory was created by the import */
+    char *data;
+    size_t size; /* of data, or of the host file for a task */
+    size_t offset;
+};
+
+struct import
+{
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    struct import_entry *tasks, *last_task;
+    struct import_entry *entries, *last_entry;
+    size_t queued, queue_max; /* bytes of data in entries */
+    int busy; /* readers working on a task */
+    int error;
+};
+
+static struct import_entry *import_entry_new(const char *host, const char *path, mode_t mode,
+                                             int fresh)
+{
+    struct import_entry *e = calloc(1, sizeof(*e));
+
+    assert(e);
+    e->host = make_str_copy(host);
+    e->path = make_str_copy(path);
+    e->mode = mode;
+    e->fresh = fresh;
+    return e;
+}
+
+static void import_entry_free(struct import_entry *e)
+{
+    free(e->host);
+    free(e->path);
+    free(e->data);
+    free(e);
+}
+
+static void import_append(struct import_entry **first, struct import_entry **last,
+                          struct import_entry *e)
+{
+    e->next = 0;
+    if (*last)
+        (*last)->next = e;
+    else
+        *first = e;
+    *last = e;
+}
+
+static void import_fail(struct import *imp, int error)
+{
+    pthread_mutex_lock(&imp->lock);
+    if (!imp->error)
+        imp->error = error;
+    pthread_cond_broadcast(&imp->changed);
+    pthread_mutex_unlock(&imp->lock);
+}
+
+static void import_add_task(struct import *imp, struct import_entry *task)
+{
+    pthread_mutex_lock(&imp->lock);
+    import_append(&imp->tasks, &imp->last_task, task);
+    pthread_cond_broadcast(&imp->changed);
+    pthread_mutex_unlock(&imp->lock);
+}
+
+/* hands an entry to the writer, waiting while it is too far behind.
+ * Returns 0 when the import has failed. */
+static int import_hand_over(struct import *imp, struct import_entry *e)
+{
+    int ok;
+
+    pthread_mutex_lock(&imp->lock);
+    while (!imp->error && imp->entries && (imp->queued + e->size > imp->queue_max))
+        pthread_cond_wait(&imp->changed, &imp->lock);
+    ok = !imp->error;
+    if (ok)
+    {
+        import_append(&imp->entries, &imp->last_entry, e);
+        imp->queued += e->size;
+        pthread_cond_broadcast(&imp->changed);
+    }
+    pthread_mutex_unlock(&imp->lock);
+    if (!ok)
+        import_entry_free(e);
+    return ok;
+}
+
+/* lists a host directory.  Its subdirectories are handed over before
+ * they become tasks, so the writer always creates a directory before
+ * anything in it. */
+static void import_read_dir(struct import *imp, struct import_entry *dir)
+{
+    DIR *d = opendir(dir->host);
+    struct dirent *de;
+
+    if (!d)
+    {
+        import_fail(imp, -errno);
+        return;
+    }
+    while ((de = readdir(d)) != 0)
+    {
+        char host[PATH_MAX], path[PATH_MAX];
+        struct stat st;
+        struct import_entry *e;
+
+        if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+            continue;
+        if ((snprintf(host, sizeof(host), "%s/%s", dir->host, de->d_name) >= (int) sizeof(host)) ||
+            (snprintf(path, sizeof(path), "%s/%s", strcmp(dir->path, "/") ? dir->path : "",
+                      de->d_name) >= (int) sizeof(path)))
+        {
+            import_fail(imp, -ENAMETOOLONG);
+            break;
+        }
+        if (lstat(host, &st) != 0)
+        {
+            import_fail(imp, -errno);
+            break;
+        }
+        if (S_ISREG(st.st_mode))
+        {
+            e = import_entry_new(host, path, st.st_mode, dir->fresh);
+            e->size = st.st_size;
+            import_add_task(imp, e);
+        }
+        else if (S_ISDIR(st.st_mode))
+        {
+            if (!import_hand_over(imp, import_entry_new(0, path, st.st_mode, dir->fresh)))
+                break;
+            import_add_task(imp, import_entry_new(host, path, st.st_mode, dir->fresh));
+        }
+        else if (S_ISLNK(st.st_mode))
+        {
+            /* stored like sqlfs_proc_symlink() does, with the terminating 0 */
+            char target[PATH_MAX];
+            ssize_t n = readlink(host, target, sizeof(target) - 1);
+            if (n < 0)
+            {
+                import_fail(imp, -errno);
+                break;
+            }
+            e = import_entry_new(0, path, st.st_mode, dir->fresh);
+            e->data = malloc(n + 1);
+            assert(e->data);
+            memcpy(e->data, target, n);
+            e->data[n] = 0;
+            e->size = n + 1;
+            if (!import_hand_over(imp, e))
+                break;
+        }
+        /* devices, fifos and sockets are left out */
+    }
+    closedir(d);
+}
+
+static ssize_t import_read_full(int fd, char *buf, size_t size)
+{
+    size_t done = 0;
+
+    while (done < size)
+    {
+        ssize_t n = read(fd, buf + done, size - done);
+        if ((n < 0) && (errno == EINTR))
+            continue;
+        if (n < 0)
+            return -1;
+        if (n == 0)
+            break;
+        done += n;
+    }
+    return done;
+}
+
+/* reads a host file up to the size it had when it was listed */
+static void import_read_file(struct import *imp, struct import_entry *file)
+{
+    int fd = open(file->host, O_RDONLY);
+    size_t offset = 0, size;
+    ssize_t n;
+
+    if (fd < 0)
+    {
+        import_fail(imp, -errno);
+        return;
+    }
+    do
+    {
+        struct import_entry *e = import_entry_new(0, file->path, file->mode, file->fresh);
+        size = file->size - offset;
+        if (size > IMPORT_CHUNK)
+            size = IMPORT_CHUNK;
+        if (size > 0)
+        {
+            e->data = malloc(size);
+            assert(e->data);
+        }
+        e->offset = offset;
+        n = import_read_full(fd, e->data, size);
+        if (n < 0)
+        {
+            import_fail(imp, -errno);
+            import_entry_free(e);
+            break;
+        }
+        e->size = n;
+        offset += n;
+        if (!import_hand_over(imp, e))
+            break;
+    }
+    while (((size_t) n == size) && (offset < file->size));
+    close(fd);
+}
+
+static void *import_reader(void *arg)
+{
+    struct import *imp = (struct import *) arg;
+    struct import_entry *task;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&imp->lock);
+        while (!imp->error && !imp->tasks && imp->busy)
+            pthread_cond_wait(&imp->changed, &imp->lock);
+        task = imp->error ? 0 : imp->tasks;
+        if (task)
+        {
+            imp->tasks = task->next;
+            if (!imp->tasks)
+                imp->last_task = 0;
+            imp->busy++;
+        }
+        pthread_mutex_unlock(&imp->lock);
+        if (!task)
+            break;
+        if (S_ISDIR(task->mode))
+            import_read_dir(imp, task);
+        else
+            import_read_file(imp, task);
+        import_entry_free(task);
+        pthread_mutex_lock(&imp->lock);
+        imp->busy--;
+        pthread_cond_broadcast(&imp->changed);
+        pthread_mutex_unlock(&imp->lock);
+    }
+    return 0;
+}
+
+/* writes an entry handed over by the readers.  Nothing inside a
+ * directory the import created can exist yet, anything else may. */
+static int import_write(sqlfs_t *sqlfs, struct import_entry *e, int *next_inode)
+{
+    key_attr attr = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+    key_value value;
+    struct meta_entry *m;
+    int r;
+
+    if (e->offset == 0)
+    {
+        if (!e->fresh)
+        {
+            r = get_meta(sqlfs, e->path, &m);
+            if (r != SQLITE_OK)
+                return (r == SQLITE_BUSY) ? -EBUSY : -EIO;
+            if (m->exists)
+            {
+                int is_dir = m->type && !strcmp(m->type, TYPE_DIR);
+                if (S_ISDIR(e->mode))
+                    return is_dir ? sqlfs_proc_access(sqlfs, e->path, W_OK | X_OK) : -ENOTDIR;
+                if (is_dir)
+                    return -EISDIR;
+                /* replaced, keeping its inode, when it may be written */
+                r = sqlfs_proc_access(sqlfs, e->path, W_OK);
+                if (r != 0)
+                    return r;
+                if ((m->size > 0) && (key_shorten_value(sqlfs, e->path, 0) != SQLITE_OK))
+                    return -EIO;
+            }
+        }
+        attr.path = e->path;
+        if (S_ISDIR(e->mode))
+            attr.type = TYPE_DIR;
+        else if (S_ISLNK(e->mode))
+            attr.type = TYPE_SYM_LINK;
+        else
+            attr.type = TYPE_BLOB;
+        attr.mode = e->mode & 07777;
+#ifdef HAVE_LIBFUSE
+        attr.uid = geteuid();
+        attr.gid = getegid();
+#else
+        attr.uid = get_sqlfs(sqlfs)->uid;
+        attr.gid = get_sqlfs(sqlfs)->gid;
+#endif
+        attr.inode = (*next_inode)++;
+        r = set_attr(sqlfs, e->path, &attr);
+        if (r != SQLITE_OK)
+            return (r == SQLITE_BUSY) ? -EBUSY : -EIO;
+    }
+    if ((e->size > 0) && (e->offset == 0) && S_ISREG(e->mode) && (e->size < IMPORT_CHUNK) &&
+        (e->size <= get_sqlfs(sqlfs)->inline_threshold) &&
+        (e->size <= get_sqlfs(sqlfs)->block_size))
+    {
+        /* a whole file small enough to be stored inline, in the row just
+         * written */
+        r = set_inline_data(sqlfs, e->path, e->data, e->size);
+        if (r != SQLITE_OK)
+            return (r == SQLITE_BUSY) ? -EBUSY : -EIO;
+    }
+    else if (e->size > 0)
+    {
+        value.data = e->data;
+        value.size = e->size;
+        r = set_value(sqlfs, e->path, &value, e->offset, e->offset + e->size);
+        if (r == SQLITE_TOOBIG)
+            return -EFBIG;
+        if (r != SQLITE_OK)
+            return (r == SQLITE_BUSY) ? -EBUSY : -EIO;
+    }
+    return 0;
+}
+
+int sqlfs_import_tree(sqlfs_t *sqlfs, const char *host_dir, const char *dest_path,
+                      sqlfs_import_opts *opts)
+{
+    struct import imp;
+    struct import_entry *e;
+    struct stat st;
+    pthread_t threads[IMPORT_THREADS_MAX];
+    char path[PATH_MAX];
+    size_t batch_size = (opts && opts->batch_size) ? opts->batch_size : IMPORT_BATCH_SIZE;
+    size_t len, batch = 0, files = 0, directories = 0, bytes = 0;
+    int i, n, result = 0, in_transaction, next_inode;
+
+    n = (opts && (opts->threads > 0)) ? opts->threads : IMPORT_THREADS;
+    if (n > IMPORT_THREADS_MAX)
+        n = IMPORT_THREADS_MAX;
+    if (lstat(host_dir, &st) != 0)
+        return -errno;
+    if (!S_ISDIR(st.st_mode))
+        return -ENOTDIR;
+    if (strlen(dest_path) >= sizeof(path))
+        return -ENAMETOOLONG;
+    strcpy(path, dest_path);
+    len = strlen(path);
+    while ((len > 1) && (path[len - 1] == '/'))
+        path[--len] = 0;
+    if (!len)
+        return -ENOENT;
+
+    memset(&imp, 0, sizeof(imp));
+    pthread_mutex_init(&imp.lock, 0);
+    pthread_cond_init(&imp.changed, 0);
+    imp.queue_max = batch_size;
+
+    if (begin_transaction(get_sqlfs(sqlfs)) != SQLITE_OK)
+        return -EBUSY;
+    in_transaction = 1;
+    /* the destination is created, or merged into when it is a directory */
+    i = key_is_dir(get_sqlfs(sqlfs), path);
+    if (i == 2)
+        result = -EBUSY;
+    else if (i == 1)
+        result = sqlfs_proc_access(sqlfs, path, W_OK | X_OK);
+    else if (key_exists(get_sqlfs(sqlfs), path, 0))
+        result = -ENOTDIR;
+    else
+    {
+        result = check_parent_write(sqlfs, path);
+        import_append(&imp.entries, &imp.last_entry, import_entry_new(0, path, st.st_mode, 1));
+    }
+    import_append(&imp.tasks, &imp.last_task, import_entry_new(host_dir, path, st.st_mode,
+                                                               i == 0));
+
+    for (i = 0; (result == 0) && (i < n); i++)
+        if (pthread_create(&threads[i], 0, import_reader, &imp) != 0)
+            break;
+    n = i;
+    if ((result == 0) && (n == 0))
+        result = -EAGAIN;
+    next_inode = get_new_inode(sqlfs);
+
+    while (result == 0)
+    {
+        pthread_mutex_lock(&imp.lock);
+        while (!imp.error && !imp.entries && (imp.tasks || imp.busy))
+            pthread_cond_wait(&imp.changed, &imp.lock);
+        result = imp.error;
+        e = result ? 0 : imp.entries;
+        if (e)
+        {
+            imp.entries = e->next;
+            if (!imp.entries)
+                imp.last_entry = 0;
+            imp.queued -= e->size;
+            pthread_cond_broadcast(&imp.changed);
+        }
+        pthread_mutex_unlock(&imp.lock);
+        if (!e)
+            break;
+
+        result = import_write(sqlfs, e, &next_inode);
+        if ((result == 0) && (e->offset == 0))
+        {
+            if (S_ISDIR(e->mode))
+                directories++;
+            else
+                files++;
+        }
+        if (!S_ISLNK(e->mode))
+            bytes += e->size;
+        batch += e->size;
+        import_entry_free(e);
+        /* the data goes to the database in large transactions */
+        if ((result == 0) && (batch >= batch_size))
+        {
+            if (commit_transaction(get_sqlfs(sqlfs), 1) != SQLITE_OK)
+                result = -EBUSY;
+            else if (begin_transaction(get_sqlfs(sqlfs)) != SQLITE_OK)
+            {
+                in_transaction = 0;
+                result = -EBUSY;
+            }
+            next_inode = get_new_inode(sqlfs);
+            batch = 0;
+        }
+    }
+    if (result)
+        import_fail(&imp, result);
+    for (i = 0; i < n; i++)
+        pthread_join(threads[i], 0);
+    while ((e = imp.tasks) != 0)
+    {
+        imp.tasks = e->next;
+        import_entry_free(e);
+    }
+    while ((e = imp.entries) != 0)
+    {
+        imp.entries = e->next;
+        import_entry_free(e);
+    }
+    pthread_cond_destroy(&imp.changed);
+    pthread_mutex_destroy(&imp.lock);
+    /* what was committed before a failure stays */
+    if (in_transaction)
+        commit_transaction(get_sqlfs(sqlfs), result == 0);
+
+    if (opts)
+    {
+        opts->files = files;
+        opts->directories = directories;
+        opts->bytes = bytes;
+    }
+    return result;
+}
+
+
+/* sqlfs_export_tar() writes a POSIX tar archive.  Names and link targets
+ * that do not fit the ustar header, and sizes of 8 GiB or more, go in an
+ * extended (pax) header before the entry. */
+#define TAR_BLOCK 512
+#define TAR_OCTAL_MAX(width) ((1ULL << (3 * ((width) - 1))) - 1)
+
+struct tar_out
+{
+    int fd;
+    int error;
+};
+
+static int tar_write(struct tar_out *out, const char *data, size_t size)
+{
+    while ((size > 0) && !out->error)
+    {
+        ssize_t n = write(out->fd, data, size);
+        if ((n < 0) && (errno == EINTR))
+            continue;
+        if (n < 0)
+            out->error = -errno;
+        else
+        {
+            data += n;
+            size -= n;
+        }
+    }
+    return out->error;
+}
+
+/* a read callback writing the file data to the archive */
+static int tar_write_data(void *ctx, const char *data, size_t size, off_t offset)
+{
+    return tar_write((struct tar_out *) ctx, data, size) != 0;
+}
+
+/* fills the entry just written up to a whole tar block */
+static int tar_pad(struct tar_out *out, size_t size)
+{
+    size_t n = size % TAR_BLOCK;
+    return n ? tar_write(out, zero_block, TAR_BLOCK - n) : out->error;
+}
+
+/* writes value as width - 1 octal digits and a terminating 0 */
+static void tar_octal(char *field, size_t width, unsigned long long value)
+{
+    size_t i = width - 1;
+
+    field[i] = 0;
+    while (i-- > 0)
+    {
+        field[i] = '0' + (value & 7);
+        value >>= 3;
+    }
+}
+
+/* appends a "length key=value" record to an extended header */
+static void tar_pax_record(char *buf, size_t *len, size_t cap, const char *key, const char *value)
+{
+    size_t n = strlen(key) + strlen(value) + 3, digits = 1, limit = 10;
+
+    while (n + digits >= limit)
+    {
+        digits++;
+        limit *= 10;
+    }
+    if (*len + n + digits < cap)
+        *len += sprintf(buf + *len, "%zu %s=%s\n", n + digits, key, value);
+}
+
+/* puts name in the name field of a header, or splits it at a slash
+ * between the prefix and the name fields.  Returns 0 if neither fits. */
+static int tar_set_name(char *h, const char *name)
+{
+    size_t len = strlen(name);
+    const char *s;
+
+    if (len <= 100)
+    {
+        memcpy(h, name, len);
+        return 1;
+    }
+    for (s = strchr(name + len - 101, '/'); s && (s < name + len - 1); s = strchr(s + 1, '/'))
+    {
+        if ((s > name) && (s - name <= 155))
+        {
+            memcpy(h + 345, name, s - name);
+            memcpy(h, s + 1, len - (s - name) - 1);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int tar_header(struct tar_out *out, const char *name, mode_t mode, unsigned int uid,
+                      unsigned int gid, unsigned long long size, time_t mtime, char type,
+                      const char *link)
 {
-    return -ENOSYS;
+    char h[TAR_BLOCK], pax[3 * PATH_MAX], n[32];
+    size_t i, len = 0;
+    unsigned int sum = 0;
+
+    memset(h, 0, sizeof(h));
+    if (!tar_set_name(h, name))
+    {
+        tar_pax_record(pax, &len, sizeof(pax), "path", name);
+        memcpy(h, name, 100);
+    }
+    if (link && (strlen(link) > 100))
+        tar_pax_record(pax, &len, sizeof(pax), "linkpath", link);
+    if (size > TAR_OCTAL_MAX(12))
+    {
+        snprintf(n, sizeof(n), "%llu", size);
+        tar_pax_record(pax, &len, sizeof(pax), "size", n);
+        size = 0;
+    }
+    if (uid > TAR_OCTAL_MAX(8))
+    {
+        snprintf(n, sizeof(n), "%u", uid);
+        tar_pax_record(pax, &len, sizeof(pax), "uid", n);
+        uid = 0;
+    }
+    if (gid > TAR_OCTAL_MAX(8))
+    {
+        snprintf(n, sizeof(n), "%u", gid);
+        tar_pax_record(pax, &len, sizeof(pax), "gid", n);
+        gid = 0;
+    }
+    if ((len > 0) && (tar_header(out, "PaxHeader", 0644, 0, 0, len, mtime, 'x', 0) ||
+                      tar_write(out, pax, len) || tar_pad(out, len)))
+        return out->error;
+
+    tar_octal(h + 100, 8, mode & 07777);
+    tar_octal(h + 108, 8, uid);
+    tar_octal(h + 116, 8, gid);
+    tar_octal(h + 124, 12, size);
+    tar_octal(h + 136, 12, (mtime > 0) ? mtime : 0);
+    h[156] = type;
+    if (link)
+        memcpy(h + 157, link, (strlen(link) < 100) ? strlen(link) : 100);
+    memcpy(h + 257, "ustar", 6);
+    memcpy(h + 263, "00", 2);
+    /* the checksum is taken with its own field filled with spaces */
+    memset(h + 148, ' ', 8);
+    for (i = 0; i < TAR_BLOCK; i++)
+        sum += (unsigned char) h[i];
+    tar_octal(h + 148, 7, sum);
+    h[155] = ' ';
+    return tar_write(out, h, TAR_BLOCK);
 }
 
-int sqlfs_proc_listxattr(sqlfs_t *sqlfs, const char *path, char *list, size_t size)
+/* writes the archive entry of a meta_data row selected by
+ * sqlfs_export_tar(), with the data of a file read in order */
+static int export_entry(sqlfs_t *sqlfs, sqlite3_stmt *stmt, const char *name, struct tar_out *out)
 {
-    return -ENOSYS;
-}
+    const char *key = (const char *) sqlite3_column_text(stmt, 0);
+    const char *type = (const char *) sqlite3_column_text(stmt, 1);
+    mode_t mode = sqlite3_column_int(stmt, 2);
+    unsigned int uid = sqlite3_column_int(stmt, 3);
+    unsigned int gid = sqlite3_column_int(stmt, 4);
+    time_t mtime = sqlite3_column_int64(stmt, 5);
+    size_t size = sqlite3_column_int64(stmt, 6), pos = 0;
+    int r = SQLITE_OK;
 
-int sqlfs_proc_removexattr(sqlfs_t *sqlfs, const char *path, const char *name)
-{
-    return -ENOSYS;
+    if (type && !strcmp(type, TYPE_DIR))
+        return tar_header(out, name, mode, uid, gid, 0, mtime, '5', 0);
+    if (type && !strcmp(type, TYPE_SYM_LINK))
+    {
+        char link[PATH_MAX];
+        key_value value;
+        value.data = link;
+        value.size = (size < sizeof(link)) ? size : sizeof(link) - 1;
+        memset(link, 0, sizeof(link));
+        if (value.size > 0)
+            r = get_value(sqlfs, key, &value, 0, value.size);
+        if (r != SQLITE_OK)
+            return (r == SQLITE_BUSY) ? -EBUSY : -EIO;
+        return tar_header(out, name, mode, uid, gid, 0, mtime, '2', link);
+    }
+
+    if (tar_header(out, name, mode, uid, gid, size, mtime, '0', 0))
+        return out->error;
+    if (sqlite3_column_type(stmt, 8) != SQLITE_NULL)
+    {
+        /* small file stored inline */
+        size_t n = sqlite3_column_bytes(stmt, 8);
+        if (n > size)
+            n = size;
+        tar_write(out, sqlite3_column_blob(stmt, 8), n);
+        pos = n;
+        read_zeros(tar_write_data, out, &pos, size, get_sqlfs(sqlfs)->block_size);
+    }
+    else
+        r = read_blocks_to(sqlfs, sqlite3_column_int(stmt, 7), &pos, size, tar_write_data, out);
+    if (r != SQLITE_OK)
+        return (r == SQLITE_BUSY) ? -EBUSY : -EIO;
+    return tar_pad(out, size);
 }
-*/
 
-int sqlfs_del_tree(sqlfs_t *sqlfs, const char *key)
+/* whether key is below one of the directories the export skips */
+static int export_skipped(char **dirs, size_t n, const char *key)
 {
-    int i, result = 0;
-    begin_transaction(get_sqlfs(sqlfs));
-    CHECK_PARENT_WRITE(key);
-    CHECK_DIR_WRITE(key);
-
-    i = key_exists(get_sqlfs(sqlfs), key, 0);
-    if (i == 0)
-        result = -ENOENT;
-    else if (i == 2)
-        result = -EBUSY;
-
-    if (result == 0)
+    size_t i, len;
+    for (i = 0; i < n; i++)
     {
-        if (SQLITE_OK == remove_key_subtree(get_sqlfs(sqlfs), key))
-            result = 0;
-        else
-            result = -EIO;
+        len = strlen(dirs[i]);
+        if (!strncmp(key, dirs[i], len) && (key[len] == '/'))
+            return 1;
     }
-    commit_transaction(get_sqlfs(sqlfs), 1);
-    return result;
+    return 0;
 }
 
+#undef INDEX
+#define INDEX 49
 
-int sqlfs_del_tree_with_exclusion(sqlfs_t *sqlfs, const char *key, const char *exclusion_pattern)
+int sqlfs_export_tar(sqlfs_t *sqlfs, const char *path, int fd)
 {
-    int i, result = 0;
-    begin_transaction(get_sqlfs(sqlfs));
-    CHECK_PARENT_WRITE(key);
-    CHECK_DIR_WRITE(key);
+    int i, r, result = 0;
+    const char *tail, *base;
+    sqlite3_stmt *stmt;
+    char key[PATH_MAX], first[PATH_MAX + 1], last[PATH_MAX + 1], name[2 * PATH_MAX];
+    char **skipped = 0;
+    size_t len, n_skipped = 0;
+    struct tar_out out = { fd, 0 };
+#ifdef HAVE_LIBFUSE
+    gid_t gid = getegid();
+    uid_t uid = geteuid();
+#else
+    gid_t gid = get_sqlfs(sqlfs)->gid;
+    uid_t uid = get_sqlfs(sqlfs)->uid;
+#endif
+    static const char *cmd1 = "select key, type, mode, uid, gid, mtime, size, inode, inline_data "
+                              "from meta_data where key = :key;";
+    /* '0' follows '/', so this is everything below a directory, in order */
+    static const char *cmd2 = "select key, type, mode, uid, gid, mtime, size, inode, inline_data "
+                              "from meta_data where key > :first and key < :last order by key;";
+
+    len = strlen(path);
+    if (len >= sizeof(key))
+        return -ENAMETOOLONG;
+    strcpy(key, path);
+    while ((len > 1) && (key[len - 1] == '/'))
+        key[--len] = 0;
+    if (!len)
+        return -ENOENT;
+    /* the names in the archive start with the last part of path */
+    base = strrchr(key, '/');
+    base = base ? base + 1 : key;
+    if (len == 1)
+        len = 0;
 
-    i = key_exists(get_sqlfs(sqlfs), key, 0);
-    if (i == 0)
-        result = -ENOENT;
-    else if (i == 2)
-        result = -EBUSY;
+    /* a read transaction for the whole archive, which is a snapshot */
+    begin_read_transaction(get_sqlfs(sqlfs));
+    CHECK_PARENT_PATH(key);
+    CHECK_READ(key);
 
-    if (result == 0)
+    for (i = 0; (i < 2) && !result; i++)
     {
-        if (SQLITE_OK == remove_key_subtree_with_exclusion(get_sqlfs(sqlfs), key, exclusion_pattern))
-            result = 0;
+        if (i == 0)
+        {
+            SQLITE3_PREPARE(get_sqlfs(sqlfs)->db, cmd1, -1, &stmt,  &tail);
+        }
         else
+        {
+#undef INDEX
+#define INDEX 50
+            SQLITE3_PREPARE(get_sqlfs(sqlfs)->db, cmd2, -1, &stmt,  &tail);
+        }
+        if (r != SQLITE_OK)
+        {
+            show_msg(stderr, "%s\n", sqlite3_errmsg(get_sqlfs(sqlfs)->db));
             result = -EIO;
+            break;
+        }
+        if (i == 0)
+            sqlite3_bind_text(stmt, 1, key, -1, SQLITE_STATIC);
+        else
+        {
+            snprintf(first, sizeof(first), "%.*s/", (int) len, key);
+            snprintf(last, sizeof(last), "%.*s0", (int) len, key);
+            sqlite3_bind_text(stmt, 1, first, -1, SQLITE_STATIC);
+            sqlite3_bind_text(stmt, 2, last, -1, SQLITE_STATIC);
+        }
+        while (!result && ((r = sql_step(stmt)) == SQLITE_ROW))
+        {
+            const char *k = (const char *) sqlite3_column_text(stmt, 0);
+            const char *type = (const char *) sqlite3_column_text(stmt, 1);
+            int is_dir = type && !strcmp(type, TYPE_DIR);
+            /* the rows carry their permissions, so they are checked here
+             * rather than with a lookup each.  Files the caller may not
+             * read are left out, and so is what is below directories it
+             * may not list or search. */
+            int allowed = (uid == 0) ||
+                mode_allows(uid, gid, sqlite3_column_int(stmt, 3), sqlite3_column_int(stmt, 4),
+                            sqlite3_column_int(stmt, 2), is_dir ? R_OK | X_OK : R_OK);
+            if (export_skipped(skipped, n_skipped, k))
+                continue;
+            if (!allowed && (i == 0))
+            {
+                result = -EACCES;
+                break;
+            }
+            if (!allowed && !is_dir)
+                continue;
+            if (!allowed)
+            {
+                char **more = realloc(skipped, (n_skipped + 1) * sizeof(*skipped));
+                if (!more || !(more[n_skipped] = strdup(k)))
+                {
+                    skipped = more ? more : skipped;
+                    result = -ENOMEM;
+                    break;
+                }
+                skipped = more;
+                n_skipped++;
+            }
+            /* the root directory has no name of its own */
+            if (!len && (i == 0))
+                continue;
+            snprintf(name, sizeof(name), "%s%s%s", base, k + len + (*base ? 0 : 1),
+                     is_dir ? "/" : "");
+            result = export_entry(sqlfs, stmt, name, &out);
+        }
+        if (!result && (r != SQLITE_DONE))
+        {
+            show_msg(stderr, "%s\n", sqlite3_errmsg(get_sqlfs(sqlfs)->db));
+            result = (r == SQLITE_BUSY) ? -EBUSY : -EIO;
+        }
+        sqlite3_reset(stmt);
     }
+    /* two empty blocks end the archive */
+    if (!result)
+        result = tar_write(&out, zero_block, 2 * TAR_BLOCK);
     commit_transaction(get_sqlfs(sqlfs), 1);
+    while (n_skipped > 0)
+        free(skipped[--n_skipped]);
+    free(skipped);
     return result;
 }
 
 
-
 int sqlfs_get_value(sqlfs_t *sqlfs, const char *key, key_value *value,
                     size_t begin, size_t end)
 {
     int r = SQLITE_OK;
-    begin_transaction(get_sqlfs(sqlfs));
+    begin_read_transaction(get_sqlfs(sqlfs));
     if (check_parent_access(sqlfs, key) != 0)
         r = SQLITE_ERROR;
     else if (sqlfs_proc_access(sqlfs, key, R_OK | F_OK) != 0)
@@ -3066,7 +6418,7 @@ int sqlfs_set_value(sqlfs_t *sqlfs, const char *key, const key_value *value,
 int sqlfs_get_attr(sqlfs_t *sqlfs, const char *key, key_attr *attr)
 {
     int i, r = 1;
-    begin_transaction(get_sqlfs(sqlfs));
+    begin_read_transaction(get_sqlfs(sqlfs));
     if ((i = check_parent_access(sqlfs, key)) != 0)
     {
         if (i == -ENOENT)
@@ -3173,7 +6525,7 @@ int sqlfs_list_keys(sqlfs_t *sqlfs, const char *pattern, void *buf, fuse_fill_di
     char tmp[PATH_MAX];
     char *lpath;
     sqlite3_stmt *stmt;
-    begin_transaction(get_sqlfs(sqlfs));
+    begin_read_transaction(get_sqlfs(sqlfs));
 
     lpath = strdup(pattern);
     remove_tail_slash(lpath);
@@ -3228,21 +6580,340 @@ int sqlfs_is_dir(sqlfs_t *sqlfs, const char *key)
     return key_is_dir(sqlfs, key);
 }
 
+/* The dentry table lists the direct children of each directory by inode,
+ * so that readdir does not have to scan every descendant in meta_data.
+ * It is kept up to date by triggers on meta_data: a row is linked to the
+ * directory holding it and adopts the rows below it, which covers rows
+ * created or renamed before their parent (see rename_dir_children).
+ * The parent of a key is its prefix up to the last '/'. */
+#define DENTRY_PREFIX(k) "rtrim(" k ", replace(" k ", '/', ''))"
+#define DENTRY_NAME(k) "substr(" k ", length(" DENTRY_PREFIX(k) ") + 1)"
+#define DENTRY_PARENT(k) "coalesce(nullif(rtrim(" DENTRY_PREFIX(k) ", '/'), ''), '/')"
+#define DENTRY_LINK \
+    "insert or replace into dentry (parent, name, child) " \
+    "select p.inode, " DENTRY_NAME("new.key") ", new.inode from meta_data p " \
+    "where p.key = " DENTRY_PARENT("new.key") " and p.inode is not null " \
+    "and new.inode is not null and " DENTRY_NAME("new.key") " <> ''; "
+#define DENTRY_ADOPT \
+    "insert or replace into dentry (parent, name, child) " \
+    "select new.inode, substr(c.key, length(rtrim(new.key, '/')) + 2), c.inode from meta_data c " \
+    "where new.inode is not null and c.inode is not null " \
+    "and c.key > rtrim(new.key, '/') || '/' and c.key < rtrim(new.key, '/') || '0' " \
+    "and instr(substr(c.key, length(rtrim(new.key, '/')) + 2), '/') = 0; "
+
+static const char *dentry_cmds[] =
+{
+    "create table if not exists dentry (parent integer, name text, child integer, "
+    "primary key (parent, name));",
+    "create unique index if not exists dentry_child on dentry (child);",
+    "create trigger if not exists dentry_insert after insert on meta_data "
+    "begin " DENTRY_LINK DENTRY_ADOPT "end;",
+    "create trigger if not exists dentry_update after update of key, inode on meta_data "
+    "when old.key is not new.key or old.inode is not new.inode begin "
+    "delete from dentry where child = old.inode; "
+    "delete from dentry where parent = old.inode; "
+    DENTRY_LINK DENTRY_ADOPT "end;",
+    "create trigger if not exists dentry_delete after delete on meta_data begin "
+    "delete from dentry where child = old.inode; "
+    "delete from dentry where parent = old.inode; "
+    "end;",
+    0
+};
+
+/* Deduplicated blocks are stored once in block_content and referred to by
+ * the content column of value_data, with the number of references kept in
+ * refcount by these triggers.  Removing or overwriting blocks through any
+ * path (remove_key(), key_shorten_value(), ...) thus releases the content. */
+static const char *block_content_cmds[] =
+{
+    "create table if not exists block_content (id integer primary key, hash integer, "
+    "refcount integer, data_block blob, codec integer);",
+    "create index if not exists block_content_hash on block_content (hash);",
+    "create trigger if not exists block_content_insert after insert on value_data "
+    "when new.content is not null begin "
+    "update block_content set refcount = refcount + 1 where id = new.content; "
+    "end;",
+    "create trigger if not exists block_content_update after update of content on value_data "
+    "when old.content is not new.content begin "
+    "update block_content set refcount = refcount + 1 where id = new.content; "
+    "update block_content set refcount = refcount - 1 where id = old.content; "
+    "delete from block_content where id = old.content and refcount <= 0; "
+    "end;",
+    "create trigger if not exists block_content_delete after delete on value_data "
+    "when old.content is not null begin "
+    "update block_content set refcount = refcount - 1 where id = old.content; "
+    "delete from block_content where id = old.content and refcount <= 0; "
+    "end;",
+    0
+};
+
 static int create_db_table(sqlfs_t *sqlfs)
 {
     /* ensure tables are created if not existing already
                    if already exist, command results ignored so no effects */
     static const char *cmd1 =
-        " CREATE TABLE meta_data(key text, type text, inode integer, uid integer, gid integer, mode integer,"
-        "acl text, attribute text, atime integer, mtime integer, ctime integer, size integer,"
-        "block_size integer, primary key (key), unique(key))" ;
+        " CREATE TABLE meta_data(key text primary key, type text, inode integer, uid integer, gid integer,"
+        "mode integer, acl text, attribute text, atime integer, mtime integer, ctime integer,"
+        "size integer, block_size integer, inline_data blob)" ;
+    /* see block_id() */
     static const char *cmd2 =
-        " CREATE TABLE value_data (key text, block_no integer, data_block blob, unique(key, block_no))";
-    static const char *cmd3 = "create index meta_index on meta_data (key);";
+        " CREATE TABLE value_data (block_id integer primary key, data_block blob, content integer,"
+        "codec integer)";
+    static const char *cmd3 = "create unique index meta_inode on meta_data (inode);";
+    /* filesystem wide settings chosen when the database is created */
+    static const char *cmd4 = " CREATE TABLE superblock (key text primary key, value)";
+    int i;
 
     sqlite3_exec(get_sqlfs(sqlfs)->db, cmd1, NULL, NULL, NULL);
     sqlite3_exec(get_sqlfs(sqlfs)->db, cmd2, NULL, NULL, NULL);
     sqlite3_exec(get_sqlfs(sqlfs)->db, cmd3, NULL, NULL, NULL);
+    sqlite3_exec(get_sqlfs(sqlfs)->db, cmd4, NULL, NULL, NULL);
+    for (i = 0; dentry_cmds[i]; i++)
+        sqlite3_exec(get_sqlfs(sqlfs)->db, dentry_cmds[i], NULL, NULL, NULL);
+    for (i = 0; block_content_cmds[i]; i++)
+        sqlite3_exec(get_sqlfs(sqlfs)->db, block_content_cmds[i], NULL, NULL, NULL);
+    return 1;
+}
+
+static int get_layout_version(sqlfs_t *sqlfs)
+{
+    int r, version = -1;
+    const char *tail;
+    sqlite3_stmt *stmt;
+
+    r = sqlite3_prepare(get_sqlfs(sqlfs)->db, "PRAGMA user_version;", -1, &stmt, &tail);
+    if (r != SQLITE_OK)
+    {
+        show_msg(stderr, "%s\n", sqlite3_errmsg(get_sqlfs(sqlfs)->db));
+        return -1;
+    }
+    if (sql_step(stmt) == SQLITE_ROW)
+        version = sqlite3_column_int(stmt, 0);
+    sqlite3_finalize(stmt);
+    return version;
+}
+
+/* layout 0 keyed value_data by path, so the blocks get re-keyed by the
+ * inode of their file.  Legacy inodes came from a per-process counter, so
+ * missing and duplicated ones are renumbered first. */
+static const char *layout_1_cmds[] =
+{
+    "update meta_data set inode = null where inode <= 0 or rowid not in "
+    "(select min(rowid) from meta_data group by inode);",
+    "update meta_data set inode = (select coalesce(max(inode), 0) from meta_data) + rowid where inode is null;",
+    "create table value_data_1 (inode integer, block_no integer, data_block blob, unique(inode, block_no));",
+    "insert into value_data_1 (inode, block_no, data_block) select m.inode, v.block_no, v.data_block "
+    "from value_data v join meta_data m on m.key = v.key;",
+    "drop table value_data;",
+    "alter table value_data_1 rename to value_data;",
+    "create unique index if not exists meta_inode on meta_data (inode);",
+    0
+};
+
+/* layout 2 added the dentry table, fill it from the existing keys */
+static const char *layout_2_cmds[] =
+{
+    "insert or replace into dentry (parent, name, child) "
+    "select p.inode, " DENTRY_NAME("c.key") ", c.inode from meta_data c "
+    "join meta_data p on p.key = " DENTRY_PARENT("c.key") " "
+    "where c.key <> '/' and c.inode is not null and p.inode is not null "
+    "and " DENTRY_NAME("c.key") " <> '';",
+    0
+};
+
+/* before layout 3 the block size was always 8192; a database without any
+ * keys yet is new and gets its block size from load_superblock() */
+static const char *layout_3_cmds[] =
+{
+    "insert or ignore into superblock (key, value) "
+    "select 'block_size', 8192 where exists (select * from meta_data);",
+    0
+};
+
+/* layout 7 rebuilds value_data around its block_id rowid, which replaces
+ * the separate (inode, block_no) index, and meta_data without the
+ * duplicate indexes on key.  Dropping the tables drops their triggers and
+ * indexes, they are created again afterwards. */
+static const char *layout_7_cmds[] =
+{
+    "create table value_data_7 (block_id integer primary key, data_block blob, content integer,"
+    "codec integer);",
+    "insert into value_data_7 (block_id, data_block, content, codec) "
+    "select (inode << 32) | block_no, data_block, content, codec from value_data "
+    "order by inode, block_no;",
+    "drop table value_data;",
+    "alter table value_data_7 rename to value_data;",
+    "create table meta_data_7 (key text primary key, type text, inode integer, uid integer,"
+    "gid integer, mode integer, acl text, attribute text, atime integer, mtime integer,"
+    "ctime integer, size integer, block_size integer, inline_data blob);",
+    "insert into meta_data_7 (key, type, inode, uid, gid, mode, acl, attribute, atime, mtime,"
+    "ctime, size, block_size, inline_data) "
+    "select key, type, inode, uid, gid, mode, acl, attribute, atime, mtime,"
+    "ctime, size, block_size, inline_data from meta_data order by key;",
+    "drop table meta_data;",
+    "alter table meta_data_7 rename to meta_data;",
+    "create unique index meta_inode on meta_data (inode);",
+    0
+};
+
+/* adds a column to a table unless it is already there, as it is in the
+ * tables of a freshly created database */
+static int add_column(sqlfs_t *sqlfs, const char *table, const char *column, char **errmsg)
+{
+    int r;
+    const char *tail;
+    sqlite3_stmt *stmt;
+    char buf[256];
+
+    snprintf(buf, sizeof(buf), "select %.*s from %s limit 0;",
+             (int) strcspn(column, " "), column, table);
+    r = sqlite3_prepare(get_sqlfs(sqlfs)->db, buf, -1, &stmt, &tail);
+    if (r == SQLITE_OK)
+    {
+        sqlite3_finalize(stmt);
+        return r;
+    }
+    snprintf(buf, sizeof(buf), "alter table %s add column %s;", table, column);
+    return sqlite3_exec(get_sqlfs(sqlfs)->db, buf, NULL, NULL, errmsg);
+}
+
+static int upgrade_db_layout(sqlfs_t *sqlfs)
+{
+    int i, r, version;
+    const char *tail;
+    sqlite3_stmt *stmt;
+    char *errmsg = 0;
+    char buf[64];
+
+    if (get_layout_version(sqlfs) == LAYOUT_VERSION)
+        return 1;
+
+    r = sqlite3_exec(get_sqlfs(sqlfs)->db, "begin immediate;", NULL, NULL, NULL);
+    if (r != SQLITE_OK)
+    {
+        show_msg(stderr, "%s\n", sqlite3_errmsg(get_sqlfs(sqlfs)->db));
+        return 0;
+    }
+    /* check again, another connection might have done the upgrade meanwhile */
+    version = get_layout_version(sqlfs);
+    if (version > LAYOUT_VERSION)
+    {
+        show_msg(stderr, "database layout %d is newer than supported (%d)\n",
+                 version, LAYOUT_VERSION);
+        sqlite3_exec(get_sqlfs(sqlfs)->db, "rollback;", NULL, NULL, NULL);
+        return 0;
+    }
+
+    if (version < 1)
+    {
+        /* a freshly created database already has the current tables */
+        r = sqlite3_prepare(get_sqlfs(sqlfs)->db, "select key from value_data limit 0;", -1, &stmt, &tail);
+        if (r == SQLITE_OK)
+        {
+            sqlite3_finalize(stmt);
+            for (i = 0; layout_1_cmds[i] && (r == SQLITE_OK); i++)
+                r = sqlite3_exec(get_sqlfs(sqlfs)->db, layout_1_cmds[i], NULL, NULL, &errmsg);
+        }
+        else
+            r = SQLITE_OK;
+    }
+    if ((r == SQLITE_OK) && (version < 2))
+    {
+        for (i = 0; layout_2_cmds[i] && (r == SQLITE_OK); i++)
+            r = sqlite3_exec(get_sqlfs(sqlfs)->db, layout_2_cmds[i], NULL, NULL, &errmsg);
+    }
+    if ((r == SQLITE_OK) && (version < 3))
+    {
+        for (i = 0; layout_3_cmds[i] && (r == SQLITE_OK); i++)
+            r = sqlite3_exec(get_sqlfs(sqlfs)->db, layout_3_cmds[i], NULL, NULL, &errmsg);
+    }
+    if ((r == SQLITE_OK) && (version < 4))
+        r = add_column(sqlfs, "meta_data", "inline_data blob", &errmsg);
+    if ((r == SQLITE_OK) && (version < 5))
+    {
+        r = add_column(sqlfs, "value_data", "content integer", &errmsg);
+        /* the triggers could not be created on the old value_data */
+        for (i = 0; block_content_cmds[i] && (r == SQLITE_OK); i++)
+            r = sqlite3_exec(get_sqlfs(sqlfs)->db, block_content_cmds[i], NULL, NULL, &errmsg);
+    }
+    if ((r == SQLITE_OK) && (version < 6))
+        r = add_column(sqlfs, "value_data", "codec integer", &errmsg);
+    if ((r == SQLITE_OK) && (version < 6))
+        r = add_column(sqlfs, "block_content", "codec integer", &errmsg);
+    if ((r == SQLITE_OK) && (version < 7))
+    {
+        /* a freshly created database already has the current tables */
+        r = sqlite3_prepare(get_sqlfs(sqlfs)->db, "select block_id from value_data limit 0;", -1, &stmt, &tail);
+        if (r == SQLITE_OK)
+            sqlite3_finalize(stmt);
+        else
+        {
+            r = SQLITE_OK;
+            for (i = 0; layout_7_cmds[i] && (r == SQLITE_OK); i++)
+                r = sqlite3_exec(get_sqlfs(sqlfs)->db, layout_7_cmds[i], NULL, NULL, &errmsg);
+            for (i = 0; dentry_cmds[i] && (r == SQLITE_OK); i++)
+                r = sqlite3_exec(get_sqlfs(sqlfs)->db, dentry_cmds[i], NULL, NULL, &errmsg);
+            for (i = 0; block_content_cmds[i] && (r == SQLITE_OK); i++)
+                r = sqlite3_exec(get_sqlfs(sqlfs)->db, block_content_cmds[i], NULL, NULL, &errmsg);
+        }
+    }
+
+    if (r == SQLITE_OK)
+    {
+        snprintf(buf, sizeof(buf), "PRAGMA user_version = %d;", LAYOUT_VERSION);
+        r = sqlite3_exec(get_sqlfs(sqlfs)->db, buf, NULL, NULL, &errmsg);
+    }
+    if (r != SQLITE_OK)
+    {
+        show_msg(stderr, "upgrading database layout failed: %s\n", errmsg ? errmsg : "");
+        sqlite3_free(errmsg);
+        sqlite3_exec(get_sqlfs(sqlfs)->db, "rollback;", NULL, NULL, NULL);
+        return 0;
+    }
+    return sqlite3_exec(get_sqlfs(sqlfs)->db, "commit;", NULL, NULL, NULL) == SQLITE_OK;
+}
+
+/* the first connection to a new database stores the block size in its
+ * superblock, later ones use whatever is stored there */
+static int load_superblock(sqlfs_t *sqlfs)
+{
+    int r;
+    const char *tail;
+    sqlite3_stmt *stmt;
+    static const char *cmd1 = "insert or ignore into superblock (key, value) values ('block_size', :value);";
+    static const char *cmd2 = "select value from superblock where key = 'block_size';";
+
+    r = sqlite3_prepare(get_sqlfs(sqlfs)->db, cmd1, -1, &stmt, &tail);
+    if (r != SQLITE_OK)
+    {
+        show_msg(stderr, "%s\n", sqlite3_errmsg(get_sqlfs(sqlfs)->db));
+        return 0;
+    }
+    sqlite3_bind_int64(stmt, 1, new_db_block_size);
+    r = sql_step(stmt);
+    sqlite3_finalize(stmt);
+    if (r != SQLITE_DONE)
+    {
+        show_msg(stderr, "%s\n", sqlite3_errmsg(get_sqlfs(sqlfs)->db));
+        return 0;
+    }
+
+    r = sqlite3_prepare(get_sqlfs(sqlfs)->db, cmd2, -1, &stmt, &tail);
+    if (r != SQLITE_OK)
+    {
+        show_msg(stderr, "%s\n", sqlite3_errmsg(get_sqlfs(sqlfs)->db));
+        return 0;
+    }
+    get_sqlfs(sqlfs)->block_size = DEFAULT_BLOCK_SIZE;
+    if (sql_step(stmt) == SQLITE_ROW)
+        get_sqlfs(sqlfs)->block_size = sqlite3_column_int64(stmt, 0);
+    sqlite3_finalize(stmt);
+    if ((get_sqlfs(sqlfs)->block_size < SQLFS_MIN_BLOCK_SIZE) ||
+        (get_sqlfs(sqlfs)->block_size > SQLFS_MAX_BLOCK_SIZE))
+    {
+        show_msg(stderr, "invalid block size %zu in the superblock\n", get_sqlfs(sqlfs)->block_size);
+        return 0;
+    }
     return 1;
 }
 
@@ -3327,13 +6998,25 @@ static void * sqlfs_t_init(const char *db_file, const char *password)
     sql_fs->default_mode = 0700; /* allows the creation of children under / , default user at initialization is 0 (root)*/
 
     create_db_table(sql_fs);
-
-    if (max_inode == 0)
-        max_inode = get_current_max_inode(sql_fs);
+    if (!upgrade_db_layout(sql_fs))
+        return 0;
+    if (!load_superblock(sql_fs))
+        return 0;
+    sql_fs->inline_threshold = default_inline_threshold;
+    sql_fs->dedup = default_dedup;
+    sql_fs->codec = default_codec;
+    sql_fs->atime_mode = default_atime_mode;
+    sql_fs->upsert = (sqlite3_libversion_number() >= 3024000);
+    sql_fs->write_back_size = default_write_back_size;
+    sql_fs->write_back_delay = default_write_back_delay;
+    pthread_mutex_lock(&write_back_lock);
+    sql_fs->serial = ++connection_serial;
+    pthread_mutex_unlock(&write_back_lock);
 
     r = ensure_existence(sql_fs, "/", TYPE_DIR);
     if (!r)
         return 0;
+    block_cache_attach(sql_fs, db_file);
     pthread_setspecific(pthread_key, sql_fs);
     instance_count++;
     return (void *) sql_fs;
@@ -3345,11 +7028,23 @@ static void sqlfs_t_finalize(void *arg)
     if (sql_fs)
     {
         int i;
+        write_back_store_all(sql_fs, 0);
         for (i = 0; i < (int)(sizeof(sql_fs->stmts) / sizeof(sql_fs->stmts[0])); i++)
             if (sql_fs->stmts[i])
                 sqlite3_finalize(sql_fs->stmts[i]);
 
         sqlite3_close(sql_fs->db);
+        block_cache_detach(sql_fs);
+        free(sql_fs->read_ahead.path);
+        free(sql_fs->read_ahead.data);
+        for (i = 0; sql_fs->meta_cache && (i < META_CACHE_SIZE); i++)
+        {
+            free(sql_fs->meta_cache[i].key);
+            free(sql_fs->meta_cache[i].type);
+        }
+        free(sql_fs->meta_cache);
+        free(sql_fs->meta_scratch.key);
+        free(sql_fs->meta_scratch.type);
         free(sql_fs);
         instance_count--;
     }
@@ -3481,6 +7176,81 @@ int sqlfs_close(sqlfs_t *sqlfs)
     return !instance_count; // its an error if still instances left
 }
 
+int sqlfs_set_block_size(size_t block_size)
+{
+    if ((block_size < SQLFS_MIN_BLOCK_SIZE) || (block_size > SQLFS_MAX_BLOCK_SIZE) ||
+        (block_size & (block_size - 1)))
+        return 0;
+    new_db_block_size = block_size;
+    return 1;
+}
+
+int sqlfs_set_inline_threshold(size_t size)
+{
+    default_inline_threshold = size;
+    return 1;
+}
+
+int sqlfs_set_dedup(int enable)
+{
+    default_dedup = enable;
+    return 1;
+}
+
+int sqlfs_set_codec(int codec)
+{
+    if ((codec != SQLFS_CODEC_NONE) && (codec != SQLFS_CODEC_LZF))
+        return 0;
+    default_codec = codec;
+    return 1;
+}
+
+int sqlfs_set_atime_mode(int mode)
+{
+    if ((mode != SQLFS_ATIME_STRICT) && (mode != SQLFS_ATIME_RELATIME) &&
+        (mode != SQLFS_ATIME_NOATIME))
+        return 0;
+    default_atime_mode = mode;
+    return 1;
+}
+
+int sqlfs_set_write_back(size_t size, unsigned int delay_ms)
+{
+    default_write_back_size = size;
+    default_write_back_delay = delay_ms;
+    return 1;
+}
+
+int sqlfs_set_group_commit(size_t max_ops, unsigned int delay_ms)
+{
+    pthread_mutex_lock(&group_lock);
+    default_group_commit_ops = max_ops;
+    default_group_commit_delay = delay_ms;
+    pthread_mutex_unlock(&group_lock);
+    return 1;
+}
+
+int sqlfs_set_block_cache_size(size_t size)
+{
+    pthread_mutex_lock(&block_cache_lock);
+    block_cache_budget = size;
+    block_cache_evict();
+    pthread_mutex_unlock(&block_cache_lock);
+    return 1;
+}
+
+void sqlfs_get_block_cache_stats(size_t *hits, size_t *misses, size_t *used)
+{
+    pthread_mutex_lock(&block_cache_lock);
+    if (hits)
+        *hits = block_cache_hits;
+    if (misses)
+        *misses = block_cache_misses;
+    if (used)
+        *used = block_cache_used;
+    pthread_mutex_unlock(&block_cache_lock);
+}
+
 void sqlfs_detach_thread(void)
 {
     sqlfs_t_finalize(pthread_getspecific(pthread_key));
@@ -3648,7 +7418,9 @@ int sqlfs_init(const char *db_file_name)
 
 int sqlfs_destroy()
 {
-    int err = pthread_key_delete(pthread_key);
+    int err;
+    group_commit_stop();
+    err = pthread_key_delete(pthread_key);
     if (err == EINVAL)
         show_msg(stderr, "Invalid pthread key in sqlfs_destroy()!\n");
     /* zero out password in memory */
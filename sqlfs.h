@@ -106,6 +106,51 @@ extern "C" {
     int sqlfs_open(const char *db_file, sqlfs_t **psqlfs);
     int sqlfs_close(sqlfs_t *);
     void sqlfs_detach_thread();
+    /* block size used when a new database is created, existing databases
+     * keep the one stored in their superblock.  Must be a power of two
+     * between SQLFS_MIN_BLOCK_SIZE and SQLFS_MAX_BLOCK_SIZE. */
+#   define SQLFS_MIN_BLOCK_SIZE 512
+#   define SQLFS_MAX_BLOCK_SIZE (1024 * 1024)
+    int sqlfs_set_block_size(size_t block_size);
+    /* files up to this size (1024 by default, 0 disables it) are stored
+     * inline in their metadata row by connections opened afterwards */
+    int sqlfs_set_inline_threshold(size_t size);
+    /* when enabled, connections opened afterwards store identical blocks
+     * only once.  Either way all blocks stay readable. */
+    int sqlfs_set_dedup(int enable);
+    /* codec used by connections opened afterwards to compress new blocks.
+     * Every block records its codec, so blocks written with any codec stay
+     * readable. */
+#   define SQLFS_CODEC_NONE 0
+#   define SQLFS_CODEC_LZF 1
+    int sqlfs_set_codec(int codec);
+    /* when reads by connections opened afterwards update the access time:
+     * always (the default), only when it is not after the modification
+     * time or is a day old, or never */
+#   define SQLFS_ATIME_STRICT 0
+#   define SQLFS_ATIME_RELATIME 1
+#   define SQLFS_ATIME_NOATIME 2
+    int sqlfs_set_atime_mode(int mode);
+    /* when size is not 0, files opened for writing by connections opened
+     * afterwards hold back small writes that continue each other, up to
+     * size bytes, in a buffer on the fh of their fuse_file_info.  They are
+     * stored together on release, fsync, the next call of any connection
+     * of the process, or a write made delay_ms after the first held (0
+     * for no limit).  Other processes only see the writes once stored. */
+    int sqlfs_set_write_back(size_t size, unsigned int delay_ms);
+    /* when max_ops is not 0, the calls that change the file system from
+     * threads of the thread API (sqlfs == 0) go to one writer thread, which
+     * runs up to max_ops of them in one transaction, waiting up to delay_ms
+     * for them to arrive.  Each call returns once its transaction ended.
+     * Calls made inside a transaction of the thread still run on its own
+     * connection. */
+    int sqlfs_set_group_commit(size_t max_ops, unsigned int delay_ms);
+    /* memory in bytes for the block cache shared by all connections of the
+     * process, 0 (the default) turns it off.  Only use it when no other
+     * process writes to the databases. */
+    int sqlfs_set_block_cache_size(size_t size);
+    /* block cache lookups that were hits and misses, and the bytes cached */
+    void sqlfs_get_block_cache_stats(size_t *hits, size_t *misses, size_t *used);
     /* since the password gets cooked down to 256 bits, 512 chars is plenty */
 #   define MAX_PASSWORD_LENGTH 512
 #ifdef HAVE_LIBSQLCIPHER
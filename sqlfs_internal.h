@@ -35,6 +35,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 #include <fcntl.h>
 #include <errno.h>
 #include <utime.h>
+#include <sys/uio.h>
 
 #define TYPE_NULL "null"
 #define TYPE_DIR "dir"
@@ -124,6 +125,36 @@ int sqlfs_proc_read(sqlfs_t *, const char *path, char *buf, size_t size, off_t o
                     fuse_file_info *fi);
 int sqlfs_proc_write(sqlfs_t *, const char *path, const char *buf, size_t size, off_t offset,
                      struct fuse_file_info *fi);
+/* read or write the iovec buffers in order as one contiguous range of the
+ * file starting at offset, in a single call */
+int sqlfs_proc_readv(sqlfs_t *, const char *path, const struct iovec *iov, int iovcnt,
+                     off_t offset, struct fuse_file_info *fi);
+int sqlfs_proc_writev(sqlfs_t *, const char *path, const struct iovec *iov, int iovcnt,
+                      off_t offset, struct fuse_file_info *fi);
+/* called by sqlfs_read_blocks() with consecutive pieces of a file.  data
+ * points into the database row and is only valid during the call.  A
+ * non-zero return stops the read. */
+typedef int (*sqlfs_block_callback_t)(void *ctx, const char *data, size_t size, off_t offset);
+int sqlfs_read_blocks(sqlfs_t *, const char *path, off_t offset, size_t size,
+                      sqlfs_block_callback_t callback, void *ctx);
+/* copies the host directory host_dir and everything in it to dest_path,
+ * which is created or, when it is a directory, merged into.  Threads read
+ * the host files while the calling thread writes them in transactions of
+ * batch_size bytes; what was committed before a failure stays. */
+typedef struct
+{
+    int threads; /* threads reading the host files, 0 for 4 */
+    size_t batch_size; /* bytes written per transaction, 0 for 16 MiB */
+    /* filled in by sqlfs_import_tree() */
+    size_t files; /* regular files and symbolic links */
+    size_t directories;
+    size_t bytes; /* of file data */
+} sqlfs_import_opts;
+int sqlfs_import_tree(sqlfs_t *, const char *host_dir, const char *dest_path,
+                      sqlfs_import_opts *opts);
+/* writes path and everything below it to fd as a tar archive, read in
+ * one transaction so it is a consistent snapshot */
+int sqlfs_export_tar(sqlfs_t *, const char *path, int fd);
 int sqlfs_proc_statfs(sqlfs_t *, const char *path, struct statvfs *stbuf);
 int sqlfs_proc_release(sqlfs_t *, const char *path, struct fuse_file_info *fi);
 int sqlfs_proc_fsync(sqlfs_t *, const char *path, int isfdatasync, struct fuse_file_info *fi);
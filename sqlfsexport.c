@@ -0,0 +1,64 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "sqlfs.h"
+
+#define BUF_SIZE 8192
+
+int main(int argc, char *argv[])
+{
+    int r;
+    sqlfs_t *sqlfs = 0;
+    if (argc != 3)
+    {
+        fprintf(stderr, "Usage: %s sqlfs.db /path/in/sqlfs > archive.tar\n", argv[0]);
+        exit(1);
+    }
+    const char *db = argv[1];
+    const char *path = argv[2];
+
+    if(access(db, R_OK))
+    {
+        fprintf(stderr, "sqlfs file is not readable! (%s)\n", db);
+        exit(1);
+    }
+    if (isatty(STDOUT_FILENO))
+    {
+        fprintf(stderr, "Not writing a tar archive to a terminal\n");
+        exit(1);
+    }
+
+#ifdef HAVE_LIBSQLCIPHER
+/* get the password from stdin */
+    char password[BUF_SIZE];
+    char *p = fgets(password, BUF_SIZE, stdin);
+    if (p)
+    {
+        /* remove trailing newline */
+        size_t last = strlen(p) - 1;
+        if (p[last] == '\n')
+            p[last] = '\0';
+        if (!sqlfs_open_password(db, password, &sqlfs)) {
+            fprintf(stderr, "Failed to open: %s\n", db);
+            return 1;
+        }
+        memset(password, 0, BUF_SIZE); // zero out password
+    }
+    else
+#endif /* HAVE_LIBSQLCIPHER */
+    {
+        if (!sqlfs_open(db, &sqlfs)) {
+            fprintf(stderr, "Failed to open: %s\n", db);
+            return 1;
+        }
+    }
+
+    r = sqlfs_export_tar(sqlfs, path, STDOUT_FILENO);
+    if (r != 0)
+        fprintf(stderr, "Failed to export %s from %s: %s\n", path, db, strerror(-r));
+
+    sqlfs_close(sqlfs);
+    return (r != 0);
+}
@@ -0,0 +1,69 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "sqlfs.h"
+
+#define BUF_SIZE 8192
+
+int main(int argc, char *argv[])
+{
+    int r;
+    struct timeval tstart, tstop;
+    double t;
+    sqlfs_import_opts opts = { 0, 0, 0, 0, 0 };
+    sqlfs_t *sqlfs = 0;
+    if ((argc != 4) && (argc != 5))
+    {
+        fprintf(stderr, "Usage: %s sqlfs.db /host/dir/to/import /path/in/sqlfs [threads]\n",
+                argv[0]);
+        exit(1);
+    }
+    const char *db = argv[1];
+    const char *host_dir = argv[2];
+    const char *dest = argv[3];
+    if (argc == 5)
+        opts.threads = atoi(argv[4]);
+
+/* the database is created if it does not exist yet */
+#ifdef HAVE_LIBSQLCIPHER
+/* get the password from stdin */
+    char password[BUF_SIZE];
+    char *p = fgets(password, BUF_SIZE, stdin);
+    if (p)
+    {
+        /* remove trailing newline */
+        size_t last = strlen(p) - 1;
+        if (p[last] == '\n')
+            p[last] = '\0';
+        if (!sqlfs_open_password(db, password, &sqlfs)) {
+            fprintf(stderr, "Failed to open: %s\n", db);
+            return 1;
+        }
+        memset(password, 0, BUF_SIZE); // zero out password
+    }
+    else
+#endif /* HAVE_LIBSQLCIPHER */
+    {
+        if (!sqlfs_open(db, &sqlfs)) {
+            fprintf(stderr, "Failed to open: %s\n", db);
+            return 1;
+        }
+    }
+
+    gettimeofday(&tstart, NULL);
+    r = sqlfs_import_tree(sqlfs, host_dir, dest, &opts);
+    gettimeofday(&tstop, NULL);
+    t = (double) (tstop.tv_usec - tstart.tv_usec) / 1000000 + (double) (tstop.tv_sec - tstart.tv_sec);
+    if (t <= 0)
+        t = 1e-6;
+    printf("%zu files, %zu directories, %zu bytes in %.3f seconds: %.0f files/s, %.1f MB/s\n",
+           opts.files, opts.directories, opts.bytes, t, opts.files / t,
+           opts.bytes / t / 1048576);
+    if (r != 0)
+        fprintf(stderr, "Failed to import %s into %s: %s\n", host_dir, dest, strerror(-r));
+
+    sqlfs_close(sqlfs);
+    return (r != 0);
+}
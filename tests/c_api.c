@@ -22,6 +22,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 int main(int argc, char *argv[])
 {
     char *database_filename = "c_api.db";
+    char block_size_filename[PATH_MAX];
     int rc;
     sqlfs_t *sqlfs = 0;
 
@@ -45,6 +46,21 @@ int main(int argc, char *argv[])
     assert(sqlfs_close(sqlfs));
     printf("passed\n");
 
+    snprintf(block_size_filename, sizeof(block_size_filename), "%s-bs", database_filename);
+    test_block_size_persists(block_size_filename);
+    test_dedup_refcounts(block_size_filename);
+    test_codec_roundtrip(block_size_filename);
+    test_sparse_file(block_size_filename);
+    test_block_cache(block_size_filename);
+    test_read_ahead(block_size_filename);
+    test_meta_cache(block_size_filename);
+    test_atime_modes(block_size_filename);
+    test_write_back(block_size_filename);
+#ifndef HAVE_LIBFUSE
+    test_import_permissions(block_size_filename);
+    test_export_permissions(block_size_filename);
+#endif
+
     rc++; // silence ccpcheck
 
     return 0;
@@ -26,6 +26,16 @@ int main(int argc, char *argv[])
     assert(rc);
     printf("done\n");
 
+    run_block_size_perf_tests(database_filename, 8*WRITESZ);
+    run_codec_perf_tests(database_filename, 8*WRITESZ);
+    run_sequential_read_perf_tests(database_filename, 16*WRITESZ);
+    run_aligned_write_perf_tests(database_filename, 32*WRITESZ);
+    run_write_throughput_perf_tests(database_filename, 32*WRITESZ);
+    run_reader_scaling_perf_tests(database_filename);
+    run_writer_scaling_perf_tests(database_filename);
+    run_import_perf_tests(database_filename);
+    run_export_perf_tests(database_filename);
+
 
     printf("\n------------------------------------------------------------------------\n");
     printf("Running tests using the thread API, i.e. sqlfs == 0:\n");
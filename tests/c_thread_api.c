@@ -26,6 +26,8 @@ int main(int argc, char *argv[])
 {
     int rc;
     char *database_filename = "c_thread_api.db";
+    char write_back_filename[PATH_MAX];
+    char group_filename[PATH_MAX];
 
     if(argc > 1)
       database_filename = argv[1];
@@ -42,6 +44,11 @@ int main(int argc, char *argv[])
     rc = sqlfs_destroy();
     assert(rc == 0);
 
+    snprintf(write_back_filename, sizeof(write_back_filename), "%s-write-back", database_filename);
+    test_write_back_threads(write_back_filename);
+    snprintf(group_filename, sizeof(group_filename), "%s-group", database_filename);
+    test_group_commit(group_filename);
+
     rc++; // silence ccpcheck
 
     printf("done\n");
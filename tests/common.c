@@ -24,6 +24,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 #include <stdio.h>
 #include <time.h>
 #include <sys/time.h>
+#include <pthread.h>
 #include "sqlfs.h"
 
 #ifdef HAVE_LIBSQLCIPHER
@@ -81,6 +82,12 @@ int create_test_file(sqlfs_t* sqlfs, char* filename, int size)
     return sqlfs_proc_write(sqlfs, filename, randomdata, size, 0, &fi);
 }
 
+static int count_filler(void *buf, const char *name, const struct stat *st, off_t off)
+{
+    (*(int *)buf)++;
+    return 0;
+}
+
 void randomfilename(char* buf, int size, char* prefix)
 {
     snprintf(buf, size, "/%s-random-%i", prefix, rand());
@@ -130,6 +137,32 @@ void test_mkdir_to_make_nested_dirs(sqlfs_t *sqlfs)
     printf("passed\n");
 }
 
+void test_deep_path(sqlfs_t *sqlfs)
+{
+    printf("Testing a path deeper than one lookup batch...");
+    char path[PATH_MAX] = "/deep", file[PATH_MAX];
+    struct stat sb;
+    int i;
+    struct fuse_file_info fi = { 0 };
+    for (i = 0; i < 20; i++)
+    {
+        assert(sqlfs_proc_mkdir(sqlfs, path, 0777) == 0);
+        snprintf(path + strlen(path), sizeof(path) - strlen(path), "/%d", i);
+    }
+    snprintf(file, sizeof(file), "%s/file", path);
+    assert(sqlfs_proc_getattr(sqlfs, file, &sb) == -ENOENT);
+    assert(sqlfs_proc_mkdir(sqlfs, path, 0777) == 0);
+    assert(sqlfs_proc_write(sqlfs, file, "deep", 4, 0, &fi) == 4);
+    assert(sqlfs_proc_getattr(sqlfs, file, &sb) == 0);
+    assert(sb.st_size == 4);
+    /* an ancestor that goes away in the middle of the path */
+    assert(sqlfs_proc_rename(sqlfs, "/deep/0/1/2", "/deep/0/1/x") == 0);
+    assert(sqlfs_proc_getattr(sqlfs, file, &sb) == -ENOENT);
+    assert(sqlfs_proc_rename(sqlfs, "/deep/0/1/x", "/deep/0/1/2") == 0);
+    assert(sqlfs_proc_getattr(sqlfs, file, &sb) == 0);
+    printf("passed\n");
+}
+
 void test_rmdir(sqlfs_t *sqlfs)
 {
     printf("Testing rmdir...");
@@ -482,6 +515,1192 @@ void test_open_creat_trunc_existing(sqlfs_t *sqlfs)
     printf("passed\n");
 }
 
+void test_rename_keeps_data(sqlfs_t *sqlfs)
+{
+    printf("Testing rename of files and directories keeps the data...");
+    int testsize = BLOCK_SIZE * 3 + 17;
+    char buf[testsize];
+    char *data = calloc(testsize, sizeof(char));
+    struct stat sb;
+    struct fuse_file_info fi = { 0 };
+    int i;
+    for (i=0; i<testsize; ++i)
+        data[i] = (i % 90) + 32;
+    sqlfs_proc_mkdir(sqlfs, "/renamedir", 0777);
+    sqlfs_proc_mkdir(sqlfs, "/renamedir/sub", 0777);
+    assert(sqlfs_proc_write(sqlfs, "/renamedir/sub/file", data, testsize, 0, &fi) == testsize);
+    assert(sqlfs_proc_rename(sqlfs, "/renamedir/sub/file", "/renamedir/sub/moved") == 0);
+    assert(sqlfs_proc_getattr(sqlfs, "/renamedir/sub/file", &sb) == -ENOENT);
+    assert(sqlfs_proc_read(sqlfs, "/renamedir/sub/moved", buf, testsize, 0, &fi) == testsize);
+    assert(!memcmp(buf, data, testsize));
+    assert(sqlfs_proc_rename(sqlfs, "/renamedir", "/renameddir") == 0);
+    assert(sqlfs_proc_getattr(sqlfs, "/renamedir/sub/moved", &sb) == -ENOENT);
+    sqlfs_proc_getattr(sqlfs, "/renameddir/sub/moved", &sb);
+    assert(sb.st_size == testsize);
+    memset(buf, 0, testsize);
+    assert(sqlfs_proc_read(sqlfs, "/renameddir/sub/moved", buf, testsize, 0, &fi) == testsize);
+    assert(!memcmp(buf, data, testsize));
+    /* a file renamed over another one takes its place, data and all */
+    assert(create_test_file(sqlfs, "/renameddir/other", 100) == 100);
+    assert(sqlfs_proc_rename(sqlfs, "/renameddir/sub/moved", "/renameddir/other") == 0);
+    sqlfs_proc_getattr(sqlfs, "/renameddir/other", &sb);
+    assert(sb.st_size == testsize);
+    assert(sqlfs_proc_read(sqlfs, "/renameddir/other", buf, testsize, 0, &fi) == testsize);
+    assert(!memcmp(buf, data, testsize));
+    free(data);
+    printf("passed\n");
+}
+
+void test_readdir_direct_children(sqlfs_t *sqlfs)
+{
+    printf("Testing readdir lists only the direct children...");
+    int count = 0;
+    sqlfs_proc_mkdir(sqlfs, "/readdir", 0777);
+    sqlfs_proc_mkdir(sqlfs, "/readdir/sub", 0777);
+    sqlfs_proc_mkdir(sqlfs, "/readdir/sub/subsub", 0777);
+    assert(create_test_file(sqlfs, "/readdir/file", 10) == 10);
+    assert(create_test_file(sqlfs, "/readdir/sub/file", 10) == 10);
+    assert(create_test_file(sqlfs, "/readdir/sub/subsub/file", 10) == 10);
+    assert(sqlfs_proc_readdir(sqlfs, "/readdir", &count, count_filler, 0, NULL) == 0);
+    assert(count == 4); /* ".", "..", "sub" and "file" */
+    assert(sqlfs_proc_rmdir(sqlfs, "/readdir/sub/subsub") == -ENOTEMPTY);
+    /* children follow their directory when it is renamed */
+    assert(sqlfs_proc_rename(sqlfs, "/readdir/sub", "/readdir/moved") == 0);
+    count = 0;
+    assert(sqlfs_proc_readdir(sqlfs, "/readdir/moved", &count, count_filler, 0, NULL) == 0);
+    assert(count == 4);
+    count = 0;
+    assert(sqlfs_proc_readdir(sqlfs, "/readdir/moved/subsub", &count, count_filler, 0, NULL) == 0);
+    assert(count == 3);
+    assert(sqlfs_proc_unlink(sqlfs, "/readdir/moved/subsub/file") == 0);
+    assert(sqlfs_proc_rmdir(sqlfs, "/readdir/moved/subsub") == 0);
+    count = 0;
+    assert(sqlfs_proc_readdir(sqlfs, "/readdir/moved", &count, count_filler, 0, NULL) == 0);
+    assert(count == 3);
+    printf("passed\n");
+}
+
+void test_small_file_grows(sqlfs_t *sqlfs)
+{
+    printf("Testing a small file growing past the inline size...");
+    int i, testsize = BLOCK_SIZE * 2 + 100;
+    char buf[testsize], data[testsize];
+    struct stat sb;
+    struct fuse_file_info fi = { 0 };
+    char *testfilename = "/small-file-grows";
+    for (i=0; i<testsize; ++i)
+        data[i] = (i % 90) + 32;
+    assert(sqlfs_proc_write(sqlfs, testfilename, data, 100, 0, &fi) == 100);
+    assert(sqlfs_proc_write(sqlfs, testfilename, data + 50, 20, 50, &fi) == 20);
+    assert(sqlfs_proc_read(sqlfs, testfilename, buf, testsize, 0, &fi) == 100);
+    assert(!memcmp(buf, data, 100));
+    assert(sqlfs_proc_truncate(sqlfs, testfilename, 40) == 0);
+    assert(sqlfs_proc_truncate(sqlfs, testfilename, 60) == 0);
+    assert(sqlfs_proc_read(sqlfs, testfilename, buf, testsize, 0, &fi) == 60);
+    assert(!memcmp(buf, data, 40));
+    for (i=40; i<60; ++i)
+        assert(buf[i] == 0);
+    assert(sqlfs_proc_write(sqlfs, testfilename, data + 40, testsize - 40, 40, &fi) == testsize - 40);
+    sqlfs_proc_getattr(sqlfs, testfilename, &sb);
+    assert(sb.st_size == testsize);
+    assert(sqlfs_proc_read(sqlfs, testfilename, buf, testsize, 0, &fi) == testsize);
+    assert(!memcmp(buf, data, testsize));
+    printf("passed\n");
+}
+
+void test_overwrite_in_place(sqlfs_t *sqlfs)
+{
+    printf("Testing small overwrites inside and across blocks...");
+    int i, testsize = BLOCK_SIZE * 3 - 200;
+    char buf[testsize + 300], data[testsize + 300];
+    struct fuse_file_info fi = { 0 };
+    char *testfilename = "/overwrite-in-place";
+    for (i=0; i<testsize + 300; ++i)
+        data[i] = rand();
+    assert(sqlfs_proc_write(sqlfs, testfilename, data, testsize, 0, &fi) == testsize);
+    for (i=0; i<testsize + 300; ++i)
+        data[i] = ~data[i];
+    /* inside one block, across a block boundary, and past the short tail */
+    assert(sqlfs_proc_write(sqlfs, testfilename, data + 10, 100, 10, &fi) == 100);
+    assert(sqlfs_proc_write(sqlfs, testfilename, data + BLOCK_SIZE - 50, 100,
+                            BLOCK_SIZE - 50, &fi) == 100);
+    assert(sqlfs_proc_write(sqlfs, testfilename, data + testsize - 100, 400,
+                            testsize - 100, &fi) == 400);
+    assert(sqlfs_proc_read(sqlfs, testfilename, buf, sizeof(buf), 0, &fi) == testsize + 300);
+    for (i=0; i<testsize + 300; ++i)
+    {
+        int changed = (i >= 10 && i < 110) || (i >= BLOCK_SIZE - 50 && i < BLOCK_SIZE + 50)
+                      || i >= testsize - 100;
+        assert(buf[i] == (changed ? data[i] : ~data[i]));
+    }
+    /* a partial read of a single block */
+    assert(sqlfs_proc_read(sqlfs, testfilename, buf, 30, BLOCK_SIZE - 15, &fi) == 30);
+    assert(!memcmp(buf, data + BLOCK_SIZE - 15, 30));
+    printf("passed\n");
+}
+
+struct read_blocks_ctx
+{
+    char *buf;
+    off_t next;
+    int calls, stop_after;
+};
+
+static int read_blocks_callback(void *ctx, const char *data, size_t size, off_t offset)
+{
+    struct read_blocks_ctx *c = ctx;
+    assert(offset == c->next);
+    assert(size > 0 && size <= BLOCK_SIZE);
+    memcpy(c->buf + offset, data, size);
+    c->next += size;
+    return ++c->calls == c->stop_after;
+}
+
+void test_read_blocks(sqlfs_t *sqlfs)
+{
+    printf("Testing reading blocks through a callback...");
+    int i, testsize = BLOCK_SIZE * 6 + 300;
+    char buf[testsize], data[testsize];
+    struct read_blocks_ctx ctx = { buf, 0, 0, 0 };
+    struct fuse_file_info fi = { 0 };
+    char *testfilename = "/read-blocks";
+    for (i=0; i<testsize; ++i)
+        data[i] = rand();
+    /* leave a hole of two blocks and a short block before it */
+    memset(data + BLOCK_SIZE + 100, 0, BLOCK_SIZE * 3);
+    assert(sqlfs_proc_write(sqlfs, testfilename, data, BLOCK_SIZE + 100, 0, &fi) == BLOCK_SIZE + 100);
+    assert(sqlfs_proc_write(sqlfs, testfilename, data + BLOCK_SIZE * 4 + 100, testsize - BLOCK_SIZE * 4 - 100,
+                            BLOCK_SIZE * 4 + 100, &fi) == testsize - BLOCK_SIZE * 4 - 100);
+    memset(buf, 1, testsize);
+    assert(sqlfs_read_blocks(sqlfs, testfilename, 0, testsize + 1000,
+                             read_blocks_callback, &ctx) == testsize);
+    assert(ctx.next == testsize);
+    assert(!memcmp(buf, data, testsize));
+    /* starting inside a block, and stopping early */
+    memset(buf, 1, testsize);
+    ctx.next = 10;
+    ctx.calls = 0;
+    ctx.stop_after = 2;
+    assert(sqlfs_read_blocks(sqlfs, testfilename, 10, testsize, read_blocks_callback, &ctx) == BLOCK_SIZE + 90);
+    assert(!memcmp(buf + 10, data + 10, BLOCK_SIZE + 90));
+    assert(sqlfs_read_blocks(sqlfs, testfilename, testsize, 10, read_blocks_callback, &ctx) == 0);
+    assert(sqlfs_read_blocks(sqlfs, "/read-blocks-missing", 0, 10, read_blocks_callback, &ctx) == -ENOENT);
+    printf("passed\n");
+}
+
+void test_readv_writev(sqlfs_t *sqlfs)
+{
+    printf("Testing vectored reads and writes...");
+    int i, testsize = BLOCK_SIZE * 3 + 700;
+    char buf[testsize], data[testsize];
+    struct iovec iov[4];
+    struct stat sb;
+    struct fuse_file_info fi = { 0 };
+    char *testfilename = "/readv-writev";
+    for (i=0; i<testsize; ++i)
+        data[i] = rand();
+    /* pieces that do not line up with the blocks */
+    iov[0].iov_base = data;
+    iov[0].iov_len = 100;
+    iov[1].iov_base = data + 100;
+    iov[1].iov_len = BLOCK_SIZE * 2;
+    iov[2].iov_base = data + 100 + BLOCK_SIZE * 2;
+    iov[2].iov_len = 0;
+    iov[3].iov_base = data + 100 + BLOCK_SIZE * 2;
+    iov[3].iov_len = testsize - 100 - BLOCK_SIZE * 2;
+    assert(sqlfs_proc_writev(sqlfs, testfilename, iov, 4, 0, &fi) == testsize);
+    assert(sqlfs_proc_getattr(sqlfs, testfilename, &sb) == 0);
+    assert(sb.st_size == testsize);
+    memset(buf, 1, testsize);
+    assert(sqlfs_proc_read(sqlfs, testfilename, buf, testsize, 0, &fi) == testsize);
+    assert(!memcmp(buf, data, testsize));
+    /* a read that starts inside a block and runs past the end of the file */
+    memset(buf, 1, testsize);
+    iov[0].iov_base = buf;
+    iov[0].iov_len = BLOCK_SIZE;
+    iov[1].iov_base = buf + BLOCK_SIZE;
+    iov[1].iov_len = testsize - BLOCK_SIZE;
+    assert(sqlfs_proc_readv(sqlfs, testfilename, iov, 2, 50, &fi) == testsize - 50);
+    assert(!memcmp(buf, data + 50, testsize - 50));
+    assert(sqlfs_proc_readv(sqlfs, testfilename, iov, 2, testsize, &fi) == 0);
+    assert(sqlfs_proc_readv(sqlfs, testfilename, iov, -1, 0, &fi) == -EINVAL);
+    printf("passed\n");
+}
+
+static void write_host_file(const char *dir, const char *name, const char *data, size_t size)
+{
+    char path[PATH_MAX];
+    FILE *f;
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    f = fopen(path, "w");
+    assert(f);
+    assert(fwrite(data, 1, size, f) == size);
+    fclose(f);
+}
+
+void test_import_tree(sqlfs_t *sqlfs)
+{
+    printf("Testing importing a host directory...");
+    int i, testsize = BLOCK_SIZE * 3 + 5;
+    char host[] = "/tmp/sqlfs-import-XXXXXX", path[PATH_MAX];
+    char buf[testsize], big[testsize];
+    struct stat sb;
+    struct fuse_file_info fi = { 0 };
+    sqlfs_import_opts opts = { 2, BLOCK_SIZE, 0, 0, 0 };
+    for (i=0; i<testsize; ++i)
+        big[i] = rand();
+    assert(mkdtemp(host));
+    snprintf(path, sizeof(path), "%s/sub", host);
+    assert(mkdir(path, 0755) == 0);
+    snprintf(path, sizeof(path), "%s/sub/deeper", host);
+    assert(mkdir(path, 0700) == 0);
+    write_host_file(host, "small", data, strlen(data));
+    write_host_file(host, "sub/big", big, testsize);
+    write_host_file(host, "sub/empty", "", 0);
+    write_host_file(host, "sub/deeper/x", "x", 1);
+    snprintf(path, sizeof(path), "%s/link", host);
+    assert(symlink("sub/big", path) == 0);
+
+    assert(sqlfs_import_tree(sqlfs, host, "/imported", &opts) == 0);
+    assert(opts.files == 5 && opts.directories == 3);
+    assert(opts.bytes == strlen(data) + testsize + 1);
+    assert(sqlfs_proc_read(sqlfs, "/imported/small", buf, testsize, 0, &fi) == (int) strlen(data));
+    assert(!memcmp(buf, data, strlen(data)));
+    assert(sqlfs_proc_read(sqlfs, "/imported/sub/big", buf, testsize, 0, &fi) == testsize);
+    assert(!memcmp(buf, big, testsize));
+    assert(sqlfs_proc_getattr(sqlfs, "/imported/sub/empty", &sb) == 0);
+    assert(S_ISREG(sb.st_mode) && sb.st_size == 0);
+    assert(sqlfs_proc_getattr(sqlfs, "/imported/sub/deeper", &sb) == 0);
+    assert(S_ISDIR(sb.st_mode) && (sb.st_mode & 0777) == 0700);
+    assert(sqlfs_proc_readlink(sqlfs, "/imported/link", buf, sizeof(buf)) == 0);
+    assert(!strcmp(buf, "sub/big"));
+
+    /* importing again merges into the directories and replaces the files */
+    write_host_file(host, "sub/big", big, 10);
+    assert(sqlfs_import_tree(sqlfs, host, "/imported/", 0) == 0);
+    assert(sqlfs_proc_getattr(sqlfs, "/imported/sub/big", &sb) == 0);
+    assert(sb.st_size == 10);
+    assert(sqlfs_proc_read(sqlfs, "/imported/sub/big", buf, testsize, 0, &fi) == 10);
+    assert(!memcmp(buf, big, 10));
+    assert(sqlfs_import_tree(sqlfs, host, "/imported/small", 0) == -ENOTDIR);
+    assert(sqlfs_import_tree(sqlfs, "/nonexistent-import-source", "/imported", 0) == -ENOENT);
+
+    snprintf(path, sizeof(path), "%s/sub/deeper/x", host);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s/sub/deeper", host);
+    rmdir(path);
+    snprintf(path, sizeof(path), "%s/sub/big", host);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s/sub/empty", host);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s/sub", host);
+    rmdir(path);
+    snprintf(path, sizeof(path), "%s/small", host);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s/link", host);
+    unlink(path);
+    assert(rmdir(host) == 0);
+    printf("passed\n");
+}
+
+#ifndef HAVE_LIBFUSE
+/* an import only replaces the files the caller may write to */
+void test_import_permissions(const char *database_filename)
+{
+    printf("Testing importing over a read-only file...");
+    char host[] = "/tmp/sqlfs-import-XXXXXX", path[PATH_MAX], buf[10];
+    sqlfs_t *sqlfs = 0;
+    struct fuse_file_info fi = { 0 };
+    unlink(database_filename);
+    assert(sqlfs_open(database_filename, &sqlfs));
+    assert(sqlfs_proc_chmod(sqlfs, "/", 0755) == 0);
+    assert(sqlfs_proc_mkdir(sqlfs, "/perm", 0755) == 0);
+    assert(sqlfs_proc_chown(sqlfs, "/perm", 1000, 1000) == 0);
+    assert(sqlfs_proc_write(sqlfs, "/perm/ro", "keep", 4, 0, &fi) == 4);
+    assert(sqlfs_proc_chown(sqlfs, "/perm/ro", 1000, 1000) == 0);
+    assert(sqlfs_proc_chmod(sqlfs, "/perm/ro", 0444) == 0);
+    assert(mkdtemp(host));
+    write_host_file(host, "ro", "new", 3);
+
+    sqlfs->uid = sqlfs->gid = 1000;
+    assert(sqlfs_proc_write(sqlfs, "/perm/ro", "x", 1, 0, &fi) == -EACCES);
+    assert(sqlfs_import_tree(sqlfs, host, "/perm", 0) == -EACCES);
+    assert(sqlfs_proc_read(sqlfs, "/perm/ro", buf, sizeof(buf), 0, &fi) == 4);
+    assert(!memcmp(buf, "keep", 4));
+    assert(sqlfs_proc_chmod(sqlfs, "/perm/ro", 0644) == 0);
+    assert(sqlfs_import_tree(sqlfs, host, "/perm", 0) == 0);
+    assert(sqlfs_proc_read(sqlfs, "/perm/ro", buf, sizeof(buf), 0, &fi) == 3);
+    assert(!memcmp(buf, "new", 3));
+    sqlfs->uid = sqlfs->gid = 0;
+
+    snprintf(path, sizeof(path), "%s/ro", host);
+    unlink(path);
+    assert(rmdir(host) == 0);
+    assert(sqlfs_close(sqlfs));
+    printf("passed\n");
+}
+
+/* an export leaves out what the caller may not read */
+void test_export_permissions(const char *database_filename)
+{
+    printf("Testing exporting unreadable files...");
+    static const char *names[] = { "exp/", "exp/a", "exp/other/", "exp/other-x", 0 };
+    char tarname[] = "/tmp/sqlfs-export-XXXXXX", *tar;
+    sqlfs_t *sqlfs = 0;
+    struct fuse_file_info fi = { 0 };
+    struct stat sb;
+    size_t pos = 0;
+    int i, fd;
+    unlink(database_filename);
+    assert(sqlfs_open(database_filename, &sqlfs));
+    assert(sqlfs_proc_chmod(sqlfs, "/", 0755) == 0);
+    assert(sqlfs_proc_mkdir(sqlfs, "/exp", 0755) == 0);
+    assert(sqlfs_proc_write(sqlfs, "/exp/a", "a", 1, 0, &fi) == 1);
+    assert(sqlfs_proc_chmod(sqlfs, "/exp/a", 0644) == 0);
+    assert(sqlfs_proc_write(sqlfs, "/exp/secret", "s", 1, 0, &fi) == 1);
+    assert(sqlfs_proc_chmod(sqlfs, "/exp/secret", 0) == 0);
+    assert(sqlfs_proc_chown(sqlfs, "/exp/secret", 1000, 1000) == 0);
+    assert(sqlfs_proc_mkdir(sqlfs, "/exp/other", 0700) == 0);
+    assert(sqlfs_proc_chown(sqlfs, "/exp/other", 2000, 2000) == 0);
+    assert(sqlfs_proc_write(sqlfs, "/exp/other/f", "f", 1, 0, &fi) == 1);
+    assert(sqlfs_proc_chmod(sqlfs, "/exp/other/f", 0644) == 0);
+    /* sorts between the directory and what is in it */
+    assert(sqlfs_proc_write(sqlfs, "/exp/other-x", "x", 1, 0, &fi) == 1);
+    assert(sqlfs_proc_chmod(sqlfs, "/exp/other-x", 0644) == 0);
+
+    sqlfs->uid = sqlfs->gid = 1000;
+    fd = mkstemp(tarname);
+    assert(fd >= 0);
+    assert(sqlfs_export_tar(sqlfs, "/exp", fd) == 0);
+    assert(sqlfs_export_tar(sqlfs, "/exp/secret", fd) == -EACCES);
+    assert(sqlfs_export_tar(sqlfs, "/exp/other", fd) == -EACCES);
+    sqlfs->uid = sqlfs->gid = 0;
+    assert(fstat(fd, &sb) == 0);
+    tar = malloc(sb.st_size);
+    assert(pread(fd, tar, sb.st_size, 0) == sb.st_size);
+    close(fd);
+    unlink(tarname);
+    for (i = 0; names[i]; i++)
+    {
+        assert(pos + 512 <= (size_t) sb.st_size);
+        assert(!strcmp(tar + pos, names[i]));
+        pos += 512 + (strtoul(tar + pos + 124, 0, 8) + 511) / 512 * 512;
+    }
+    assert(pos + 1024 == (size_t) sb.st_size);
+    free(tar);
+    assert(sqlfs_close(sqlfs));
+    printf("passed\n");
+}
+#endif
+
+void test_export_tar(sqlfs_t *sqlfs)
+{
+    printf("Testing exporting a tar archive...");
+    int i, fd, testsize = BLOCK_SIZE * 2 + 10;
+    char dir[PATH_MAX], path[PATH_MAX], name[PATH_MAX], tarname[] = "/tmp/sqlfs-export-XXXXXX";
+    char big[testsize], *tar;
+    static const char *names[] = { "/", "/a", "/b/", "/b/c", "/link", 0 };
+    struct stat sb;
+    struct fuse_file_info fi = { 0 };
+    size_t n, size, pos = 0;
+    unsigned int sum;
+    for (i=0; i<testsize; ++i)
+        big[i] = rand();
+    randomfilename(dir, PATH_MAX, "export");
+    assert(sqlfs_proc_mkdir(sqlfs, dir, 0755) == 0);
+    snprintf(path, sizeof(path), "%s/a", dir);
+    assert(sqlfs_proc_write(sqlfs, path, data, strlen(data), 0, &fi) == (int) strlen(data));
+    snprintf(path, sizeof(path), "%s/b", dir);
+    assert(sqlfs_proc_mkdir(sqlfs, path, 0700) == 0);
+    snprintf(path, sizeof(path), "%s/b/c", dir);
+    assert(sqlfs_proc_write(sqlfs, path, big, testsize, 0, &fi) == testsize);
+    snprintf(path, sizeof(path), "%s/link", dir);
+    assert(sqlfs_proc_symlink(sqlfs, "b/c", path) == 0);
+    /* sorts between the directory and what is in it, but is not part of it */
+    snprintf(path, sizeof(path), "%s-other", dir);
+    assert(sqlfs_proc_write(sqlfs, path, data, strlen(data), 0, &fi) == (int) strlen(data));
+
+    fd = mkstemp(tarname);
+    assert(fd >= 0);
+    assert(sqlfs_export_tar(sqlfs, dir, fd) == 0);
+    assert(sqlfs_export_tar(sqlfs, "/export-missing", fd) == -ENOENT);
+    assert(fstat(fd, &sb) == 0);
+    assert(sb.st_size % 512 == 0);
+    tar = malloc(sb.st_size);
+    assert(pread(fd, tar, sb.st_size, 0) == sb.st_size);
+    close(fd);
+    unlink(tarname);
+    for (i = 0; names[i]; i++)
+    {
+        const char *h = tar + pos;
+        assert(pos + 512 <= (size_t) sb.st_size);
+        snprintf(name, sizeof(name), "%s%s", dir + 1, names[i]);
+        assert(!strcmp(h, name));
+        assert(!memcmp(h + 257, "ustar", 6));
+        for (sum = 0, n = 0; n < 512; n++)
+            sum += ((n >= 148) && (n < 156)) ? ' ' : (unsigned char) h[n];
+        assert(sum == strtoul(h + 148, 0, 8));
+        size = strtoul(h + 124, 0, 8);
+        pos += 512;
+        if (i == 1)
+            assert((size == strlen(data)) && !memcmp(tar + pos, data, size));
+        if (i == 2)
+            assert((h[156] == '5') && (strtoul(h + 100, 0, 8) == 0700));
+        if (i == 3)
+            assert((size == (size_t) testsize) && !memcmp(tar + pos, big, size));
+        if (i == 4)
+            assert((h[156] == '2') && !strcmp(h + 157, "b/c"));
+        pos += (size + 511) / 512 * 512;
+    }
+    /* two empty blocks end the archive */
+    assert(pos + 1024 == (size_t) sb.st_size);
+    for (n = pos; n < (size_t) sb.st_size; n++)
+        assert(!tar[n]);
+    free(tar);
+    printf("passed\n");
+}
+
+static int count_rows(const char *database_filename, const char *sql)
+{
+    sqlite3 *db;
+    sqlite3_stmt *stmt;
+    int count;
+    assert(sqlite3_open(database_filename, &db) == SQLITE_OK);
+    assert(sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) == SQLITE_OK);
+    assert(sqlite3_step(stmt) == SQLITE_ROW);
+    count = sqlite3_column_int(stmt, 0);
+    sqlite3_finalize(stmt);
+    sqlite3_close(db);
+    return count;
+}
+
+void test_block_size_persists(const char *database_filename)
+{
+    printf("Testing the block size is kept in the superblock...");
+    int i, testsize = 4096 * 5 + 100;
+    char buf[testsize], data[testsize];
+    sqlfs_t *sqlfs = 0;
+    struct fuse_file_info fi = { 0 };
+    for (i=0; i<testsize; ++i)
+        data[i] = (i % 90) + 32;
+    unlink(database_filename);
+    assert(!sqlfs_set_block_size(1000));
+    assert(sqlfs_set_block_size(4096));
+    assert(sqlfs_open(database_filename, &sqlfs));
+    assert(sqlfs_proc_write(sqlfs, "/blocks", data, testsize, 0, &fi) == testsize);
+    assert(sqlfs_proc_truncate(sqlfs, "/blocks", testsize - 4096) == 0);
+    assert(sqlfs_close(sqlfs));
+    /* only new databases get the new block size */
+    assert(sqlfs_set_block_size(65536));
+    assert(sqlfs_open(database_filename, &sqlfs));
+    assert(sqlfs_proc_read(sqlfs, "/blocks", buf, testsize, 0, &fi) == testsize - 4096);
+    assert(!memcmp(buf, data, testsize - 4096));
+    assert(sqlfs_close(sqlfs));
+    assert(count_rows(database_filename, "select value from superblock where key = 'block_size'") == 4096);
+    assert(sqlfs_set_block_size(BLOCK_SIZE));
+    printf("passed\n");
+}
+
+void test_dedup_refcounts(const char *database_filename)
+{
+    printf("Testing identical blocks are stored once in dedup mode...");
+    int i, testsize = BLOCK_SIZE * 4;
+    char buf[testsize], data[testsize];
+    sqlfs_t *sqlfs = 0;
+    struct fuse_file_info fi = { 0 };
+    /* blocks 0 and 2 are the same, and so are 1 and 3 */
+    for (i=0; i<testsize; ++i)
+        data[i] = ((i / BLOCK_SIZE) % 2) ? (i % BLOCK_SIZE) % 90 + 32 : (i % BLOCK_SIZE) % 7;
+    unlink(database_filename);
+    assert(sqlfs_set_dedup(1));
+    assert(sqlfs_open(database_filename, &sqlfs));
+    assert(sqlfs_proc_write(sqlfs, "/copy1", data, testsize, 0, &fi) == testsize);
+    assert(sqlfs_proc_write(sqlfs, "/copy2", data, testsize, 0, &fi) == testsize);
+    assert(sqlfs_proc_write(sqlfs, "/copy3", data, testsize, 0, &fi) == testsize);
+    assert(count_rows(database_filename, "select count(*) from block_content") == 2);
+    assert(count_rows(database_filename, "select sum(refcount) from block_content") == 12);
+    assert(sqlfs_proc_unlink(sqlfs, "/copy1") == 0);
+    assert(sqlfs_proc_truncate(sqlfs, "/copy2", BLOCK_SIZE) == 0);
+    assert(sqlfs_proc_write(sqlfs, "/copy3", data, BLOCK_SIZE, BLOCK_SIZE, &fi) == BLOCK_SIZE);
+    assert(count_rows(database_filename, "select sum(refcount) from block_content") == 5);
+    assert(sqlfs_proc_read(sqlfs, "/copy3", buf, testsize, 0, &fi) == testsize);
+    assert(!memcmp(buf, data, BLOCK_SIZE));
+    assert(!memcmp(buf + BLOCK_SIZE, data, BLOCK_SIZE));
+    assert(!memcmp(buf + 2 * BLOCK_SIZE, data + 2 * BLOCK_SIZE, 2 * BLOCK_SIZE));
+    assert(sqlfs_proc_unlink(sqlfs, "/copy2") == 0);
+    assert(sqlfs_proc_unlink(sqlfs, "/copy3") == 0);
+    assert(count_rows(database_filename, "select count(*) from block_content") == 0);
+    assert(sqlfs_close(sqlfs));
+    assert(sqlfs_set_dedup(0));
+    printf("passed\n");
+}
+
+void test_codec_roundtrip(const char *database_filename)
+{
+    printf("Testing compressed blocks read back and stay readable...");
+    int i, testsize = BLOCK_SIZE * 5 + 123;
+    char buf[testsize], data[testsize];
+    sqlfs_t *sqlfs = 0;
+    struct fuse_file_info fi = { 0 };
+    /* compressible text with one block of noise, which stays uncompressed
+     * along with the short tail block */
+    for (i=0; i<testsize; ++i)
+        data[i] = (i / BLOCK_SIZE == 2) ? rand() : "compressible "[i % 13];
+    unlink(database_filename);
+    assert(!sqlfs_set_codec(-1));
+    assert(sqlfs_set_codec(SQLFS_CODEC_LZF));
+    assert(sqlfs_open(database_filename, &sqlfs));
+    assert(sqlfs_proc_write(sqlfs, "/compressed", data, testsize, 0, &fi) == testsize);
+    assert(sqlfs_proc_write(sqlfs, "/compressed", data + 10, 5000, BLOCK_SIZE - 100, &fi) == 5000);
+    memcpy(data + BLOCK_SIZE - 100, data + 10, 5000);
+    assert(sqlfs_proc_truncate(sqlfs, "/compressed", testsize - 100) == 0);
+    assert(sqlfs_proc_read(sqlfs, "/compressed", buf, testsize, 0, &fi) == testsize - 100);
+    assert(!memcmp(buf, data, testsize - 100));
+    assert(sqlfs_close(sqlfs));
+    assert(count_rows(database_filename, "select count(*) from value_data where codec is null") == 2);
+    assert(count_rows(database_filename, "select sum(length(data_block)) from value_data")
+           < testsize / 2);
+    /* blocks keep their codec tag, so they are readable with compression off */
+    assert(sqlfs_set_codec(SQLFS_CODEC_NONE));
+    assert(sqlfs_open(database_filename, &sqlfs));
+    assert(sqlfs_proc_read(sqlfs, "/compressed", buf, testsize, 0, &fi) == testsize - 100);
+    assert(!memcmp(buf, data, testsize - 100));
+    assert(sqlfs_close(sqlfs));
+    printf("passed\n");
+}
+
+void test_sparse_file(const char *database_filename)
+{
+    printf("Testing holes in sparse files are not stored...");
+    int i;
+    off_t gig = 1024 * 1024 * 1024;
+    char buf[3 * BLOCK_SIZE], zeros[3 * BLOCK_SIZE];
+    struct stat sb;
+    sqlfs_t *sqlfs = 0;
+    struct fuse_file_info fi = { 0 };
+    memset(zeros, 0, sizeof(zeros));
+    unlink(database_filename);
+    assert(sqlfs_open(database_filename, &sqlfs));
+    /* a write far past the end of a new file only stores its own block */
+    assert(sqlfs_proc_write(sqlfs, "/sparse", "x", 1, gig, &fi) == 1);
+    assert(sqlfs_proc_getattr(sqlfs, "/sparse", &sb) == 0);
+    assert(sb.st_size == gig + 1);
+    i = sqlfs_proc_read(sqlfs, "/sparse", buf, sizeof(buf), gig - 2 * BLOCK_SIZE, &fi);
+    assert(i == 2 * BLOCK_SIZE + 1);
+    assert(!memcmp(buf, zeros, 2 * BLOCK_SIZE));
+    assert(buf[2 * BLOCK_SIZE] == 'x');
+    /* truncating up does not write anything, and the old tail reads back */
+    assert(sqlfs_proc_write(sqlfs, "/grown", "0123456789", 10, 0, &fi) == 10);
+    assert(sqlfs_proc_truncate(sqlfs, "/grown", gig) == 0);
+    assert(sqlfs_proc_getattr(sqlfs, "/grown", &sb) == 0);
+    assert(sb.st_size == gig);
+    assert(sqlfs_proc_read(sqlfs, "/grown", buf, sizeof(buf), 0, &fi) == sizeof(buf));
+    assert(!memcmp(buf, "0123456789", 10));
+    assert(!memcmp(buf + 10, zeros, sizeof(buf) - 10));
+    /* writing into the middle of a hole, then cutting into another one */
+    assert(sqlfs_proc_write(sqlfs, "/grown", "y", 1, gig / 2, &fi) == 1);
+    assert(sqlfs_proc_truncate(sqlfs, "/grown", gig / 4 + 5) == 0);
+    assert(sqlfs_proc_read(sqlfs, "/grown", buf, sizeof(buf), gig / 4 - 10, &fi) == 15);
+    assert(!memcmp(buf, zeros, 15));
+    assert(sqlfs_close(sqlfs));
+    assert(count_rows(database_filename, "select count(*) from value_data") == 2);
+    printf("passed\n");
+}
+
+void test_block_cache(const char *database_filename)
+{
+    printf("Testing the block cache stays current...");
+    int i;
+    char data[3 * BLOCK_SIZE], buf[3 * BLOCK_SIZE];
+    size_t hits, misses, hits2, misses2;
+    key_value value = { 0, 0 };
+    sqlfs_t *sqlfs = 0;
+    struct fuse_file_info fi = { 0 };
+    for (i = 0; i < (int) sizeof(data); i++)
+        data[i] = rand();
+    unlink(database_filename);
+    assert(sqlfs_set_block_cache_size(1024 * 1024));
+    assert(sqlfs_open(database_filename, &sqlfs));
+    assert(sqlfs_proc_write(sqlfs, "/cached", data, sizeof(data), 0, &fi) == sizeof(data));
+    assert(sqlfs_proc_read(sqlfs, "/cached", buf, sizeof(buf), 0, &fi) == sizeof(buf));
+    sqlfs_get_block_cache_stats(&hits, &misses, 0);
+    /* the second read is served from the cache, it goes around the
+     * read-ahead buffer of sqlfs_proc_read() */
+    value.data = buf;
+    value.size = sizeof(buf);
+    assert(sqlfs_get_value(sqlfs, "/cached", &value, 0, sizeof(buf)) == 1);
+    assert(!memcmp(buf, data, sizeof(data)));
+    sqlfs_get_block_cache_stats(&hits2, &misses2, 0);
+    assert(hits2 == hits + 3);
+    assert(misses2 == misses);
+    /* writes and truncates replace what was cached */
+    memset(data + BLOCK_SIZE + 10, 'w', 20);
+    assert(sqlfs_proc_write(sqlfs, "/cached", data + BLOCK_SIZE + 10, 20, BLOCK_SIZE + 10, &fi) == 20);
+    assert(sqlfs_proc_read(sqlfs, "/cached", buf, sizeof(buf), 0, &fi) == sizeof(buf));
+    assert(!memcmp(buf, data, sizeof(data)));
+    assert(sqlfs_proc_truncate(sqlfs, "/cached", BLOCK_SIZE + 100) == 0);
+    assert(sqlfs_proc_truncate(sqlfs, "/cached", sizeof(data)) == 0);
+    memset(data + BLOCK_SIZE + 100, 0, sizeof(data) - BLOCK_SIZE - 100);
+    assert(sqlfs_proc_read(sqlfs, "/cached", buf, sizeof(buf), 0, &fi) == sizeof(buf));
+    assert(!memcmp(buf, data, sizeof(data)));
+    /* a rolled back write must not stay in the cache */
+    assert(sqlfs_begin_transaction(sqlfs) == 1);
+    assert(sqlfs_proc_write(sqlfs, "/cached", "rollback", 8, 0, &fi) == 8);
+    assert(sqlfs_proc_read(sqlfs, "/cached", buf, 8, 0, &fi) == 8);
+    assert(sqlfs_complete_transaction(sqlfs, 0) == 1);
+    assert(sqlfs_proc_read(sqlfs, "/cached", buf, sizeof(buf), 0, &fi) == sizeof(buf));
+    assert(!memcmp(buf, data, sizeof(data)));
+    /* the next file created reuses the inode of a deleted one */
+    assert(sqlfs_proc_unlink(sqlfs, "/cached") == 0);
+    for (i = 0; i < (int) sizeof(data); i++)
+        data[i] = rand();
+    assert(sqlfs_proc_write(sqlfs, "/recreated", data, sizeof(data), 0, &fi) == sizeof(data));
+    assert(sqlfs_proc_read(sqlfs, "/recreated", buf, sizeof(buf), 0, &fi) == sizeof(buf));
+    assert(!memcmp(buf, data, sizeof(data)));
+    assert(sqlfs_close(sqlfs));
+    assert(sqlfs_set_block_cache_size(0));
+    sqlfs_get_block_cache_stats(0, 0, &hits);
+    assert(hits == 0);
+    printf("passed\n");
+}
+
+void test_read_ahead(const char *database_filename)
+{
+    printf("Testing sequential reads see every write...");
+    int i;
+    char data[8 * BLOCK_SIZE], buf[1024];
+    sqlfs_t *sqlfs = 0, *other = 0;
+    struct fuse_file_info fi = { 0 };
+    for (i = 0; i < (int) sizeof(data); i++)
+        data[i] = rand();
+    unlink(database_filename);
+    assert(sqlfs_open(database_filename, &sqlfs));
+    assert(sqlfs_open(database_filename, &other));
+    assert(sqlfs_proc_write(sqlfs, "/stream", data, sizeof(data), 0, &fi) == sizeof(data));
+    for (i = 0; i < (int) sizeof(data); i += sizeof(buf))
+    {
+        /* change data ahead of the reader, through its own connection
+         * and through another one */
+        if (i == 2 * BLOCK_SIZE)
+        {
+            memset(data + i + 100, 'a', 10);
+            assert(sqlfs_proc_write(sqlfs, "/stream", data + i + 100, 10, i + 100, &fi) == 10);
+        }
+        if (i == 4 * BLOCK_SIZE)
+        {
+            memset(data + i + 200, 'b', 10);
+            assert(sqlfs_proc_write(other, "/stream", data + i + 200, 10, i + 200, &fi) == 10);
+        }
+        if (i == 6 * BLOCK_SIZE)
+        {
+            assert(sqlfs_begin_transaction(sqlfs) == 1);
+            assert(sqlfs_proc_write(sqlfs, "/stream", "rollback", 8, i, &fi) == 8);
+            assert(sqlfs_proc_read(sqlfs, "/stream", buf, sizeof(buf), i, &fi) == sizeof(buf));
+            assert(sqlfs_complete_transaction(sqlfs, 0) == 1);
+        }
+        assert(sqlfs_proc_read(sqlfs, "/stream", buf, sizeof(buf), i, &fi) == sizeof(buf));
+        assert(!memcmp(buf, data + i, sizeof(buf)));
+    }
+    /* the end moves when the file is truncated through another connection */
+    assert(sqlfs_proc_read(sqlfs, "/stream", buf, sizeof(buf), 0, &fi) == sizeof(buf));
+    assert(sqlfs_proc_truncate(other, "/stream", 100) == 0);
+    assert(sqlfs_proc_read(sqlfs, "/stream", buf, sizeof(buf), sizeof(buf), &fi) == 0);
+    assert(sqlfs_proc_read(sqlfs, "/stream", buf, sizeof(buf), 0, &fi) == 100);
+    sqlfs_close(other); /* only the last close reports success */
+    assert(sqlfs_close(sqlfs));
+    printf("passed\n");
+}
+
+void test_meta_cache(const char *database_filename)
+{
+    printf("Testing cached attributes follow other connections...");
+    struct stat sb;
+    sqlfs_t *sqlfs = 0, *other = 0;
+    struct fuse_file_info fi = { 0 };
+    unlink(database_filename);
+    assert(sqlfs_open(database_filename, &sqlfs));
+    assert(sqlfs_open(database_filename, &other));
+    /* a key looked up before it exists */
+    assert(sqlfs_proc_getattr(sqlfs, "/meta", &sb) == -ENOENT);
+    assert(sqlfs_proc_write(other, "/meta", "0123456789", 10, 0, &fi) == 10);
+    assert(sqlfs_proc_getattr(sqlfs, "/meta", &sb) == 0);
+    assert(sb.st_size == 10);
+    assert(sqlfs_proc_chmod(other, "/meta", 0600) == 0);
+    assert(sqlfs_proc_getattr(sqlfs, "/meta", &sb) == 0);
+    assert((sb.st_mode & 0777) == 0600);
+    assert(sqlfs_proc_truncate(other, "/meta", 3) == 0);
+    assert(sqlfs_proc_getattr(sqlfs, "/meta", &sb) == 0);
+    assert(sb.st_size == 3);
+    /* changes rolled back on the own connection */
+    assert(sqlfs_begin_transaction(sqlfs) == 1);
+    assert(sqlfs_proc_chmod(sqlfs, "/meta", 0644) == 0);
+    assert(sqlfs_proc_getattr(sqlfs, "/meta", &sb) == 0);
+    assert((sb.st_mode & 0777) == 0644);
+    assert(sqlfs_complete_transaction(sqlfs, 0) == 1);
+    assert(sqlfs_proc_getattr(sqlfs, "/meta", &sb) == 0);
+    assert((sb.st_mode & 0777) == 0600);
+    assert(sqlfs_proc_rename(other, "/meta", "/meta2") == 0);
+    assert(sqlfs_proc_getattr(sqlfs, "/meta", &sb) == -ENOENT);
+    assert(sqlfs_proc_getattr(sqlfs, "/meta2", &sb) == 0);
+    assert(sqlfs_proc_unlink(other, "/meta2") == 0);
+    assert(sqlfs_proc_getattr(sqlfs, "/meta2", &sb) == -ENOENT);
+    sqlfs_close(other); /* only the last close reports success */
+    assert(sqlfs_close(sqlfs));
+    printf("passed\n");
+}
+
+/* sets the times of /atime behind the back of sqlfs, since set_attr()
+ * stamps every change with the current time, then reads it */
+static time_t read_and_get_atime(sqlfs_t *sqlfs, const char *database_filename,
+                                 time_t atime, time_t mtime)
+{
+    char buf[10];
+    struct stat sb;
+    sqlite3 *db;
+    sqlite3_stmt *stmt;
+    struct fuse_file_info fi = { 0 };
+    assert(sqlite3_open(database_filename, &db) == SQLITE_OK);
+    assert(sqlite3_prepare_v2(db, "update meta_data set atime = ?, mtime = ? where key = '/atime'",
+                              -1, &stmt, NULL) == SQLITE_OK);
+    sqlite3_bind_int64(stmt, 1, atime);
+    sqlite3_bind_int64(stmt, 2, mtime);
+    assert(sqlite3_step(stmt) == SQLITE_DONE);
+    sqlite3_finalize(stmt);
+    sqlite3_close(db);
+    assert(sqlfs_proc_read(sqlfs, "/atime", buf, sizeof(buf), 0, &fi) == sizeof(buf));
+    assert(sqlfs_proc_getattr(sqlfs, "/atime", &sb) == 0);
+    return sb.st_atime;
+}
+
+void test_atime_modes(const char *database_filename)
+{
+    printf("Testing the atime modes...");
+    time_t now = time(0), day = 24 * 3600;
+    sqlfs_t *sqlfs = 0;
+    struct fuse_file_info fi = { 0 };
+    unlink(database_filename);
+    assert(sqlfs_open(database_filename, &sqlfs));
+    assert(sqlfs_proc_write(sqlfs, "/atime", "0123456789", 10, 0, &fi) == 10);
+    assert(read_and_get_atime(sqlfs, database_filename, now - day, now - 2 * day) >= now);
+    assert(sqlfs_close(sqlfs));
+
+    assert(sqlfs_set_atime_mode(SQLFS_ATIME_RELATIME));
+    assert(sqlfs_open(database_filename, &sqlfs));
+    /* older than the last modification */
+    assert(read_and_get_atime(sqlfs, database_filename, now - 2 * day, now - day) >= now);
+    /* newer, and recent enough */
+    assert(read_and_get_atime(sqlfs, database_filename, now - 3600, now - 7200) == now - 3600);
+    /* newer, but a day old */
+    assert(read_and_get_atime(sqlfs, database_filename, now - day - 1, now - 2 * day) >= now);
+    assert(sqlfs_close(sqlfs));
+
+    assert(sqlfs_set_atime_mode(SQLFS_ATIME_NOATIME));
+    assert(sqlfs_open(database_filename, &sqlfs));
+    assert(read_and_get_atime(sqlfs, database_filename, now - 2 * day, now - day) == now - 2 * day);
+    assert(sqlfs_close(sqlfs));
+    assert(!sqlfs_set_atime_mode(3));
+    assert(sqlfs_set_atime_mode(SQLFS_ATIME_STRICT));
+    printf("passed\n");
+}
+
+/* the size stored in the database, whatever is held back */
+static int stored_size(const char *database_filename, const char *key)
+{
+    char sql[PATH_MAX];
+    snprintf(sql, sizeof(sql), "select size from meta_data where key = '%s';", key);
+    return count_rows(database_filename, sql);
+}
+
+/* a change made by another process, which does not store what is held back */
+static void exec_sql(const char *database_filename, const char *sql)
+{
+    sqlite3 *db;
+    assert(sqlite3_open(database_filename, &db) == SQLITE_OK);
+    assert(sqlite3_exec(db, sql, 0, 0, 0) == SQLITE_OK);
+    sqlite3_close(db);
+}
+
+void test_write_back(const char *database_filename)
+{
+    printf("Testing held back writes...");
+    int i;
+    char record[100], buf[3000], expected[3000];
+    char log[5 * BLOCK_SIZE], log_read[5 * BLOCK_SIZE];
+    struct stat sb;
+    sqlfs_t *sqlfs = 0, *other = 0;
+    struct fuse_file_info fi = { 0 }, ofi = { 0 }, rfi = { 0 };
+    unlink(database_filename);
+    assert(sqlfs_set_write_back(1000, 0));
+    assert(sqlfs_open(database_filename, &sqlfs));
+    assert(sqlfs_open(database_filename, &other));
+    fi.flags = O_WRONLY | O_CREAT;
+    assert(sqlfs_proc_create(sqlfs, "/write-back", 0100644, &fi) == 0);
+    assert(fi.fh);
+    for (i = 0; i < 9; i++)
+    {
+        memset(record, 'a' + i, sizeof(record));
+        memcpy(expected + i * sizeof(record), record, sizeof(record));
+        assert(sqlfs_proc_write(sqlfs, "/write-back", record, sizeof(record),
+                                i * sizeof(record), &fi) == sizeof(record));
+    }
+    /* nothing is stored yet, reads through the open file see the writes held */
+    assert(stored_size(database_filename, "/write-back") == 0);
+    assert(sqlfs_proc_read(sqlfs, "/write-back", buf, sizeof(buf), 150, &fi) == 750);
+    assert(!memcmp(buf, expected + 150, 750));
+    assert(stored_size(database_filename, "/write-back") == 0);
+    /* any other call of any connection stores them first */
+    assert(sqlfs_proc_getattr(other, "/write-back", &sb) == 0);
+    assert(sb.st_size == 900);
+    assert(stored_size(database_filename, "/write-back") == 900);
+    assert(sqlfs_proc_read(other, "/write-back", buf, sizeof(buf), 0, &rfi) == 900);
+    assert(!memcmp(buf, expected, 900));
+    /* release stores them */
+    assert(sqlfs_proc_write(sqlfs, "/write-back", "x", 1, 0, &fi) == 1);
+    expected[0] = 'x';
+    assert(sqlfs_proc_release(sqlfs, "/write-back", &fi) == 0);
+    assert(!fi.fh);
+    assert(sqlfs_proc_read(other, "/write-back", buf, 1, 0, &rfi) == 1);
+    assert(buf[0] == 'x');
+    /* appends that fill the buffer, the last block of the file included,
+     * and a write over stored data */
+    fi.flags = O_WRONLY | O_APPEND;
+    assert(sqlfs_proc_open(sqlfs, "/write-back", &fi) == 0);
+    for (i = 9; i < 30; i++)
+    {
+        memset(record, 'a' + i, sizeof(record));
+        memcpy(expected + i * sizeof(record), record, sizeof(record));
+        assert(sqlfs_proc_write(sqlfs, "/write-back", record, sizeof(record), 0, &fi) == sizeof(record));
+    }
+    fi.flags = O_WRONLY;
+    assert(sqlfs_proc_write(sqlfs, "/write-back", "y", 1, 2950, &fi) == 1);
+    expected[2950] = 'y';
+    assert(stored_size(database_filename, "/write-back") == 3000);
+    assert(sqlfs_proc_read(sqlfs, "/write-back", buf, 100, 2900, &fi) == 100);
+    assert(!memcmp(buf, expected + 2900, 100));
+    assert(sqlfs_proc_release(sqlfs, "/write-back", &fi) == 0);
+    assert(sqlfs_proc_read(other, "/write-back", buf, sizeof(buf), 0, &rfi) == 3000);
+    assert(!memcmp(buf, expected, 3000));
+    /* fsync stores them, and the open file can be used on any connection */
+    fi.flags = O_RDWR;
+    assert(sqlfs_proc_open(sqlfs, "/write-back", &fi) == 0);
+    assert(sqlfs_proc_write(other, "/write-back", "z", 1, 3000, &fi) == 1);
+    assert(sqlfs_proc_read(sqlfs, "/write-back", buf, 2, 3000, &fi) == 1);
+    assert(buf[0] == 'z');
+    assert(stored_size(database_filename, "/write-back") == 3000);
+    assert(sqlfs_proc_fsync(sqlfs, "/write-back", 0, &fi) == 0);
+    assert(stored_size(database_filename, "/write-back") == 3001);
+    assert(sqlfs_proc_release(other, "/write-back", &fi) == 0);
+
+    /* what another connection wrote meanwhile is read, not a stale end */
+    fi.flags = O_RDWR | O_CREAT;
+    assert(sqlfs_proc_create(sqlfs, "/stale", 0100644, &fi) == 0);
+    assert(sqlfs_proc_write(sqlfs, "/stale", "aaaa", 4, 0, &fi) == 4);
+    assert(sqlfs_proc_write(other, "/stale", "bbbb", 4, 4, &rfi) == 4);
+    assert(sqlfs_proc_write(sqlfs, "/stale", "cccc", 4, 8, &fi) == 4);
+    assert(sqlfs_proc_read(sqlfs, "/stale", buf, sizeof(buf), 4, &fi) == 8);
+    assert(!memcmp(buf, "bbbbcccc", 8));
+    assert(sqlfs_proc_release(sqlfs, "/stale", &fi) == 0);
+    /* of two files open on it, the last write wins */
+    fi.flags = ofi.flags = O_RDWR;
+    assert(sqlfs_proc_open(sqlfs, "/stale", &fi) == 0);
+    assert(sqlfs_proc_open(other, "/stale", &ofi) == 0);
+    assert(sqlfs_proc_write(other, "/stale", "xxxx", 4, 0, &ofi) == 4);
+    assert(sqlfs_proc_write(sqlfs, "/stale", "yyyy", 4, 0, &fi) == 4);
+    assert(sqlfs_proc_read(other, "/stale", buf, 4, 0, &ofi) == 4);
+    assert(!memcmp(buf, "yyyy", 4));
+    assert(sqlfs_proc_release(other, "/stale", &ofi) == 0);
+    assert(sqlfs_proc_release(sqlfs, "/stale", &fi) == 0);
+    assert(sqlfs_proc_read(other, "/stale", buf, 4, 0, &rfi) == 4);
+    assert(!memcmp(buf, "yyyy", 4));
+    /* appends held on two connections both go to the end of the file */
+    fi.flags = ofi.flags = O_WRONLY | O_APPEND;
+    assert(sqlfs_proc_create(sqlfs, "/append", 0100644, &fi) == 0);
+    assert(sqlfs_proc_open(other, "/append", &ofi) == 0);
+    assert(sqlfs_proc_write(sqlfs, "/append", "1111", 4, 0, &fi) == 4);
+    assert(sqlfs_proc_write(sqlfs, "/append", "2222", 4, 0, &fi) == 4);
+    assert(sqlfs_proc_write(other, "/append", "BBBB", 4, 0, &ofi) == 4);
+    assert(sqlfs_proc_write(sqlfs, "/append", "3333", 4, 0, &fi) == 4);
+    assert(sqlfs_proc_release(other, "/append", &ofi) == 0);
+    /* and so do those another process made meanwhile */
+    exec_sql(database_filename, "update meta_data set size = size + 4, "
+             "inline_data = cast(inline_data || 'CCCC' as blob) where key = '/append';");
+    assert(sqlfs_proc_write(sqlfs, "/append", "4444", 4, 0, &fi) == 4);
+    assert(sqlfs_proc_read(sqlfs, "/append", buf, sizeof(buf), 0, &fi) == 24);
+    assert(!memcmp(buf, "11112222BBBB3333CCCC4444", 24));
+    exec_sql(database_filename, "update meta_data set size = size + 4, "
+             "inline_data = cast(inline_data || 'DDDD' as blob) where key = '/append';");
+    assert(sqlfs_proc_write(sqlfs, "/append", "5555", 4, 0, &fi) == 4);
+    exec_sql(database_filename, "update meta_data set size = size + 4, "
+             "inline_data = cast(inline_data || 'EEEE' as blob) where key = '/append';");
+    assert(sqlfs_proc_release(sqlfs, "/append", &fi) == 0);
+    assert(sqlfs_proc_read(other, "/append", buf, sizeof(buf), 0, &rfi) == 36);
+    assert(!memcmp(buf, "11112222BBBB3333CCCCDDDDEEEE44445555", 36));
+    /* a file unlinked meanwhile is not created again */
+    fi.flags = O_WRONLY | O_CREAT;
+    assert(sqlfs_proc_create(sqlfs, "/unlinked", 0100644, &fi) == 0);
+    assert(sqlfs_proc_write(sqlfs, "/unlinked", "gone", 4, 0, &fi) == 4);
+    assert(sqlfs_proc_unlink(other, "/unlinked") == 0);
+    assert(sqlfs_proc_write(sqlfs, "/unlinked", "gone", 4, 4, &fi) == 4);
+    assert(sqlfs_proc_release(sqlfs, "/unlinked", &fi) == -ENOENT);
+    assert(sqlfs_proc_getattr(other, "/unlinked", &sb) == -ENOENT);
+    assert(!sqlfs_close(other));
+    assert(sqlfs_close(sqlfs));
+
+    /* writes held long enough are stored by the next one */
+    assert(sqlfs_set_write_back(1000, 1));
+    assert(sqlfs_open(database_filename, &sqlfs));
+    fi.flags = O_WRONLY;
+    assert(sqlfs_proc_open(sqlfs, "/write-back", &fi) == 0);
+    assert(sqlfs_proc_write(sqlfs, "/write-back", "1", 1, 3001, &fi) == 1);
+    assert(sqlfs_proc_write(sqlfs, "/write-back", "2", 1, 3002, &fi) == 1);
+    assert(stored_size(database_filename, "/write-back") == 3001);
+    usleep(5000);
+    assert(sqlfs_proc_write(sqlfs, "/write-back", "3", 1, 3003, &fi) == 1);
+    assert(stored_size(database_filename, "/write-back") == 3004);
+    assert(sqlfs_proc_release(sqlfs, "/write-back", &fi) == 0);
+    assert(sqlfs_close(sqlfs));
+
+    /* appends are stored a whole block at a time, the last one on release */
+    assert(sqlfs_set_write_back(2 * BLOCK_SIZE, 0));
+    assert(sqlfs_open(database_filename, &sqlfs));
+    assert(sqlfs_open(database_filename, &other));
+    fi.flags = O_WRONLY | O_APPEND | O_CREAT;
+    assert(sqlfs_proc_create(sqlfs, "/blocks", 0100644, &fi) == 0);
+    for (i = 0; i < 4 * BLOCK_SIZE / (int) sizeof(record); i++)
+    {
+        memset(record, i, sizeof(record));
+        memcpy(log + i * sizeof(record), record, sizeof(record));
+        assert(sqlfs_proc_write(sqlfs, "/blocks", record, sizeof(record), 0, &fi) == sizeof(record));
+    }
+    assert(stored_size(database_filename, "/blocks") >= BLOCK_SIZE);
+    assert(stored_size(database_filename, "/blocks") % BLOCK_SIZE == 0);
+    assert(sqlfs_proc_release(sqlfs, "/blocks", &fi) == 0);
+    assert(stored_size(database_filename, "/blocks") == i * sizeof(record));
+    /* the last block is loaded again once another connection changed it */
+    fi.flags = O_WRONLY | O_APPEND;
+    assert(sqlfs_proc_open(sqlfs, "/blocks", &fi) == 0);
+    memcpy(log + i++ * sizeof(record), record, sizeof(record));
+    assert(sqlfs_proc_write(sqlfs, "/blocks", record, sizeof(record), 0, &fi) == sizeof(record));
+    assert(sqlfs_proc_write(other, "/blocks", "X", 1, 4 * BLOCK_SIZE + 10, &rfi) == 1);
+    log[4 * BLOCK_SIZE + 10] = 'X';
+    memcpy(log + i++ * sizeof(record), record, sizeof(record));
+    assert(sqlfs_proc_write(sqlfs, "/blocks", record, sizeof(record), 0, &fi) == sizeof(record));
+    assert(sqlfs_proc_release(sqlfs, "/blocks", &fi) == 0);
+    assert(sqlfs_proc_read(other, "/blocks", log_read, sizeof(log_read), 0, &rfi) == i * sizeof(record));
+    assert(!memcmp(log_read, log, i * sizeof(record)));
+    assert(!sqlfs_close(other));
+    assert(sqlfs_close(sqlfs));
+    assert(sqlfs_set_write_back(0, 0));
+    printf("passed\n");
+}
+
+static pthread_mutex_t write_back_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t write_back_cond = PTHREAD_COND_INITIALIZER;
+static int write_back_step;
+static struct fuse_file_info write_back_fi;
+
+/* waits for write_back_step to reach step, or sets it when wait is 0 */
+static void write_back_at(int step, int wait)
+{
+    pthread_mutex_lock(&write_back_lock);
+    if (wait)
+        while (write_back_step < step)
+            pthread_cond_wait(&write_back_cond, &write_back_lock);
+    else
+        write_back_step = step;
+    pthread_cond_broadcast(&write_back_cond);
+    pthread_mutex_unlock(&write_back_lock);
+}
+
+/* writes and keeps its connection open until the other threads checked */
+static void *write_back_writer(void *arg)
+{
+    int i;
+    char record[100];
+    for (i = 0; i < 9; i++)
+    {
+        memset(record, 'a' + i, sizeof(record));
+        assert(sqlfs_proc_write(0, (const char *) arg, record, sizeof(record),
+                                i * sizeof(record), &write_back_fi) == sizeof(record));
+    }
+    write_back_at(1, 0);
+    write_back_at(2, 1);
+    return 0;
+}
+
+static void *write_back_syncer(void *arg)
+{
+    assert(sqlfs_proc_fsync(0, (const char *) arg, 0, &write_back_fi) == 0);
+    return 0;
+}
+
+/* appends records that leave the last block partly filled */
+static void *write_back_appender(void *arg)
+{
+    int i;
+    char record[100];
+    for (i = 0; i < 3 * BLOCK_SIZE / (int) sizeof(record); i++)
+    {
+        memset(record, i, sizeof(record));
+        assert(sqlfs_proc_write(0, (const char *) arg, record, sizeof(record), 0, &write_back_fi)
+               == sizeof(record));
+    }
+    write_back_at(3, 0);
+    write_back_at(4, 1);
+    return 0;
+}
+
+static void *write_back_releaser(void *arg)
+{
+    assert(sqlfs_proc_release(0, (const char *) arg, &write_back_fi) == 0);
+    return 0;
+}
+
+/* FUSE may fsync or release a file on another thread than the one that
+ * wrote it */
+void test_write_back_threads(const char *database_filename)
+{
+    printf("Testing write-back with the thread API...");
+    int i, n;
+    char buf[1000], expected[900], *log, *log_read;
+    pthread_t writer, syncer;
+    struct fuse_file_info fi = { 0 };
+    unlink(database_filename);
+    assert(sqlfs_set_write_back(2 * BLOCK_SIZE, 0));
+    assert(sqlfs_init(database_filename) == 0);
+    for (i = 0; i < 9; i++)
+        memset(expected + i * 100, 'a' + i, 100);
+    write_back_fi.flags = O_WRONLY | O_CREAT;
+    assert(sqlfs_proc_create(0, "/fsync", 0100644, &write_back_fi) == 0);
+    write_back_at(0, 0);
+    assert(pthread_create(&writer, NULL, write_back_writer, "/fsync") == 0);
+    write_back_at(1, 1);
+    assert(stored_size(database_filename, "/fsync") == 0);
+    assert(pthread_create(&syncer, NULL, write_back_syncer, "/fsync") == 0);
+    pthread_join(syncer, NULL);
+    assert(stored_size(database_filename, "/fsync") == sizeof(expected));
+    assert(sqlfs_proc_read(0, "/fsync", buf, sizeof(buf), 0, &fi) == sizeof(expected));
+    assert(!memcmp(buf, expected, sizeof(expected)));
+    assert(pthread_create(&syncer, NULL, write_back_releaser, "/fsync") == 0);
+    pthread_join(syncer, NULL);
+    assert(!write_back_fi.fh);
+    write_back_at(2, 0);
+    pthread_join(writer, NULL);
+    /* the last block of appends too */
+    n = 3 * BLOCK_SIZE / 100;
+    log = malloc(n * 100);
+    log_read = malloc(n * 100 + 100);
+    for (i = 0; i < n; i++)
+        memset(log + i * 100, i, 100);
+    write_back_fi.flags = O_WRONLY | O_APPEND | O_CREAT;
+    assert(sqlfs_proc_create(0, "/append", 0100644, &write_back_fi) == 0);
+    assert(pthread_create(&writer, NULL, write_back_appender, "/append") == 0);
+    write_back_at(3, 1);
+    assert(stored_size(database_filename, "/append") % BLOCK_SIZE == 0);
+    assert(pthread_create(&syncer, NULL, write_back_releaser, "/append") == 0);
+    pthread_join(syncer, NULL);
+    assert(stored_size(database_filename, "/append") == n * 100);
+    assert(sqlfs_proc_read(0, "/append", log_read, n * 100 + 100, 0, &fi) == n * 100);
+    assert(!memcmp(log_read, log, n * 100));
+    write_back_at(4, 0);
+    pthread_join(writer, NULL);
+    free(log);
+    free(log_read);
+    sqlfs_detach_thread();
+    assert(sqlfs_destroy() == 0);
+    assert(sqlfs_set_write_back(0, 0));
+    printf("passed\n");
+}
+
+#define GROUP_THREADS 8
+#define GROUP_RECORDS 50
+
+static void *group_commit_thread(void *arg)
+{
+    int i, n = (int) (size_t) arg;
+    char dir[PATH_MAX], path[PATH_MAX], record[100];
+    struct fuse_file_info fi = { 0 };
+    snprintf(dir, sizeof(dir), "/group/%d", n);
+    snprintf(path, sizeof(path), "%s/log", dir);
+    assert(sqlfs_proc_mkdir(0, dir, 0777) == 0);
+    for (i = 0; i < GROUP_RECORDS; i++)
+    {
+        memset(record, 'a' + (n + i) % 26, sizeof(record));
+        assert(sqlfs_proc_write(0, path, record, sizeof(record), i * sizeof(record), &fi)
+               == sizeof(record));
+    }
+    assert(sqlfs_proc_truncate(0, path, (GROUP_RECORDS - 1) * sizeof(record)) == 0);
+    return 0;
+}
+
+void test_group_commit(const char *database_filename)
+{
+    printf("Testing group commit...");
+    int i, n;
+    char path[PATH_MAX], buf[GROUP_RECORDS * 100], expected[GROUP_RECORDS * 100];
+    pthread_t threads[GROUP_THREADS];
+    struct stat sb;
+    struct fuse_file_info fi = { 0 };
+    unlink(database_filename);
+    assert(sqlfs_set_group_commit(16, 2));
+    assert(sqlfs_init(database_filename) == 0);
+    assert(sqlfs_proc_mkdir(0, "/group", 0777) == 0);
+    for (n = 0; n < GROUP_THREADS; n++)
+        assert(pthread_create(&threads[n], NULL, group_commit_thread, (void *) (size_t) n) == 0);
+    for (n = 0; n < GROUP_THREADS; n++)
+        pthread_join(threads[n], NULL);
+    /* this thread reads through a connection of its own, so each write it
+     * sees was committed by the writer */
+    for (n = 0; n < GROUP_THREADS; n++)
+    {
+        for (i = 0; i < GROUP_RECORDS - 1; i++)
+            memset(expected + i * 100, 'a' + (n + i) % 26, 100);
+        snprintf(path, sizeof(path), "/group/%d/log", n);
+        assert(sqlfs_proc_read(0, path, buf, sizeof(buf), 0, &fi) == (GROUP_RECORDS - 1) * 100);
+        assert(!memcmp(buf, expected, (GROUP_RECORDS - 1) * 100));
+    }
+    /* errors come back to the caller, and leave the rest of the batch be */
+    assert(sqlfs_proc_mkdir(0, "/group/0", 0777) == -EEXIST);
+    assert(sqlfs_proc_write(0, "/group", "x", 1, 0, &fi) == -EISDIR);
+    assert(sqlfs_proc_rename(0, "/group/0/log", "/group/0/renamed") == 0);
+    assert(sqlfs_proc_getattr(0, "/group/0/renamed", &sb) == 0);
+    assert(sb.st_size == (GROUP_RECORDS - 1) * 100);
+    /* inside a transaction of its own the thread writes itself */
+    assert(sqlfs_begin_transaction(0) == 1);
+    assert(sqlfs_proc_write(0, "/group/0/renamed", "x", 1, 0, &fi) == 1);
+    assert(sqlfs_complete_transaction(0, 1) == 1);
+    assert(sqlfs_proc_read(0, "/group/0/renamed", buf, 1, 0, &fi) == 1);
+    assert(buf[0] == 'x');
+    assert(sqlfs_proc_unlink(0, "/group/0/renamed") == 0);
+    assert(sqlfs_proc_rmdir(0, "/group/0") == 0);
+    assert(sqlfs_proc_getattr(0, "/group/0", &sb) == -ENOENT);
+    sqlfs_detach_thread();
+    assert(sqlfs_destroy() == 0);
+
+    /* a file created through the writer still holds its writes back, and
+     * the writes that do not fit are made by the thread itself */
+    assert(sqlfs_set_write_back(1000, 0));
+    assert(sqlfs_init(database_filename) == 0);
+    fi.flags = O_WRONLY;
+    assert(sqlfs_proc_create(0, "/group/held", 0644, &fi) == 0);
+    assert(sqlfs_proc_write(0, "/group/held", "1111", 4, 0, &fi) == 4);
+    assert(sqlfs_proc_write(0, "/group/held", "2222", 4, 4, &fi) == 4);
+    assert(stored_size(database_filename, "/group/held") == 0);
+    assert(sqlfs_proc_write(0, "/group/held", expected, sizeof(expected), 8, &fi) == sizeof(expected));
+    assert(stored_size(database_filename, "/group/held") == 8 + sizeof(expected));
+    assert(sqlfs_proc_write(0, "/group/held", "3333", 4, 8 + sizeof(expected), &fi) == 4);
+    assert(sqlfs_proc_unlink(0, "/group/other") == -ENOENT);
+    assert(stored_size(database_filename, "/group/held") == 12 + sizeof(expected));
+    assert(sqlfs_proc_release(0, "/group/held", &fi) == 0);
+    assert(sqlfs_proc_read(0, "/group/held", buf, 8, 0, &fi) == 8);
+    assert(!memcmp(buf, "11112222", 8));
+    sqlfs_detach_thread();
+    assert(sqlfs_destroy() == 0);
+    assert(sqlfs_set_write_back(0, 0));
+    assert(sqlfs_set_group_commit(0, 0));
+    printf("passed\n");
+}
+
 void run_standard_tests(sqlfs_t* sqlfs)
 {
     int size;
@@ -491,6 +1710,7 @@ void run_standard_tests(sqlfs_t* sqlfs)
     test_mkdir_with_sleep(sqlfs);
     test_mkdir_without_sleep(sqlfs);
     test_mkdir_to_make_nested_dirs(sqlfs);
+    test_deep_path(sqlfs);
     test_rmdir(sqlfs);
     test_create_file_with_small_string(sqlfs);
     test_create_file_and_read(sqlfs);
@@ -502,6 +1722,14 @@ void run_standard_tests(sqlfs_t* sqlfs)
     test_open_creat(sqlfs);
     test_open_creat_trunc(sqlfs);
     test_open_creat_trunc_existing(sqlfs);
+    test_rename_keeps_data(sqlfs);
+    test_readdir_direct_children(sqlfs);
+    test_small_file_grows(sqlfs);
+    test_overwrite_in_place(sqlfs);
+    test_read_blocks(sqlfs);
+    test_readv_writev(sqlfs);
+    test_import_tree(sqlfs);
+    test_export_tar(sqlfs);
 
     for (size=10; size < 1000001; size *= 10) {
         test_write_n_bytes(sqlfs, size);
@@ -596,4 +1824,543 @@ void run_perf_tests(sqlfs_t *sqlfs, int testsize)
 }
 
 
+/* writes and reads back testsize bytes in 64k chunks on a new database */
+static void perf_write_read(const char *db, const char *label, char *data, int testsize)
+{
+    int i, chunk = 65536;
+    struct timeval tstart, tstop;
+    sqlfs_t *sqlfs = 0;
+    struct fuse_file_info fi = { 0 };
+    struct stat sb;
+    double t;
+
+    unlink(db);
+    assert(sqlfs_open(db, &sqlfs));
+
+    gettimeofday(&tstart, NULL);
+    for (i = 0; i + chunk <= testsize; i += chunk)
+        sqlfs_proc_write(sqlfs, "/perf", data + i, chunk, i, &fi);
+    gettimeofday(&tstop, NULL);
+    t = TIMING(tstart,tstop);
+    printf("* %s: write \t%f seconds \t%.1f MB/s\n", label, t, testsize / t / 1048576);
+
+    gettimeofday(&tstart, NULL);
+    for (i = 0; i + chunk <= testsize; i += chunk)
+        sqlfs_proc_read(sqlfs, "/perf", data + i, chunk, i, &fi);
+    gettimeofday(&tstop, NULL);
+    t = TIMING(tstart,tstop);
+    printf("* %s: read \t%f seconds \t%.1f MB/s\n", label, t, testsize / t / 1048576);
+
+    assert(sqlfs_close(sqlfs));
+    stat(db, &sb);
+    printf("* %s: database size \t%ld KiB\n", label, (long) sb.st_size / 1024);
+    unlink(db);
+}
+
+/* throughput of the same workload on databases created with different
+ * block sizes */
+void run_block_size_perf_tests(const char *database_filename, int testsize)
+{
+    static const size_t block_sizes[] = { 4096, 8192, 32768, 65536, 262144, 0 };
+    int i;
+    size_t bs;
+    char db[PATH_MAX], label[64];
+    char *randomdata = malloc(testsize);
+
+    for (i = 0; i < testsize; ++i)
+        randomdata[i] = rand();
+    printf("block size sweep, %d bytes in 65536 byte chunks ------------------------------\n",
+           testsize);
+    for (bs = 0; block_sizes[bs]; bs++) {
+        snprintf(db, sizeof(db), "%s-%zu", database_filename, block_sizes[bs]);
+        snprintf(label, sizeof(label), "%zu byte blocks", block_sizes[bs]);
+        assert(sqlfs_set_block_size(block_sizes[bs]));
+        perf_write_read(db, label, randomdata, testsize);
+    }
+    assert(sqlfs_set_block_size(BLOCK_SIZE));
+    free(randomdata);
+}
+
+/* sequential reads of a large file in big chunks */
+void run_sequential_read_perf_tests(const char *database_filename, int testsize)
+{
+    static const int chunks[] = { 65536, 1048576, 4194304, 0 };
+    int i, c;
+    char db[PATH_MAX];
+    char *data = malloc(testsize), *buf = malloc(chunks[2]);
+    struct timeval tstart, tstop;
+    sqlfs_t *sqlfs = 0;
+    struct fuse_file_info fi = { 0 };
+    double t;
+
+    for (i = 0; i < testsize; ++i)
+        data[i] = rand();
+    snprintf(db, sizeof(db), "%s-seq", database_filename);
+    unlink(db);
+    assert(sqlfs_open(db, &sqlfs));
+    assert(sqlfs_proc_write(sqlfs, "/perf", data, testsize, 0, &fi) == testsize);
+    printf("sequential reads of %d bytes ------------------------------\n", testsize);
+    for (c = 0; chunks[c]; c++)
+    {
+        gettimeofday(&tstart, NULL);
+        for (i = 0; i + chunks[c] <= testsize; i += chunks[c])
+            assert(sqlfs_proc_read(sqlfs, "/perf", buf, chunks[c], i, &fi) == chunks[c]);
+        gettimeofday(&tstop, NULL);
+        t = TIMING(tstart,tstop);
+        printf("* read in %d byte chunks \t%f seconds \t%.1f MB/s\n",
+               chunks[c], t, testsize / t / 1048576);
+    }
+    assert(!memcmp(buf, data + testsize - chunks[2], chunks[2]));
+    assert(sqlfs_close(sqlfs));
+    unlink(db);
+    free(data);
+    free(buf);
+}
+
+/* writes of whole blocks at block boundaries, to a new file and over the
+ * blocks already written */
+void run_aligned_write_perf_tests(const char *database_filename, int testsize)
+{
+    int i, pass, chunk = 1048576;
+    char db[PATH_MAX];
+    char *data = malloc(testsize), *buf = malloc(chunk);
+    struct timeval tstart, tstop;
+    sqlfs_t *sqlfs = 0;
+    struct fuse_file_info fi = { 0 };
+    double t;
+
+    for (i = 0; i < testsize; ++i)
+        data[i] = rand();
+    snprintf(db, sizeof(db), "%s-aligned", database_filename);
+    unlink(db);
+    assert(sqlfs_open(db, &sqlfs));
+    printf("aligned writes of %d bytes in %d byte chunks ------------------------------\n",
+           testsize, chunk);
+    for (pass = 0; pass < 2; pass++)
+    {
+        for (i = 0; pass && (i < testsize); ++i)
+            data[i]++;
+        gettimeofday(&tstart, NULL);
+        for (i = 0; i + chunk <= testsize; i += chunk)
+            assert(sqlfs_proc_write(sqlfs, "/perf", data + i, chunk, i, &fi) == chunk);
+        gettimeofday(&tstop, NULL);
+        t = TIMING(tstart,tstop);
+        printf("* %s \t%f seconds \t%.1f MB/s\n", pass ? "overwrite" : "new file",
+               t, testsize / t / 1048576);
+    }
+    assert(sqlfs_proc_read(sqlfs, "/perf", buf, chunk, testsize - chunk, &fi) == chunk);
+    assert(!memcmp(buf, data + testsize - chunk, chunk));
+    assert(sqlfs_close(sqlfs));
+    unlink(db);
+    free(data);
+    free(buf);
+}
+
+/* write throughput of many small files and of one large file */
+void run_write_throughput_perf_tests(const char *database_filename, int testsize)
+{
+    static const int small_sizes[] = { 100, 4096, 65536, 0 };
+    int i, c, n, chunk = 65536;
+    char db[PATH_MAX], path[PATH_MAX];
+    char *data = malloc(testsize);
+    struct timeval tstart, tstop;
+    sqlfs_t *sqlfs = 0;
+    struct fuse_file_info fi = { 0 };
+    double t;
+
+    for (i = 0; i < testsize; ++i)
+        data[i] = rand();
+    snprintf(db, sizeof(db), "%s-write", database_filename);
+    printf("write throughput ------------------------------\n");
+    for (c = 0; small_sizes[c]; c++)
+    {
+        n = testsize / small_sizes[c];
+        if (n > 5000)
+            n = 5000;
+        unlink(db);
+        assert(sqlfs_open(db, &sqlfs));
+        assert(sqlfs_proc_mkdir(sqlfs, "/small", 0777) == 0);
+        gettimeofday(&tstart, NULL);
+        for (i = 0; i < n; i++)
+        {
+            snprintf(path, sizeof(path), "/small/%d", i);
+            assert(sqlfs_proc_write(sqlfs, path, data, small_sizes[c], 0, &fi) == small_sizes[c]);
+        }
+        gettimeofday(&tstop, NULL);
+        t = TIMING(tstart,tstop);
+        printf("* %d files of %d bytes \t%f seconds \t%.0f files/s \t%.1f MB/s\n",
+               n, small_sizes[c], t, n / t, (double) n * small_sizes[c] / t / 1048576);
+        assert(sqlfs_close(sqlfs));
+    }
+    unlink(db);
+    assert(sqlfs_open(db, &sqlfs));
+    gettimeofday(&tstart, NULL);
+    for (i = 0; i + chunk <= testsize; i += chunk)
+        assert(sqlfs_proc_write(sqlfs, "/large", data + i, chunk, i, &fi) == chunk);
+    gettimeofday(&tstop, NULL);
+    t = TIMING(tstart,tstop);
+    printf("* 1 file of %d bytes in %d byte writes \t%f seconds \t%.1f MB/s\n",
+           testsize, chunk, t, testsize / t / 1048576);
+    assert(sqlfs_close(sqlfs));
+    unlink(db);
+    free(data);
+}
+
+#define READER_FILES 64
+#define READER_OPS 2000
+
+static void *reader_thread(void *arg)
+{
+    int i;
+    char path[PATH_MAX], buf[4096];
+    struct stat sb;
+    struct fuse_file_info fi = { 0 };
+    unsigned int seed = (unsigned int) (size_t) arg;
+    /* each thread gets its own connection through the thread API */
+    for (i = 0; i < READER_OPS; i++)
+    {
+        snprintf(path, sizeof(path), "/readers/%d", rand_r(&seed) % READER_FILES);
+        assert(sqlfs_proc_getattr(0, path, &sb) == 0);
+        assert(sqlfs_proc_read(0, path, buf, sizeof(buf), 0, &fi) == sizeof(buf));
+    }
+    return 0;
+}
+
+/* getattr and read throughput with 1 to 16 threads reading at once, with
+ * the access time recorded on every read and never */
+void run_reader_scaling_perf_tests(const char *database_filename)
+{
+    static const int modes[] = { SQLFS_ATIME_STRICT, SQLFS_ATIME_NOATIME };
+    static const char *mode_names[] = { "strictatime", "noatime" };
+    pthread_t threads[16];
+    int i, m, n;
+    char db[PATH_MAX], path[PATH_MAX], buf[4096];
+    struct timeval tstart, tstop;
+    sqlfs_t *sqlfs = 0;
+    struct fuse_file_info fi = { 0 };
+    double t;
+
+    snprintf(db, sizeof(db), "%s-readers", database_filename);
+    unlink(db);
+    assert(sqlfs_open(db, &sqlfs));
+    assert(sqlfs_proc_mkdir(sqlfs, "/readers", 0777) == 0);
+    for (i = 0; i < READER_FILES; i++)
+    {
+        snprintf(path, sizeof(path), "/readers/%d", i);
+        assert(sqlfs_proc_write(sqlfs, path, buf, sizeof(buf), 0, &fi) == sizeof(buf));
+    }
+    assert(sqlfs_close(sqlfs));
+    printf("concurrent readers, getattr + 4096 byte read ------------------------------\n");
+    for (m = 0; m < 2; m++)
+    {
+        assert(sqlfs_set_atime_mode(modes[m]));
+        assert(sqlfs_init(db) == 0);
+        for (n = 1; n <= 16; n *= 2)
+        {
+            gettimeofday(&tstart, NULL);
+            for (i = 0; i < n; i++)
+                assert(pthread_create(&threads[i], NULL, reader_thread, (void *) (size_t) (i + 1)) == 0);
+            for (i = 0; i < n; i++)
+                pthread_join(threads[i], NULL);
+            gettimeofday(&tstop, NULL);
+            t = TIMING(tstart,tstop);
+            printf("* %s, %2d threads \t%f seconds \t%.0f ops/s\n",
+                   mode_names[m], n, t, 2.0 * n * READER_OPS / t);
+        }
+        assert(sqlfs_destroy() == 0);
+    }
+    assert(sqlfs_set_atime_mode(SQLFS_ATIME_STRICT));
+    unlink(db);
+}
+
+/* throughput and database size with and without compression, on data
+ * resembling JSON preferences */
+void run_codec_perf_tests(const char *database_filename, int testsize)
+{
+    int n = 0;
+    char db[PATH_MAX];
+    char *textdata = malloc(testsize + 128);
+
+    while (n < testsize)
+        n += sprintf(textdata + n, "{\"key%d\": \"value %d\", \"enabled\": %s},\n",
+                     n % 997, rand() % 100, (n % 3) ? "true" : "false");
+    printf("compression, %d bytes of text in 65536 byte chunks ------------------------------\n",
+           testsize);
+    snprintf(db, sizeof(db), "%s-codec", database_filename);
+    assert(sqlfs_set_codec(SQLFS_CODEC_NONE));
+    perf_write_read(db, "no compression", textdata, testsize);
+    assert(sqlfs_set_codec(SQLFS_CODEC_LZF));
+    perf_write_read(db, "lzf compression", textdata, testsize);
+    assert(sqlfs_set_codec(SQLFS_CODEC_NONE));
+    free(textdata);
+}
+
+
+#define WRITER_OPS 200
+
+static void *writer_thread(void *arg)
+{
+    int i, n = (int) (size_t) arg;
+    char path[PATH_MAX], record[100];
+    struct fuse_file_info fi = { 0 };
+    snprintf(path, sizeof(path), "/writer-%d", n);
+    memset(record, 'a' + n % 26, sizeof(record));
+    for (i = 0; i < WRITER_OPS; i++)
+        assert(sqlfs_proc_write(0, path, record, sizeof(record), i * sizeof(record), &fi)
+               == sizeof(record));
+    return 0;
+}
+
+/* 100 byte writes from 1 to 64 threads through the thread API, each
+ * committing on its own and with group commit */
+void run_writer_scaling_perf_tests(const char *database_filename)
+{
+    static const size_t max_ops[] = { 0, 64, 64 };
+    static const unsigned int delays[] = { 0, 0, 1 };
+    static const char *mode_names[] = { "own commits", "group commit", "group commit, 1 ms" };
+    pthread_t threads[64];
+    int i, m, n;
+    char db[PATH_MAX];
+    struct timeval tstart, tstop;
+    double t;
+
+    snprintf(db, sizeof(db), "%s-writers", database_filename);
+    printf("concurrent writers, 100 byte writes ------------------------------\n");
+    assert(sqlfs_set_atime_mode(SQLFS_ATIME_NOATIME));
+    for (m = 0; m < 3; m++)
+    {
+        assert(sqlfs_set_group_commit(max_ops[m], delays[m]));
+        for (n = 1; n <= 64; n *= 2)
+        {
+            unlink(db);
+            assert(sqlfs_init(db) == 0);
+            gettimeofday(&tstart, NULL);
+            for (i = 0; i < n; i++)
+                assert(pthread_create(&threads[i], NULL, writer_thread, (void *) (size_t) i) == 0);
+            for (i = 0; i < n; i++)
+                pthread_join(threads[i], NULL);
+            gettimeofday(&tstop, NULL);
+            t = TIMING(tstart,tstop);
+            printf("* %s, %2d threads \t%f seconds \t%.0f ops/s\n",
+                   mode_names[m], n, t, (double) n * WRITER_OPS / t);
+            assert(sqlfs_destroy() == 0);
+        }
+    }
+    assert(sqlfs_set_group_commit(0, 0));
+    assert(sqlfs_set_atime_mode(SQLFS_ATIME_STRICT));
+    unlink(db);
+}
+
+
+#define IMPORT_DIRS 20
+#define IMPORT_FILES_PER_DIR 250
+
+/* removes the synthetic host tree of run_import_perf_tests() */
+static void remove_host_tree(const char *host)
+{
+    char path[PATH_MAX];
+    int d, f;
+    for (d = 0; d < IMPORT_DIRS; d++)
+    {
+        for (f = 0; f < IMPORT_FILES_PER_DIR; f++)
+        {
+            snprintf(path, sizeof(path), "%s/d%d/f%d", host, d, f);
+            unlink(path);
+        }
+        snprintf(path, sizeof(path), "%s/d%d", host, d);
+        rmdir(path);
+    }
+    rmdir(host);
+}
+
+/* seeding a database from a host tree of small and medium files, with a
+ * loop of sqlfs_proc_mkdir() and sqlfs_proc_write() and with
+ * sqlfs_import_tree() */
+void run_import_perf_tests(const char *database_filename)
+{
+    static const int sizes[] = { 100, 1000, 4096, 20000, 100000 };
+    static const int threads[] = { 1, 4, 0 };
+    int d, f, i, n, total = 0;
+    char db[PATH_MAX], host[PATH_MAX], path[PATH_MAX], dest[PATH_MAX];
+    char *data = malloc(100000);
+    struct timeval tstart, tstop;
+    sqlfs_t *sqlfs = 0;
+    struct fuse_file_info fi = { 0 };
+    double t;
+
+    for (i = 0; i < 100000; ++i)
+        data[i] = rand();
+    snprintf(db, sizeof(db), "%s-import", database_filename);
+    snprintf(host, sizeof(host), "%s-import-host", database_filename);
+    remove_host_tree(host);
+    assert(mkdir(host, 0755) == 0);
+    for (d = 0; d < IMPORT_DIRS; d++)
+    {
+        snprintf(path, sizeof(path), "%s/d%d", host, d);
+        assert(mkdir(path, 0755) == 0);
+        for (f = 0; f < IMPORT_FILES_PER_DIR; f++)
+        {
+            snprintf(path, sizeof(path), "d%d/f%d", d, f);
+            write_host_file(host, path, data, sizes[f % 5]);
+            total += sizes[f % 5];
+        }
+    }
+    n = IMPORT_DIRS * IMPORT_FILES_PER_DIR;
+    printf("importing %d files in %d directories, %d bytes ------------------------------\n",
+           n, IMPORT_DIRS, total);
+
+    unlink(db);
+    assert(sqlfs_open(db, &sqlfs));
+    gettimeofday(&tstart, NULL);
+    assert(sqlfs_proc_mkdir(sqlfs, "/seed", 0755) == 0);
+    for (d = 0; d < IMPORT_DIRS; d++)
+    {
+        snprintf(dest, sizeof(dest), "/seed/d%d", d);
+        assert(sqlfs_proc_mkdir(sqlfs, dest, 0755) == 0);
+        for (f = 0; f < IMPORT_FILES_PER_DIR; f++)
+        {
+            FILE *file;
+            snprintf(path, sizeof(path), "%s/d%d/f%d", host, d, f);
+            file = fopen(path, "r");
+            assert(file);
+            i = fread(data, 1, 100000, file);
+            fclose(file);
+            snprintf(dest, sizeof(dest), "/seed/d%d/f%d", d, f);
+            assert(sqlfs_proc_write(sqlfs, dest, data, i, 0, &fi) == i);
+        }
+    }
+    gettimeofday(&tstop, NULL);
+    t = TIMING(tstart,tstop);
+    printf("* sqlfs_proc_mkdir() and sqlfs_proc_write() \t%f seconds \t%.0f files/s \t%.1f MB/s\n",
+           t, n / t, total / t / 1048576);
+    assert(sqlfs_close(sqlfs));
+
+    for (i = 0; threads[i]; i++)
+    {
+        sqlfs_import_opts opts = { threads[i], 0, 0, 0, 0 };
+        unlink(db);
+        assert(sqlfs_open(db, &sqlfs));
+        gettimeofday(&tstart, NULL);
+        assert(sqlfs_import_tree(sqlfs, host, "/seed", &opts) == 0);
+        gettimeofday(&tstop, NULL);
+        assert(opts.files == (size_t) n && opts.bytes == (size_t) total);
+        t = TIMING(tstart,tstop);
+        printf("* sqlfs_import_tree(), %d threads \t%f seconds \t%.0f files/s \t%.1f MB/s\n",
+               threads[i], t, n / t, total / t / 1048576);
+        assert(sqlfs_close(sqlfs));
+    }
+    unlink(db);
+    remove_host_tree(host);
+    free(data);
+}
+
+
+struct export_walk
+{
+    sqlfs_t *sqlfs;
+    char *buf;
+    int fd, files;
+    size_t bytes;
+    char names[IMPORT_FILES_PER_DIR + 2][64];
+    int count;
+};
+
+static int export_walk_filler(void *buf, const char *name, const struct stat *st, off_t off)
+{
+    struct export_walk *w = buf;
+    if (strcmp(name, ".") && strcmp(name, ".."))
+        snprintf(w->names[w->count++], sizeof(w->names[0]), "%s", name);
+    return 0;
+}
+
+/* reads every file below path, listing a directory before going into it */
+static void export_walk(struct export_walk *w, const char *path)
+{
+    char child[PATH_MAX];
+    struct stat sb;
+    struct fuse_file_info fi = { 0 };
+    int i, n, count;
+    char (*names)[64];
+
+    w->count = 0;
+    assert(sqlfs_proc_readdir(w->sqlfs, path, w, export_walk_filler, 0, &fi) == 0);
+    count = w->count;
+    names = malloc(sizeof(w->names[0]) * count);
+    memcpy(names, w->names, sizeof(w->names[0]) * count);
+    for (i = 0; i < count; i++)
+    {
+        snprintf(child, sizeof(child), "%s/%s", path, names[i]);
+        assert(sqlfs_proc_getattr(w->sqlfs, child, &sb) == 0);
+        if (S_ISDIR(sb.st_mode))
+            export_walk(w, child);
+        else
+        {
+            off_t offset = 0;
+            while ((n = sqlfs_proc_read(w->sqlfs, child, w->buf, 65536, offset, &fi)) > 0)
+            {
+                assert(write(w->fd, w->buf, n) == n);
+                offset += n;
+            }
+            w->files++;
+            w->bytes += offset;
+        }
+    }
+    free(names);
+}
+
+/* backing up a tree by walking it with sqlfs_proc_readdir() and reading
+ * every file, and with sqlfs_export_tar() */
+void run_export_perf_tests(const char *database_filename)
+{
+    static const int sizes[] = { 100, 1000, 4096, 20000, 100000 };
+    int d, f, i, n = IMPORT_DIRS * IMPORT_FILES_PER_DIR;
+    char db[PATH_MAX], path[PATH_MAX];
+    char *data = malloc(100000);
+    struct timeval tstart, tstop;
+    struct export_walk w;
+    struct fuse_file_info fi = { 0 };
+    double t;
+
+    for (i = 0; i < 100000; ++i)
+        data[i] = rand();
+    snprintf(db, sizeof(db), "%s-export", database_filename);
+    unlink(db);
+    memset(&w, 0, sizeof(w));
+    assert(sqlfs_open(db, &w.sqlfs));
+    assert(sqlfs_proc_mkdir(w.sqlfs, "/backup", 0755) == 0);
+    for (d = 0; d < IMPORT_DIRS; d++)
+    {
+        snprintf(path, sizeof(path), "/backup/d%d", d);
+        assert(sqlfs_proc_mkdir(w.sqlfs, path, 0755) == 0);
+        for (f = 0; f < IMPORT_FILES_PER_DIR; f++)
+        {
+            snprintf(path, sizeof(path), "/backup/d%d/f%d", d, f);
+            assert(sqlfs_proc_write(w.sqlfs, path, data, sizes[f % 5], 0, &fi) == sizes[f % 5]);
+        }
+    }
+    printf("exporting %d files in %d directories to /dev/null ------------------------------\n",
+           n, IMPORT_DIRS);
+    w.fd = open("/dev/null", O_WRONLY);
+    assert(w.fd >= 0);
+    w.buf = data;
+    gettimeofday(&tstart, NULL);
+    export_walk(&w, "/backup");
+    gettimeofday(&tstop, NULL);
+    assert(w.files == n);
+    t = TIMING(tstart,tstop);
+    printf("* sqlfs_proc_readdir() and sqlfs_proc_read() \t%f seconds \t%.0f files/s \t%.1f MB/s\n",
+           t, n / t, w.bytes / t / 1048576);
+    gettimeofday(&tstart, NULL);
+    assert(sqlfs_export_tar(w.sqlfs, "/backup", w.fd) == 0);
+    gettimeofday(&tstop, NULL);
+    t = TIMING(tstart,tstop);
+    printf("* sqlfs_export_tar() \t%f seconds \t%.0f files/s \t%.1f MB/s\n",
+           t, n / t, w.bytes / t / 1048576);
+    close(w.fd);
+    assert(sqlfs_close(w.sqlfs));
+    unlink(db);
+    free(data);
+}
+
+
 /* -*- mode: c; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; c-file-style: "bsd"; -*- */